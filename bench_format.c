@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "collect_ipd_format.h"
+
+// Compare throughput of fprintf("%.17g") and the buffered writer with format_double
+// on values shaped like the CSV output (sums of IPDs and counts).
+// Usage: bench_format [CELLS]
+
+#define BENCH_STAT_NUM 9
+#define BENCH_BUFFER_SIZE (1 << 20)
+
+static double elapsed_seconds(struct timespec const *begin, struct timespec const *end) {
+    return (double)(end->tv_sec - begin->tv_sec) + (double)(end->tv_nsec - begin->tv_nsec) * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    size_t cells = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+    double *values = (double *)malloc(sizeof(double) * cells * BENCH_STAT_NUM);
+    if(values == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for values\n"); exit(EXIT_FAILURE); }
+    // Sums of float IPDs have all 17 significant digits, like real output
+    uint64_t state = 88172645463325252ULL;
+    for (size_t i = 0; i < cells * BENCH_STAT_NUM; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        values[i] = (double)(state >> 11) * 0x1.0p-53 * 1000.0;
+    }
+    FILE *fp = tmpfile();
+    if(fp == NULL) { fprintf(stderr, "ERROR: Cannot create a temporary file\n"); exit(EXIT_FAILURE); }
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (size_t i = 0; i < cells; i++) {
+        for (size_t j = 0; j < BENCH_STAT_NUM; j++) {
+            fprintf(fp, ",%.17g", values[i * BENCH_STAT_NUM + j]);
+        }
+        fprintf(fp, ",%zu\n", i);
+    }
+    fflush(fp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double printf_time = elapsed_seconds(&begin, &end);
+    size_t printf_bytes = (size_t)ftell(fp);
+    fclose(fp);
+
+    fp = tmpfile();
+    if(fp == NULL) { fprintf(stderr, "ERROR: Cannot create a temporary file\n"); exit(EXIT_FAILURE); }
+
+    struct buffered_writer writer;
+    init_buffered_writer(&writer, fp, BENCH_BUFFER_SIZE);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (size_t i = 0; i < cells; i++) {
+        for (size_t j = 0; j < BENCH_STAT_NUM; j++) {
+            write_char(&writer, ',');
+            write_double(&writer, values[i * BENCH_STAT_NUM + j]);
+        }
+        write_char(&writer, ',');
+        write_size(&writer, i);
+        write_char(&writer, '\n');
+    }
+    flush_buffered_writer(&writer);
+    fflush(fp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double writer_time = elapsed_seconds(&begin, &end);
+    free_buffered_writer(&writer);
+    size_t writer_bytes = (size_t)ftell(fp);
+
+    printf("cells: %zu\n", cells);
+    printf("fprintf:         %zu bytes, %.3f s, %.1f MB/s\n", printf_bytes, printf_time, printf_bytes / printf_time * 1e-6);
+    printf("buffered_writer: %zu bytes, %.3f s, %.1f MB/s\n", writer_bytes, writer_time, writer_bytes / writer_time * 1e-6);
+    fclose(fp);
+    free(values);
+    return 0;
+}
@@ -2,11 +2,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stddef.h>
+#include <stdint.h>
 //#include <errno.h>
 #include <argp.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include <hdf5_hl.h>
 #include "collect_ipd_module.h"
+#include "collect_ipd_output.h"
 
 // Prepare for argp_parse
 char const *argp_program_version = "collect_ipd 1.0";
@@ -15,22 +20,89 @@ static char doc[] = "collect_ipd -- a program to collect IPDs and model predicti
 static char args_doc[] = "FILE1 [FILE2...]";
 // Keys for options without short-options
 #define OPT_DATA_CONVERSION_ONLY 1
+#define OPT_THREADS 2
+#define OPT_SEGMENTS 3
+#define OPT_SIMD 4
+#define OPT_CHUNK_SIZE 5
+#define OPT_TABLE 6
+#define OPT_DENSE_LIMIT 7
+#define OPT_FORMAT 8
+#define OPT_SKIP_EMPTY 9
+#define OPT_MIN_COUNT 10
+#define OPT_ASYNC_OUTPUT 11
+#define OPT_PREFETCH 12
+#define OPT_AGGREGATE 13
+#define OPT_SHARD 14
+#define OPT_REGIONS 15
+#define OPT_MAX_MEMORY 16
+#define OPT_HUGE_PAGES 17
+#define OPT_KERNEL 18
+#define OPT_STATS 19
+#define OPT_VERBOSE 20
+// Values of --table
+#define TABLE_AUTO 0
+#define TABLE_DENSE 1
+#define TABLE_SPARSE 2
+// Values of --aggregate
+#define AGGREGATE_CHROMOSOME 0
+#define AGGREGATE_FILE 1
+#define AGGREGATE_ALL 2
 static struct argp_option options[] = {
-    {0, 'k', "LENGTH", 0, "Set the length of substring (k-mer) to LENGTH. Default: 2."},
+    {0, 'k', "LENGTHS", 0, "Set the length of substring (k-mer) to LENGTHS, a comma-separated list of lengths or ranges such as 1-6 or 2,4. All the lengths are collected in one pass over the data, and each of them is written to FILE with .kLENGTH inserted before the extension (out.csv to out.k3.csv), which requires --output for multiple lengths. Default: 2."},
     {0, 'l', "LENGTH", 0, "Set the outside length of k-mers. Default: 20."},
     {"chars", 'c', "STRING", 0, "Set the character set of the bases in the input kinetics file to STRING. Do not include delimiters. Default: ACGT"},
     {"threshold", 't', "INTEGER", 0, "Set the threshold of coverage of observed k-mers. Default: 25."},
     {"output", 'o', "FILE", 0, "Write IPD sum per k-mer to FILE. Default: standard output"},
+    {"format", OPT_FORMAT, "NAME", 0, "Write the output as CSV rows (csv), HDF5 data sets of [chromosome][kmer][offset] per statistic (hdf5), raw arrays of the same order in FILE.STATISTIC.f64 files (columnar), or accumulators to be summed by collect_ipd_merge (partial). Binary formats require --output. Default: csv"},
+    {"stats", OPT_STATS, "LIST", 0, "Collect and write only the statistics in LIST, a comma-separated list of ipd (ipd_sum and ipd_sq_sum), ipd_log2 (log2_ipd_sum and log2_ipd_sq_sum), pred (prediction_sum and prediction_sq_sum), pred_log2 (log2_prediction_sum and log2_prediction_sq_sum) or all. count is always written. Data sets and log2 values not needed by them are not read or computed, and partial files hold 0 for the others. Default: all"},
+    {"shard", OPT_SHARD, "I/N", 0, "Process only the chromosomes assigned to the I-th of N shards (0 <= I < N), where the c-th chromosome of the f-th file is assigned to the shard (f + c) mod N. Results are written in the partial format to be summed by collect_ipd_merge. Default: 0/1"},
+    {"regions", OPT_REGIONS, "BED", 0, "Read and collect only the intervals in the BED file, each with the positions around it needed by k-mers and their outside. IPD is collected for the k-mers whose last base in the direction of their strand is in an interval, and chromosomes without intervals are skipped. Default: whole chromosomes"},
+    {"aggregate", OPT_AGGREGATE, "UNIT", 0, "Write one table per chromosome (chromosome), per input file (file) or for all the input files (all). Tables of file and all are written with the chromosome \"*\", and all also with the file index \"*\" (the maximum of uint64 in binary formats). Default: chromosome"},
+    {"threads", OPT_THREADS, "INTEGER", 0, "Process up to INTEGER chromosomes at the same time. The chromosomes of all the input files are taken from one list, where long chromosomes are taken first when the others would wait for them at the end, and the results are written in the order of files and chromosomes. Chromosomes with more than 1 / INTEGER of all the positions are split into parts taken separately, whose sums are merged before writing and may differ from those of one thread by rounding errors. Each thread holds its own accumulators. Default: 1"},
+    {"segments", OPT_SEGMENTS, "INTEGER", 0, "Split each chromosome into INTEGER segments processed by separate threads. This multiplies the number of threads and accumulators. Default: 1"},
+    {"chunk-size", OPT_CHUNK_SIZE, "INTEGER", 0, "Read each strand of chromosomes in chunks of INTEGER positions with the overlap needed by k-mers and their outside, so that memory does not depend on the length of chromosomes. 0 reads whole chromosomes at once. Default: 0"},
+    {"skip-empty", OPT_SKIP_EMPTY, 0, 0, "Write only the cells observed at least once in CSV. Same as --min-count 1"},
+    {"min-count", OPT_MIN_COUNT, "INTEGER", 0, "Write only the cells observed at least INTEGER times in CSV. 0 writes all the cells. Default: 0"},
+    {"async-output", OPT_ASYNC_OUTPUT, 0, 0, "Write the results of each chromosome in a separate thread while the next chromosome is processed. Each thread holds one more set of accumulators for the results being written"},
+    {"prefetch", OPT_PREFETCH, "DEPTH", 0, "Read chromosomes, or chunks of them with --chunk-size, in a separate thread up to DEPTH ahead of processing, continuing into the next file. Each of DEPTH buffers holds a whole chromosome or a chunk. 0 reads data when it is processed. Default: 0"},
+    {"table", OPT_TABLE, "NAME", 0, "Hold sums per k-mer in a dense table of all k-mers (dense), a hash table of observed k-mers (sparse), or choose one of them automatically (auto). Auto chooses sparse if dense tables exceed --dense-limit or have more k-mers than the positions of input files. Default: auto"},
+    {"max-memory", OPT_MAX_MEMORY, "MEGABYTES", 0, "Fit the estimated peak memory of accumulators and chromosome buffers in MEGABYTES by choosing sparse tables for --table auto, a chunk size unless --chunk-size is given, and fewer prefetched loads, threads and segments, or exit immediately with the estimate if they cannot fit. 0 sets no limit. Default: 0"},
+    {"huge-pages", OPT_HUGE_PAGES, 0, 0, "Align the buffers of chromosomes, which are reused across chromosomes and files, to huge pages and advise the kernel to back them by transparent huge pages"},
+    {"verbose", OPT_VERBOSE, 0, 0, "Report the estimated peak memory and the kind of tables chosen for each length of k-mers"},
+    {"dense-limit", OPT_DENSE_LIMIT, "MEGABYTES", 0, "Upper limit of the total size of dense tables for --table auto. Default: 1024"},
+    {"simd", OPT_SIMD, "NAME", 0, "Use instructions up to NAME (none, sse4 or avx2) to accumulate values, if the CPU supports them. Default: avx2"},
+    {"kernel", OPT_KERNEL, "NAME", 0, "Collect IPD with the kernels compiled for common k and outside lengths (k of 1 to 6 and -l 10 or 20 with 4 chars) when they match (specialized), or always with the kernel for any k and outside length (generic). Both give the same results. Default: specialized"},
     {0}
 };
 struct arguments {
     char **file_paths;
     size_t file_num;
-    size_t k;
+    // Lengths of k-mers in ascending order without duplicates
+    size_t *ks;
+    size_t k_num;
     size_t outside_length;
     char *chars;
     size_t coverage_threshold;
     char *output_path;
+    size_t thread_num;
+    size_t segment_num;
+    int simd_level;
+    int specialized_kernels;
+    size_t chunk_size;
+    int table;
+    size_t dense_limit;
+    int format;
+    size_t min_count;
+    int stats;
+    int async_output;
+    size_t prefetch_depth;
+    int aggregate;
+    size_t shard_index;
+    size_t shard_num;
+    char *regions_path;
+    size_t max_memory;
+    int huge_pages;
+    int verbose;
 };
 // According to the manual of argp, the return type should be errno_t,
 // but I couldn't use it in my environment.
@@ -40,11 +112,9 @@ static int parse_opt(int key, char *arg, struct argp_state *state){
     long lparsed;
     switch(key){
         case 'k':
-            lparsed = strtol(arg, &remain, 10);
-            if(arg[0] == '\0' || remain[0] != '\0' || lparsed <= 0){
+            if(!parse_k_list(arg, &arguments->ks, &arguments->k_num)){
                 fprintf(stderr, "ERROR: Invalid argument for k\n"); argp_usage(state);
             }
-            arguments->k = lparsed;
             break;
         case 'l':
             lparsed = strtol(arg, &remain, 10);
@@ -66,6 +136,145 @@ static int parse_opt(int key, char *arg, struct argp_state *state){
         case 'o':
             arguments->output_path = arg;
             break;
+        case OPT_THREADS:
+            lparsed = strtol(arg, &remain, 10);
+            if(arg[0] == '\0' || remain[0] != '\0' || lparsed <= 0){
+                fprintf(stderr, "ERROR: Invalid argument for threads\n"); argp_usage(state);
+            }
+            arguments->thread_num = lparsed;
+            break;
+        case OPT_SEGMENTS:
+            lparsed = strtol(arg, &remain, 10);
+            if(arg[0] == '\0' || remain[0] != '\0' || lparsed <= 0){
+                fprintf(stderr, "ERROR: Invalid argument for segments\n"); argp_usage(state);
+            }
+            arguments->segment_num = lparsed;
+            break;
+        case OPT_CHUNK_SIZE:
+            lparsed = strtol(arg, &remain, 10);
+            if(arg[0] == '\0' || remain[0] != '\0' || lparsed < 0){
+                fprintf(stderr, "ERROR: Invalid argument for chunk-size\n"); argp_usage(state);
+            }
+            arguments->chunk_size = lparsed;
+            break;
+        case OPT_FORMAT:
+            if(strcmp(arg, "csv") == 0){
+                arguments->format = FORMAT_CSV;
+            }else if(strcmp(arg, "hdf5") == 0){
+                arguments->format = FORMAT_HDF5;
+            }else if(strcmp(arg, "columnar") == 0){
+                arguments->format = FORMAT_COLUMNAR;
+            }else if(strcmp(arg, "partial") == 0){
+                arguments->format = FORMAT_PARTIAL;
+            }else{
+                fprintf(stderr, "ERROR: Invalid argument for format\n"); argp_usage(state);
+            }
+            break;
+        case OPT_SKIP_EMPTY:
+            if(arguments->min_count == 0){
+                arguments->min_count = 1;
+            }
+            break;
+        case OPT_MIN_COUNT:
+            lparsed = strtol(arg, &remain, 10);
+            if(arg[0] == '\0' || remain[0] != '\0' || lparsed < 0){
+                fprintf(stderr, "ERROR: Invalid argument for min-count\n"); argp_usage(state);
+            }
+            arguments->min_count = lparsed;
+            break;
+        case OPT_ASYNC_OUTPUT:
+            arguments->async_output = 1;
+            break;
+        case OPT_HUGE_PAGES:
+            arguments->huge_pages = 1;
+            break;
+        case OPT_VERBOSE:
+            arguments->verbose = 1;
+            break;
+        case OPT_PREFETCH:
+            lparsed = strtol(arg, &remain, 10);
+            if(arg[0] == '\0' || remain[0] != '\0' || lparsed < 0){
+                fprintf(stderr, "ERROR: Invalid argument for prefetch\n"); argp_usage(state);
+            }
+            arguments->prefetch_depth = lparsed;
+            break;
+        case OPT_SHARD:
+            lparsed = strtol(arg, &remain, 10);
+            if(remain == arg || remain[0] != '/' || lparsed < 0){
+                fprintf(stderr, "ERROR: Invalid argument for shard\n"); argp_usage(state);
+            }
+            arguments->shard_index = lparsed;
+            arg = remain + 1;
+            lparsed = strtol(arg, &remain, 10);
+            if(remain == arg || remain[0] != '\0' || lparsed <= 0 || arguments->shard_index >= (size_t)lparsed){
+                fprintf(stderr, "ERROR: Invalid argument for shard\n"); argp_usage(state);
+            }
+            arguments->shard_num = lparsed;
+            break;
+        case OPT_REGIONS:
+            arguments->regions_path = arg;
+            break;
+        case OPT_MAX_MEMORY:
+            lparsed = strtol(arg, &remain, 10);
+            if(arg[0] == '\0' || remain[0] != '\0' || lparsed < 0){
+                fprintf(stderr, "ERROR: Invalid argument for max-memory\n"); argp_usage(state);
+            }
+            arguments->max_memory = lparsed;
+            break;
+        case OPT_AGGREGATE:
+            if(strcmp(arg, "chromosome") == 0){
+                arguments->aggregate = AGGREGATE_CHROMOSOME;
+            }else if(strcmp(arg, "file") == 0){
+                arguments->aggregate = AGGREGATE_FILE;
+            }else if(strcmp(arg, "all") == 0){
+                arguments->aggregate = AGGREGATE_ALL;
+            }else{
+                fprintf(stderr, "ERROR: Invalid argument for aggregate\n"); argp_usage(state);
+            }
+            break;
+        case OPT_TABLE:
+            if(strcmp(arg, "auto") == 0){
+                arguments->table = TABLE_AUTO;
+            }else if(strcmp(arg, "dense") == 0){
+                arguments->table = TABLE_DENSE;
+            }else if(strcmp(arg, "sparse") == 0){
+                arguments->table = TABLE_SPARSE;
+            }else{
+                fprintf(stderr, "ERROR: Invalid argument for table\n"); argp_usage(state);
+            }
+            break;
+        case OPT_DENSE_LIMIT:
+            lparsed = strtol(arg, &remain, 10);
+            if(arg[0] == '\0' || remain[0] != '\0' || lparsed < 0){
+                fprintf(stderr, "ERROR: Invalid argument for dense-limit\n"); argp_usage(state);
+            }
+            arguments->dense_limit = lparsed;
+            break;
+        case OPT_SIMD:
+            if(strcmp(arg, "none") == 0){
+                arguments->simd_level = IPD_SIMD_NONE;
+            }else if(strcmp(arg, "sse4") == 0){
+                arguments->simd_level = IPD_SIMD_SSE4;
+            }else if(strcmp(arg, "avx2") == 0){
+                arguments->simd_level = IPD_SIMD_AVX2;
+            }else{
+                fprintf(stderr, "ERROR: Invalid argument for simd\n"); argp_usage(state);
+            }
+            break;
+        case OPT_STATS:
+            if(!parse_stat_list(arg, &arguments->stats)){
+                fprintf(stderr, "ERROR: Invalid argument for stats\n"); argp_usage(state);
+            }
+            break;
+        case OPT_KERNEL:
+            if(strcmp(arg, "specialized") == 0){
+                arguments->specialized_kernels = 1;
+            }else if(strcmp(arg, "generic") == 0){
+                arguments->specialized_kernels = 0;
+            }else{
+                fprintf(stderr, "ERROR: Invalid argument for kernel\n"); argp_usage(state);
+            }
+            break;
         case ARGP_KEY_ARG:
             arguments->file_num++;
             arguments->file_paths = (char **)realloc(arguments->file_paths, sizeof(char *) * arguments->file_num);
@@ -76,6 +285,22 @@ static int parse_opt(int key, char *arg, struct argp_state *state){
             if(state->arg_num < 1){
                 fprintf(stderr, "ERROR: Too few arguments\n"); argp_usage(state);
             }
+            // Results of a shard are summed with those of the other shards. shard_num is 0 without --shard.
+            if(arguments->shard_num > 0){
+                if(arguments->format != FORMAT_CSV && arguments->format != FORMAT_PARTIAL){
+                    fprintf(stderr, "ERROR: --shard writes the partial format\n"); argp_usage(state);
+                }
+                arguments->format = FORMAT_PARTIAL;
+            }else{
+                arguments->shard_num = 1;
+            }
+            if(arguments->k_num == 0){
+                parse_k_list("2", &arguments->ks, &arguments->k_num);
+            }
+            // Each length of k-mers is written to its own file
+            if(arguments->k_num > 1 && arguments->output_path == NULL){
+                fprintf(stderr, "ERROR: Multiple lengths of k-mers require --output\n"); argp_usage(state);
+            }
             break;
         default:
             return ARGP_ERR_UNKNOWN;
@@ -84,220 +309,1694 @@ static int parse_opt(int key, char *arg, struct argp_state *state){
 }
 static struct argp argp = {options, parse_opt, args_doc, doc};
 
-// Write IPD data per k-mer
-// Column: k-mer index, k-mer string, position (1 == start of k-mer), chromosome name, IPD sum, squared IPD sum, model prediction sum, squared model prediction sum, count
-void write_ipd_by_kmer(size_t const k, size_t const outside_length, size_t const chars_size, char const *chars, char const *chromosome_name, size_t const file_idx,
-        double const *tMean_sum, double const *tMean_sq_sum, double const *tMean_log2_sum, double const *tMean_log2_sq_sum,
-        double const *prediction_sum, double const *prediction_sq_sum, double const *prediction_log2_sum, double const *prediction_log2_sq_sum, size_t const *count,
-        int const print_header, FILE *output) {
-    size_t kmers_size = (size_t)(pow(chars_size, k) + 0.5);
-    size_t total_length = k + 2 * outside_length;
-    char *kmer_string = (char *)malloc((k + 1) * sizeof(char));
-    if(kmer_string == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for kmer_string\n"); exit(EXIT_FAILURE); }
-    kmer_string[k] = '\0';
-    if(print_header == 1) {
-        fprintf(output, "kmer_string,kmer_number,position,chromosome,file_index,ipd_sum,ipd_sq_sum,log2_ipd_sum,log2_ipd_sq_sum,prediction_sum,prediction_sq_sum,log2_prediction_sum,log2_prediction_sq_sum,count\n");
-    }
-    for (size_t kmer = 0; kmer < kmers_size; ++kmer) {
-        size_t kmer_tmp = kmer;
-        for (int i = (int)k - 1; i >= 0; --i) {
-            kmer_string[i] = chars[kmer_tmp % chars_size];
-            kmer_tmp /= chars_size;
-        }
-        for (size_t i = 0; i < total_length; ++i) {
-            size_t idx = kmer * total_length + i;
-            fprintf(output, "%s,%zu,%d,%s,%zu,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%zu\n",
-                    kmer_string, kmer, (int)i - (int)outside_length + 1, chromosome_name, file_idx, tMean_sum[idx], tMean_sq_sum[idx], tMean_log2_sum[idx], tMean_log2_sq_sum[idx],
-                    prediction_sum[idx], prediction_sq_sum[idx], prediction_log2_sum[idx], prediction_log2_sq_sum[idx], count[idx]);
-        }
-    }
-    free(kmer_string);
+// Kinetics data sets of one chromosome.
+// The data sets interleave the positive and negative strands (x_1 y_1 x_2 y_2 ... x_n y_n).
+// Each buffer holds the loaded part of strand_num strands from first_strand, one after another,
+// i.e. a part of the positive strand (x_i ... x_j) and/or that of the negative strand (y_j ... y_i), so that both strands are ordered from their own 5' end.
+struct chromosome_data {
+    char *name;
+    hsize_t dim;
+    // Length of each strand, i.e. dim / 2
+    size_t strand_length;
+    // Paths of the data sets, which point into path_buf
+    char *tMean_name;
+    char *base_name;
+    char *modelPrediction_name;
+    char *coverage_name;
+    char *path_buf;
+    size_t path_capacity;
+    // Loaded strands (0: positive, 1: negative)
+    int first_strand;
+    int strand_num;
+    // Loaded part [loaded_begin, loaded_end) in the coordinates of the positive strand
+    size_t loaded_begin;
+    size_t loaded_end;
+    // Number of elements each buffer can hold.
+    // Buffers are kept by close_chromosome and reused for the next chromosome, so that they grow to the largest load.
+    size_t capacity;
+    float *tMean_buf;
+    // Bases encoded by encode_bases
+    uint8_t *base_buf;
+    float *modelPrediction_buf;
+    unsigned int *coverage_buf;
+    // Values computed from the data sets by precompute_ipd_values
+    double *tMean_log2_buf;
+    double *prediction_log2_buf;
+    unsigned char *flag_buf;
+};
+
+// Size of transparent huge pages on x86-64
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+// Whether buffers reused across chromosomes are backed by transparent huge pages, set by --huge-pages
+static int use_huge_pages = 0;
+
+// Statistics collected, set by --stats. Buffers of the data sets and log2 values used only by the others are not allocated.
+static int collected_stats = IPD_STAT_ALL;
+
+// Allocate a buffer of size bytes reused across chromosomes.
+// With use_huge_pages, buffers of at least HUGE_PAGE_SIZE are aligned to it and advised to be backed by transparent huge pages,
+// which saves page faults and TLB misses on long chromosomes. The advice is only a hint, and failures are ignored.
+static void *alloc_reused_buffer(size_t const size){
+    if(!use_huge_pages || size < HUGE_PAGE_SIZE){
+        return malloc(size);
+    }
+    size_t rounded = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    void *buf = NULL;
+    if(posix_memalign(&buf, HUGE_PAGE_SIZE, rounded) != 0){
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(buf, rounded, MADV_HUGEPAGE);
+#endif
+    return buf;
+}
+
+// Interleaved values read by read_strands, which grow to the largest read and are reused by all the reads
+static void *interleaved_buf = NULL;
+static size_t interleaved_capacity = 0;
+
+static void free_interleaved_buffer(void){
+    free(interleaved_buf);
+    interleaved_buf = NULL;
+    interleaved_capacity = 0;
     return;
 }
 
-void collect_ipd_by_kmer_from_hdf5(char const *file_path, size_t const file_index, size_t const k, size_t const outside_length,
-        size_t const chars_size, char const *chars, size_t const kmers_size, size_t const coverage_threshold, FILE *output,
-        double *tMean_sum, double *tMean_sq_sum, double *tMean_log2_sum, double *tMean_log2_sq_sum,
-        double *prediction_sum, double *prediction_sq_sum, double *prediction_log2_sum, double *prediction_log2_sq_sum, size_t *count){
-    if(sizeof(hsize_t) < sizeof(size_t)){
-        fprintf(stderr, "WARNING: sizeof(hsize_t) == %zu < sizeof(size_t) == %zu: the result may be incorrect\n", sizeof(hsize_t), sizeof(size_t));
+// Read the elements [begin, end) of each strand in the coordinates of the positive strand from a data set into buf,
+// which receives end - begin elements of elem_size bytes of strand_num strands from first_strand.
+// A contiguous hyperslab is read and then split, because strided hyperslab selections are much slower in HDF5.
+// HDF5 library is not always thread-safe, so callers must serialize calls of this function, which also share interleaved_buf.
+static herr_t read_strands(hid_t const file_id, char const *dataset_name, hid_t const mem_type_id, size_t const elem_size,
+        hsize_t const begin, hsize_t const end, int const first_strand, int const strand_num, void *buf){
+    hsize_t n = end - begin;
+    if(2 * n * elem_size > interleaved_capacity){
+        free(interleaved_buf);
+        interleaved_capacity = 2 * n * elem_size;
+        interleaved_buf = alloc_reused_buffer(interleaved_capacity);
+        if(interleaved_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for reading %s\n", dataset_name); exit(EXIT_FAILURE); }
+    }
+    void *interleaved = interleaved_buf;
+    hid_t dset_id = H5Dopen(file_id, dataset_name, H5P_DEFAULT);
+    if(dset_id < 0) { return -1; }
+    hid_t file_space_id = H5Dget_space(dset_id);
+    hsize_t start = 2 * begin;
+    hsize_t count = 2 * n;
+    hid_t mem_space_id = H5Screate_simple(1, &count, NULL);
+    herr_t hstatus = H5Sselect_hyperslab(file_space_id, H5S_SELECT_SET, &start, NULL, &count, NULL);
+    if(hstatus >= 0){
+        hstatus = H5Dread(dset_id, mem_type_id, mem_space_id, file_space_id, H5P_DEFAULT, interleaved);
+    }
+    H5Sclose(mem_space_id);
+    H5Sclose(file_space_id);
+    H5Dclose(dset_id);
+    void *strand_bufs[2] = {NULL, NULL};
+    for(int j = 0; j < strand_num; j++){
+        strand_bufs[first_strand + j] = (char *)buf + j * n * elem_size;
+    }
+    split_strands(interleaved, elem_size, n, strand_bufs[0], strand_bufs[1]);
+    return hstatus;
+}
+
+// Name of the i-th chromosome in file_id, to be freed by the caller.
+// HDF5 library is not always thread-safe, so callers must serialize calls of this function.
+static char *get_chromosome_name(hid_t const file_id, size_t const i){
+    ssize_t name_size = H5Lget_name_by_idx(file_id, "/", H5_INDEX_NAME, H5_ITER_NATIVE, i, NULL, 0, H5P_DEFAULT);
+    if(name_size < 0) { fprintf(stderr, "ERROR: Cannot get name by idx: %zu\n", i); exit(EXIT_FAILURE); }
+    if(name_size >= SIZE_MAX / 2) { fprintf(stderr, "Name is too long: %zd\n", name_size); exit(EXIT_FAILURE); }
+    // Note: sizeof(char) == 1
+    char *name = (char *)malloc(name_size + 1);
+    if(name == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for name\n"); exit(EXIT_FAILURE); }
+    H5Lget_name_by_idx(file_id, "/", H5_INDEX_NAME, H5_ITER_NATIVE, i, name, name_size + 1, H5P_DEFAULT);
+    return name;
+}
+
+// Open the i-th chromosome in file_id and check its data sets without reading them.
+// chromosome must be initialized by init_chromosome_buffers, and its buffers are kept for load_chromosome.
+// HDF5 library is not always thread-safe, so callers must serialize calls of this function.
+static void open_chromosome(hid_t const file_id, size_t const i, struct chromosome_data *chromosome){
+    char *name = get_chromosome_name(file_id, i);
+    size_t name_size = strlen(name);
+    //printf("%s\n", name);
+    // Make dataset names to access the datasets, one after another in path_buf
+    char const *tMean = "tMean";
+    char const *base = "base";
+    char const *modelPrediction = "modelPrediction";
+    char const *coverage = "coverage";
+    size_t path_size = 4 * (name_size + 3) + strlen(tMean) + strlen(base) + strlen(modelPrediction) + strlen(coverage);
+    if(path_size > chromosome->path_capacity){
+        free(chromosome->path_buf);
+        chromosome->path_buf = (char *)malloc(path_size);
+        if(chromosome->path_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for path_buf\n"); exit(EXIT_FAILURE); }
+        chromosome->path_capacity = path_size;
+    }
+    // dataset: tMean
+    char *tMean_name = chromosome->path_buf;
+    sprintf(tMean_name, "/%s/%s", name, tMean);
+    int rank = 0;
+    H5LTget_dataset_ndims(file_id,tMean_name,&rank);
+    if(rank != 1) { fprintf(stderr, "ERROR: Rank is not 1; observed: %d, path: %s\n", rank, tMean_name); exit(EXIT_FAILURE); }
+    hid_t tMean_dset_id = H5Dopen(file_id, tMean_name, H5P_DEFAULT);
+    if(tMean_dset_id < 0) { fprintf(stderr, "ERROR: Failure in opening %s\n", tMean_name); exit(EXIT_FAILURE); }
+    hid_t tMean_dtype_id = H5Dget_type(tMean_dset_id);
+    if(H5Tequal(tMean_dtype_id, H5T_NATIVE_FLOAT) <= 0) { fprintf(stderr, "ERROR: Dataset tMean is not H5T_NATIVE_FLOAT type. Check using h5ls.\n"); exit(EXIT_FAILURE); }
+    H5Tclose(tMean_dtype_id);
+    H5Dclose(tMean_dset_id);
+    hsize_t tMean_dim = 0;
+    H5LTget_dataset_info(file_id,tMean_name,&tMean_dim,NULL,NULL);
+    fprintf(stderr, "INFO: chromosome: %s, length: %llu\n", name, tMean_dim);
+    if(tMean_dim % 2 != 0){ fprintf(stderr, "ERROR: length of input kinetics data must be even\n"); exit(EXIT_FAILURE); }
+    // dataset: base
+    char *base_name = tMean_name + strlen(tMean_name) + 1;
+    sprintf(base_name, "/%s/%s", name, base);
+    H5LTget_dataset_ndims(file_id,base_name,&rank);
+    if(rank != 1) { fprintf(stderr, "ERROR: Rank is not 1; observed: %d, path: %s\n", rank, base_name); exit(EXIT_FAILURE); }
+    hid_t base_dset_id = H5Dopen(file_id, base_name, H5P_DEFAULT);
+    if(base_dset_id < 0) { fprintf(stderr, "ERROR: Failure in opening %s\n", base_name); exit(EXIT_FAILURE); }
+    hid_t base_dtype_id = H5Dget_type(base_dset_id);
+    if(H5Tget_class(base_dtype_id) != H5T_STRING) { fprintf(stderr, "ERROR: Dataset base is not H5T_STRING class. Check the input file or PacBio specification.\n"); exit(EXIT_FAILURE); }
+    size_t base_len = H5Tget_size(base_dtype_id);
+    H5Tclose(base_dtype_id);
+    H5Dclose(base_dset_id);
+    if(base_len != 1) { fprintf(stderr, "ERROR: Length of base string is not 1; observed: %zu (Dataset: %s)\n", base_len, base_name); exit(EXIT_FAILURE); }
+    hsize_t base_dim = 0;
+    H5LTget_dataset_info(file_id,base_name,&base_dim,NULL,NULL);
+    if(tMean_dim != base_dim) { fprintf(stderr, "ERROR: Dataset dimension is inconsistent\n"); exit(EXIT_FAILURE); }
+
+    // dataset: modelPrediction
+    char *modelPrediction_name = base_name + strlen(base_name) + 1;
+    sprintf(modelPrediction_name, "/%s/%s", name, modelPrediction);
+    H5LTget_dataset_ndims(file_id,modelPrediction_name,&rank);
+    if(rank != 1) { fprintf(stderr, "ERROR: Rank is not 1; observed: %d, path: %s\n", rank, modelPrediction_name); exit(EXIT_FAILURE); }
+    hid_t modelPrediction_dset_id = H5Dopen(file_id, modelPrediction_name, H5P_DEFAULT);
+    if(modelPrediction_dset_id < 0) { fprintf(stderr, "ERROR: Failure in opening %s\n", modelPrediction_name); exit(EXIT_FAILURE); }
+    hid_t modelPrediction_dtype_id = H5Dget_type(modelPrediction_dset_id);
+    if(H5Tequal(modelPrediction_dtype_id, H5T_NATIVE_FLOAT) <= 0) { fprintf(stderr, "ERROR: Dataset modelPrediction is not H5T_NATIVE_FLOAT type. Check using h5ls.\n"); exit(EXIT_FAILURE); }
+    H5Tclose(modelPrediction_dtype_id);
+    H5Dclose(modelPrediction_dset_id);
+    hsize_t modelPrediction_dim = 0;
+    H5LTget_dataset_info(file_id,modelPrediction_name,&modelPrediction_dim,NULL,NULL);
+    if(tMean_dim != modelPrediction_dim) { fprintf(stderr, "ERROR: Dataset dimension is inconsistent\n"); exit(EXIT_FAILURE); }
+
+    // dataset: coverage
+    char *coverage_name = modelPrediction_name + strlen(modelPrediction_name) + 1;
+    sprintf(coverage_name, "/%s/%s", name, coverage);
+    H5LTget_dataset_ndims(file_id,coverage_name,&rank);
+    if(rank != 1) { fprintf(stderr, "ERROR: Rank is not 1; observed: %d, path: %s\n", rank, coverage_name); exit(EXIT_FAILURE); }
+    hid_t coverage_dset_id = H5Dopen(file_id, coverage_name, H5P_DEFAULT);
+    if(coverage_dset_id < 0) { fprintf(stderr, "ERROR: Failure in opening %s\n", coverage_name); exit(EXIT_FAILURE); }
+    hid_t coverage_dtype_id = H5Dget_type(coverage_dset_id);
+    if(H5Tequal(coverage_dtype_id, H5T_NATIVE_UINT) <= 0) { fprintf(stderr, "ERROR: Dataset coverage is not H5T_NATIVE_UINT type. Check using h5ls.\n"); exit(EXIT_FAILURE); }
+    H5Tclose(coverage_dtype_id);
+    H5Dclose(coverage_dset_id);
+    hsize_t coverage_dim = 0;
+    H5LTget_dataset_info(file_id,coverage_name,&coverage_dim,NULL,NULL);
+    if(tMean_dim != coverage_dim) { fprintf(stderr, "ERROR: Dataset dimension is inconsistent\n"); exit(EXIT_FAILURE); }
+
+    chromosome->name = name;
+    chromosome->dim = tMean_dim;
+    chromosome->strand_length = tMean_dim / 2;
+    chromosome->tMean_name = tMean_name;
+    chromosome->base_name = base_name;
+    chromosome->modelPrediction_name = modelPrediction_name;
+    chromosome->coverage_name = coverage_name;
+    chromosome->first_strand = 0;
+    chromosome->strand_num = 0;
+    chromosome->loaded_begin = 0;
+    chromosome->loaded_end = 0;
+    return;
+}
+
+// Start with empty buffers and paths of data sets, which are reused across chromosomes and files
+static void init_chromosome_buffers(struct chromosome_data *chromosome){
+    chromosome->name = NULL;
+    chromosome->path_buf = NULL;
+    chromosome->path_capacity = 0;
+    chromosome->capacity = 0;
+    chromosome->tMean_buf = NULL;
+    chromosome->base_buf = NULL;
+    chromosome->modelPrediction_buf = NULL;
+    chromosome->coverage_buf = NULL;
+    chromosome->tMean_log2_buf = NULL;
+    chromosome->prediction_log2_buf = NULL;
+    chromosome->flag_buf = NULL;
+    return;
+}
+
+// Free the buffers, which can be enlarged again by reserve_chromosome_buffers
+static void free_chromosome_buffers(struct chromosome_data *chromosome){
+    free(chromosome->tMean_buf);
+    free(chromosome->base_buf);
+    free(chromosome->modelPrediction_buf);
+    free(chromosome->coverage_buf);
+    free(chromosome->tMean_log2_buf);
+    free(chromosome->prediction_log2_buf);
+    free(chromosome->flag_buf);
+    chromosome->tMean_buf = NULL;
+    chromosome->base_buf = NULL;
+    chromosome->modelPrediction_buf = NULL;
+    chromosome->coverage_buf = NULL;
+    chromosome->tMean_log2_buf = NULL;
+    chromosome->prediction_log2_buf = NULL;
+    chromosome->flag_buf = NULL;
+    chromosome->capacity = 0;
+    return;
+}
+
+// Free the buffers and the paths of data sets after all the chromosomes
+static void free_chromosome(struct chromosome_data *chromosome){
+    free_chromosome_buffers(chromosome);
+    free(chromosome->path_buf);
+    chromosome->path_buf = NULL;
+    chromosome->path_capacity = 0;
+    return;
+}
+
+// Enlarge the buffers to hold at least size elements in total, keeping them if they are large enough.
+// The contents are not kept, because every load overwrites them.
+static void reserve_chromosome_buffers(struct chromosome_data *chromosome, size_t const size){
+    if(size <= chromosome->capacity){
+        return;
+    }
+    free_chromosome_buffers(chromosome);
+    chromosome->capacity = size;
+    chromosome->tMean_buf = (float *)alloc_reused_buffer(sizeof(float) * size);
+    if(chromosome->tMean_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for tMean_buf\n"); exit(EXIT_FAILURE); }
+    chromosome->base_buf = (uint8_t *)alloc_reused_buffer(sizeof(uint8_t) * size);
+    if(chromosome->base_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for base_buf\n"); exit(EXIT_FAILURE); }
+    if(collected_stats & (IPD_STAT_PRED | IPD_STAT_PRED_LOG2)){
+        chromosome->modelPrediction_buf = (float *)alloc_reused_buffer(sizeof(float) * size);
+        if(chromosome->modelPrediction_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for modelPrediction_buf\n"); exit(EXIT_FAILURE); }
+    }
+    chromosome->coverage_buf = (unsigned int *)alloc_reused_buffer(sizeof(unsigned int) * size);
+    if(chromosome->coverage_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for coverage_buf\n"); exit(EXIT_FAILURE); }
+    if(collected_stats & IPD_STAT_IPD_LOG2){
+        chromosome->tMean_log2_buf = (double *)alloc_reused_buffer(sizeof(double) * size);
+        if(chromosome->tMean_log2_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for tMean_log2_buf\n"); exit(EXIT_FAILURE); }
+    }
+    if(collected_stats & IPD_STAT_PRED_LOG2){
+        chromosome->prediction_log2_buf = (double *)alloc_reused_buffer(sizeof(double) * size);
+        if(chromosome->prediction_log2_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for prediction_log2_buf\n"); exit(EXIT_FAILURE); }
+    }
+    chromosome->flag_buf = (unsigned char *)alloc_reused_buffer(sizeof(unsigned char) * size);
+    if(chromosome->flag_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for flag_buf\n"); exit(EXIT_FAILURE); }
+    return;
+}
+
+// Load the elements [begin, end) in the coordinates of the positive strand of strand_num strands from first_strand.
+// Bases are encoded by encode_bases with chars.
+// HDF5 library is not always thread-safe, so callers must serialize calls of this function.
+static void load_chromosome(hid_t const file_id, char const *chars, struct chromosome_data *chromosome,
+        int const first_strand, int const strand_num, size_t const begin, size_t const end){
+    if(begin > end || end > chromosome->strand_length || (end - begin) * strand_num > chromosome->capacity){
+        fprintf(stderr, "ERROR: Buffers are too small to load [%zu, %zu) of %s\n", begin, end, chromosome->name); exit(EXIT_FAILURE);
+    }
+    chromosome->first_strand = first_strand;
+    chromosome->strand_num = strand_num;
+    chromosome->loaded_begin = begin;
+    chromosome->loaded_end = end;
+    // An empty load of a chromosome without positions to collect
+    if(begin == end || strand_num == 0){
+        return;
     }
     herr_t hstatus;
-    hid_t file_id = H5Fopen(file_path, H5F_ACC_RDONLY, H5P_DEFAULT);
-    if(file_id < 0) { fprintf(stderr, "ERROR: Cannot open file in HDF5 format: %s\n", file_path); exit(EXIT_FAILURE); }
-    H5G_info_t ginfo;
-    H5Gget_info_by_name(file_id, "/", &ginfo, H5P_DEFAULT);
-    fprintf(stderr, "INFO: # chromosomes: %d\n", (int)ginfo.nlinks);
-    // Scan data sets for each chromosome
-    for (size_t i = 0; i < ginfo.nlinks; i++){
-        ssize_t name_size = H5Lget_name_by_idx(file_id, "/", H5_INDEX_NAME, H5_ITER_NATIVE, i, NULL, 0, H5P_DEFAULT);
-        //printf("%zd\n", name_size);
-        if(name_size < 0) { fprintf(stderr, "ERROR: Cannot get name by idx: %zu\n", i); exit(EXIT_FAILURE); }
-        if(name_size >= SIZE_MAX / 2) { fprintf(stderr, "Name is too long: %zd\n", name_size); exit(EXIT_FAILURE); }
-        // Note: sizeof(char) == 1
-        char *name = (char *)malloc(name_size + 1);
-        if(name == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for name\n"); exit(EXIT_FAILURE); }
-        H5Lget_name_by_idx(file_id, "/", H5_INDEX_NAME, H5_ITER_NATIVE, i, name, name_size + 1, H5P_DEFAULT);
-        //printf("%s\n", name);
-        // Make a dataset name to access the dataset
-        // dataset: tMean
-        char const *tMean = "tMean";
-        char *tMean_name = (char *)malloc(name_size + strlen(tMean) + 3);
-        if(tMean_name == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for tMean_name\n"); exit(EXIT_FAILURE); }
-        sprintf(tMean_name, "/%s/%s", name, tMean);
-        int rank = 0;
-        H5LTget_dataset_ndims(file_id,tMean_name,&rank);
-        if(rank != 1) { fprintf(stderr, "ERROR: Rank is not 1; observed: %d, path: %s\n", rank, tMean_name); exit(EXIT_FAILURE); }
-        hid_t tMean_dset_id = H5Dopen(file_id, tMean_name, H5P_DEFAULT);
-        if(tMean_dset_id < 0) { fprintf(stderr, "ERROR: Failure in opening %s\n", tMean_name); exit(EXIT_FAILURE); }
-        hid_t tMean_dtype_id = H5Dget_type(tMean_dset_id);
-        if(H5Tequal(tMean_dtype_id, H5T_NATIVE_FLOAT) <= 0) { fprintf(stderr, "ERROR: Dataset tMean is not H5T_NATIVE_FLOAT type. Check using h5ls.\n"); exit(EXIT_FAILURE); }
-        H5Tclose(tMean_dtype_id);
-        H5Dclose(tMean_dset_id);
-        hsize_t tMean_dim = 0;
-        H5LTget_dataset_info(file_id,tMean_name,&tMean_dim,NULL,NULL);
-        fprintf(stderr, "INFO: chromosome: %s, length: %llu\n", name, tMean_dim);
-        float *tMean_buf = (float *)malloc(sizeof(float) * tMean_dim);
-        if(tMean_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for tMean_buf\n"); exit(EXIT_FAILURE); }
-        hstatus = H5LTread_dataset_float(file_id, tMean_name, tMean_buf);
-        if(hstatus < 0) { fprintf(stderr, "ERROR: Failure in reading Dataset %s\n", tMean_name); exit(EXIT_FAILURE); }
-        //if(strcmp(name, "chrIV") == 0) printf("ret:%d, val:%f\n", ret, buf[28173040 - 2]);
-        // dataset: base
-        char const *base = "base";
-        char *base_name = (char *)malloc(name_size + strlen(base) + 3);
-        if(base_name == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for base_name\n"); exit(EXIT_FAILURE); }
-        sprintf(base_name, "/%s/%s", name, base);
-        H5LTget_dataset_ndims(file_id,base_name,&rank);
-        if(rank != 1) { fprintf(stderr, "ERROR: Rank is not 1; observed: %d, path: %s\n", rank, base_name); exit(EXIT_FAILURE); }
-        hid_t base_dset_id = H5Dopen(file_id, base_name, H5P_DEFAULT);
-        if(base_dset_id < 0) { fprintf(stderr, "ERROR: Failure in opening %s\n", base_name); exit(EXIT_FAILURE); }
-        hid_t base_dtype_id = H5Dget_type(base_dset_id);
-        if(H5Tget_class(base_dtype_id) != H5T_STRING) { fprintf(stderr, "ERROR: Dataset base is not H5T_STRING class. Check the input file or PacBio specification.\n"); exit(EXIT_FAILURE); }
-        size_t base_len = H5Tget_size(base_dtype_id);
-        H5Tclose(base_dtype_id);
-        if(base_len != 1) { fprintf(stderr, "ERROR: Length of base string is not 1; observed: %zu (Dataset: %s)\n", base_len, base_name); exit(EXIT_FAILURE); }
-        // Make room for null terminator. Now, base_len == 2
-        base_len++;
-        hsize_t base_dim = 0;
-        H5LTget_dataset_info(file_id,tMean_name,&base_dim,NULL,NULL);
-        if(tMean_dim != base_dim) { fprintf(stderr, "ERROR: Dataset dimension is inconsistent\n"); exit(EXIT_FAILURE); }
-        char **base_buf = (char **)malloc(base_dim * sizeof(char *));
-        if(base_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for base_buf\n"); exit(EXIT_FAILURE); }
-        base_buf[0] = (char *)malloc(base_dim * base_len);
-        if(base_buf[0] == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for base_buf[0]\n"); exit(EXIT_FAILURE); }
-        for(size_t j = 1; j < base_dim; j++) { base_buf[j] = base_buf[0] + j * base_len; }
-        hid_t base_memtype = H5Tcopy(H5T_C_S1);
-        H5Tset_size(base_memtype, base_len);
-        hstatus = H5Dread(base_dset_id, base_memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT, base_buf[0]);
-        //hstatus = H5LTread_dataset_string(file_id, base_name, base_buf[0]);
-        if(hstatus < 0) { fprintf(stderr, "ERROR: Failure in reading Dataset %s\n", base_name); exit(EXIT_FAILURE); }
-        //if(strcmp(name, "chrIV") == 0) printf("base:%.100s\n", base_buf[28173040 - 2]);
-        H5Tclose(base_memtype);
-        H5Dclose(base_dset_id);
-
-        // dataset: modelPrediction
-        float *modelPrediction_buf = NULL;
-        char const *modelPrediction = "modelPrediction";
-        char *modelPrediction_name = (char *)malloc(name_size + strlen(modelPrediction) + 3);
-        if(modelPrediction_name == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for modelPrediction_name\n"); exit(EXIT_FAILURE); }
-        sprintf(modelPrediction_name, "/%s/%s", name, modelPrediction);
-        H5LTget_dataset_ndims(file_id,modelPrediction_name,&rank);
-        if(rank != 1) { fprintf(stderr, "ERROR: Rank is not 1; observed: %d, path: %s\n", rank, modelPrediction_name); exit(EXIT_FAILURE); }
-        hid_t modelPrediction_dset_id = H5Dopen(file_id, modelPrediction_name, H5P_DEFAULT);
-        if(modelPrediction_dset_id < 0) { fprintf(stderr, "ERROR: Failure in opening %s\n", modelPrediction_name); exit(EXIT_FAILURE); }
-        hid_t modelPrediction_dtype_id = H5Dget_type(modelPrediction_dset_id);
-        if(H5Tequal(modelPrediction_dtype_id, H5T_NATIVE_FLOAT) <= 0) { fprintf(stderr, "ERROR: Dataset modelPrediction is not H5T_NATIVE_FLOAT type. Check using h5ls.\n"); exit(EXIT_FAILURE); }
-        H5Tclose(modelPrediction_dtype_id);
-        H5Dclose(modelPrediction_dset_id);
-        hsize_t modelPrediction_dim = 0;
-        H5LTget_dataset_info(file_id,modelPrediction_name,&modelPrediction_dim,NULL,NULL);
-        if(tMean_dim != modelPrediction_dim) { fprintf(stderr, "ERROR: Dataset dimension is inconsistent\n"); exit(EXIT_FAILURE); }
-        modelPrediction_buf = (float *)malloc(sizeof(float) * modelPrediction_dim);
-        if(modelPrediction_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for modelPrediction_buf\n"); exit(EXIT_FAILURE); }
-        hstatus = H5LTread_dataset_float(file_id, modelPrediction_name, modelPrediction_buf);
-        if(hstatus < 0) { fprintf(stderr, "ERROR: Failure in reading Dataset %s\n", modelPrediction_name); exit(EXIT_FAILURE); }
-        free(modelPrediction_name);
-
-        // dataset: coverage
-        unsigned int *coverage_buf = NULL;
-        char const *coverage = "coverage";
-        char *coverage_name = (char *)malloc(name_size + strlen(coverage) + 3);
-        if(coverage_name == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for coverage_name\n"); exit(EXIT_FAILURE); }
-        sprintf(coverage_name, "/%s/%s", name, coverage);
-        H5LTget_dataset_ndims(file_id,coverage_name,&rank);
-        if(rank != 1) { fprintf(stderr, "ERROR: Rank is not 1; observed: %d, path: %s\n", rank, coverage_name); exit(EXIT_FAILURE); }
-        hid_t coverage_dset_id = H5Dopen(file_id, coverage_name, H5P_DEFAULT);
-        if(coverage_dset_id < 0) { fprintf(stderr, "ERROR: Failure in opening %s\n", coverage_name); exit(EXIT_FAILURE); }
-        hid_t coverage_dtype_id = H5Dget_type(coverage_dset_id);
-        if(H5Tequal(coverage_dtype_id, H5T_NATIVE_UINT) <= 0) { fprintf(stderr, "ERROR: Dataset coverage is not H5T_NATIVE_UINT type. Check using h5ls.\n"); exit(EXIT_FAILURE); }
-        H5Tclose(coverage_dtype_id);
-        H5Dclose(coverage_dset_id);
-        hsize_t coverage_dim = 0;
-        H5LTget_dataset_info(file_id,coverage_name,&coverage_dim,NULL,NULL);
-        if(tMean_dim != coverage_dim) { fprintf(stderr, "ERROR: Dataset dimension is inconsistent\n"); exit(EXIT_FAILURE); }
-        coverage_buf = (unsigned int *)malloc(sizeof(unsigned int) * coverage_dim);
-        if(coverage_buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for coverage_buf\n"); exit(EXIT_FAILURE); }
-        hstatus = H5LTread_dataset(file_id, coverage_name, H5T_NATIVE_UINT, coverage_buf);
-        if(hstatus < 0) { fprintf(stderr, "ERROR: Failure in reading Dataset %s\n", coverage_name); exit(EXIT_FAILURE); }
-        free(coverage_name);
-
-        // Initialize tMean_sum and so on
-        size_t total_length = kmers_size * (k + 2 * outside_length);
-        if(total_length > SIZE_MAX / sizeof(double)) { fprintf(stderr, "ERROR: memset will overflow\n"); exit(EXIT_FAILURE); }
-        if(total_length > SIZE_MAX / sizeof(size_t)) { fprintf(stderr, "ERROR: memset will overflow\n"); exit(EXIT_FAILURE); }
-        memset(tMean_sum, 0, total_length * sizeof(double));
-        memset(tMean_sq_sum, 0, total_length * sizeof(double));
-        memset(tMean_log2_sum, 0, total_length * sizeof(double));
-        memset(tMean_log2_sq_sum, 0, total_length * sizeof(double));
-        memset(prediction_sum, 0, total_length * sizeof(double));
-        memset(prediction_sq_sum, 0, total_length * sizeof(double));
-        memset(prediction_log2_sum, 0, total_length * sizeof(double));
-        memset(prediction_log2_sq_sum, 0, total_length * sizeof(double));
-        memset(count, 0, total_length * sizeof(size_t));
+    hstatus = read_strands(file_id, chromosome->tMean_name, H5T_NATIVE_FLOAT, sizeof(float), begin, end, first_strand, strand_num, chromosome->tMean_buf);
+    if(hstatus < 0) { fprintf(stderr, "ERROR: Failure in reading Dataset %s\n", chromosome->tMean_name); exit(EXIT_FAILURE); }
+    // Read one character per base without null terminators, and encode them in place
+    hid_t base_memtype = H5Tcopy(H5T_C_S1);
+    H5Tset_size(base_memtype, 1);
+    H5Tset_strpad(base_memtype, H5T_STR_NULLPAD);
+    hstatus = read_strands(file_id, chromosome->base_name, base_memtype, 1, begin, end, first_strand, strand_num, chromosome->base_buf);
+    if(hstatus < 0) { fprintf(stderr, "ERROR: Failure in reading Dataset %s\n", chromosome->base_name); exit(EXIT_FAILURE); }
+    H5Tclose(base_memtype);
+    encode_bases(chars, (char const *)chromosome->base_buf, 1, (end - begin) * strand_num, chromosome->base_buf);
+    // modelPrediction is read only for the statistics of predictions
+    if(chromosome->modelPrediction_buf != NULL){
+        hstatus = read_strands(file_id, chromosome->modelPrediction_name, H5T_NATIVE_FLOAT, sizeof(float), begin, end, first_strand, strand_num, chromosome->modelPrediction_buf);
+        if(hstatus < 0) { fprintf(stderr, "ERROR: Failure in reading Dataset %s\n", chromosome->modelPrediction_name); exit(EXIT_FAILURE); }
+    }
+    hstatus = read_strands(file_id, chromosome->coverage_name, H5T_NATIVE_UINT, sizeof(unsigned int), begin, end, first_strand, strand_num, chromosome->coverage_buf);
+    if(hstatus < 0) { fprintf(stderr, "ERROR: Failure in reading Dataset %s\n", chromosome->coverage_name); exit(EXIT_FAILURE); }
+    return;
+}
+
+// Read the whole data sets of the i-th chromosome in file_id.
+// HDF5 library is not always thread-safe, so callers must serialize calls of this function.
+static void read_chromosome(hid_t const file_id, size_t const i, char const *chars, struct chromosome_data *chromosome){
+    open_chromosome(file_id, i, chromosome);
+    reserve_chromosome_buffers(chromosome, 2 * chromosome->strand_length);
+    load_chromosome(file_id, chars, chromosome, 0, 2, 0, chromosome->strand_length);
+    return;
+}
+
+// Free the name of a chromosome after it is processed, keeping the buffers for the next chromosome
+static void close_chromosome(struct chromosome_data *chromosome){
+    free(chromosome->name);
+    chromosome->name = NULL;
+    return;
+}
+
+// HDF5 library may not be thread-safe, so all the calls of it are serialized by this lock
+static pthread_mutex_t hdf5_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Whether the i-th chromosome of the file_index-th file is assigned to the shard_index-th of shard_num shards
+static inline int in_shard(size_t const file_index, size_t const i, size_t const shard_index, size_t const shard_num){
+    return ((file_index + i) % shard_num == shard_index) ? 1 : 0;
+}
+
+// A part of a chromosome read at once: [loaded_begin, loaded_end) of strand_num strands from first_strand,
+// whose IPD is collected for [begin, end)
+struct chromosome_load {
+    int first_strand;
+    int strand_num;
+    size_t begin;
+    size_t end;
+    size_t loaded_begin;
+    size_t loaded_end;
+};
+
+// Intervals of a chromosome given by --regions, sorted and merged so that no position is collected twice.
+// IPD is collected for the k-mers whose last base in the direction of their own strand is in one of the intervals,
+// i.e. the same partition of k-mers as segments, so intervals covering a whole chromosome give the same results as the chromosome.
+struct region_set {
+    char *name;
+    size_t num;
+    size_t *begins;
+    size_t *ends;
+};
+
+// Region sets of all the chromosomes in a BED file, sorted by name
+struct region_list {
+    size_t num;
+    struct region_set *sets;
+};
+
+// An interval of a BED file
+struct bed_interval {
+    char *name;
+    size_t begin;
+    size_t end;
+};
+
+static int compare_bed_interval(void const *a, void const *b){
+    struct bed_interval const *x = (struct bed_interval const *)a;
+    struct bed_interval const *y = (struct bed_interval const *)b;
+    int c = strcmp(x->name, y->name);
+    if(c != 0){
+        return c;
+    }
+    return (x->begin > y->begin) - (x->begin < y->begin);
+}
+
+// Read the first three columns (chromosome, 0-origin start and end) of the lines of a BED file.
+// Header lines (track, browser or #) and empty lines are skipped.
+static void read_regions(char const *path, struct region_list *regions){
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL) { fprintf(stderr, "ERROR: Cannot open file: %s\n", path); exit(EXIT_FAILURE); }
+    size_t interval_num = 0;
+    size_t interval_capacity = 16;
+    struct bed_interval *intervals = (struct bed_interval *)malloc(interval_capacity * sizeof(struct bed_interval));
+    if(intervals == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for regions\n"); exit(EXIT_FAILURE); }
+    char *line = NULL;
+    size_t line_capacity = 0;
+    size_t line_no = 0;
+    while(getline(&line, &line_capacity, fp) >= 0){
+        line_no++;
+        char *save;
+        char *name = strtok_r(line, " \t\r\n", &save);
+        if(name == NULL || name[0] == '#' || strcmp(name, "track") == 0 || strcmp(name, "browser") == 0){
+            continue;
+        }
+        char *begin = strtok_r(NULL, " \t\r\n", &save);
+        char *end = strtok_r(NULL, " \t\r\n", &save);
+        char *remain;
+        long long begin_parsed = (begin == NULL) ? -1 : strtoll(begin, &remain, 10);
+        if(begin == NULL || remain[0] != '\0' || begin_parsed < 0){ fprintf(stderr, "ERROR: Invalid start at line %zu of %s\n", line_no, path); exit(EXIT_FAILURE); }
+        long long end_parsed = (end == NULL) ? -1 : strtoll(end, &remain, 10);
+        if(end == NULL || remain[0] != '\0' || end_parsed < begin_parsed){ fprintf(stderr, "ERROR: Invalid end at line %zu of %s\n", line_no, path); exit(EXIT_FAILURE); }
+        if(interval_num == interval_capacity){
+            interval_capacity *= 2;
+            intervals = (struct bed_interval *)realloc(intervals, interval_capacity * sizeof(struct bed_interval));
+            if(intervals == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for regions\n"); exit(EXIT_FAILURE); }
+        }
+        intervals[interval_num].name = strdup(name);
+        if(intervals[interval_num].name == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for regions\n"); exit(EXIT_FAILURE); }
+        intervals[interval_num].begin = begin_parsed;
+        intervals[interval_num].end = end_parsed;
+        interval_num++;
+    }
+    free(line);
+    fclose(fp);
+    qsort(intervals, interval_num, sizeof(struct bed_interval), compare_bed_interval);
+    // One set per chromosome, merging overlapping and adjacent intervals
+    regions->num = 0;
+    regions->sets = (struct region_set *)malloc((interval_num + 1) * sizeof(struct region_set));
+    if(regions->sets == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for regions\n"); exit(EXIT_FAILURE); }
+    for(size_t x = 0; x < interval_num; ){
+        size_t set_end = x + 1;
+        while(set_end < interval_num && strcmp(intervals[x].name, intervals[set_end].name) == 0){
+            set_end++;
+        }
+        struct region_set *set = &regions->sets[regions->num++];
+        set->name = intervals[x].name;
+        set->num = 0;
+        set->begins = (size_t *)malloc((set_end - x) * sizeof(size_t));
+        set->ends = (size_t *)malloc((set_end - x) * sizeof(size_t));
+        if(set->begins == NULL || set->ends == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for regions\n"); exit(EXIT_FAILURE); }
+        for(size_t y = x; y < set_end; y++){
+            if(set->num > 0 && intervals[y].begin <= set->ends[set->num - 1]){
+                if(intervals[y].end > set->ends[set->num - 1]){
+                    set->ends[set->num - 1] = intervals[y].end;
+                }
+            }else{
+                set->begins[set->num] = intervals[y].begin;
+                set->ends[set->num] = intervals[y].end;
+                set->num++;
+            }
+            if(y > x){
+                free(intervals[y].name);
+            }
+        }
+        x = set_end;
+    }
+    free(intervals);
+    return;
+}
+
+// Region set of a chromosome, or NULL if the chromosome is not in the regions
+static struct region_set const *find_region_set(struct region_list const *regions, char const *name){
+    size_t lo = 0;
+    size_t hi = regions->num;
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(regions->sets[mid].name, name);
+        if(c == 0){
+            return &regions->sets[mid];
+        }
+        if(c < 0){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+static void free_regions(struct region_list *regions){
+    for(size_t x = 0; x < regions->num; x++){
+        free(regions->sets[x].name);
+        free(regions->sets[x].begins);
+        free(regions->sets[x].ends);
+    }
+    free(regions->sets);
+    return;
+}
+
+// Add the load of [begin, end) of strand_num strands from first_strand with halo positions on both sides to loads
+static void add_chromosome_load(struct chromosome_load **loads, size_t *load_num, size_t *load_capacity,
+        size_t const strand_length, size_t const halo, int const first_strand, int const strand_num, size_t const begin, size_t const end){
+    if(*load_num == *load_capacity){
+        *load_capacity = (*load_capacity == 0) ? 16 : 2 * *load_capacity;
+        *loads = (struct chromosome_load *)realloc(*loads, *load_capacity * sizeof(struct chromosome_load));
+        if(*loads == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for loads\n"); exit(EXIT_FAILURE); }
+    }
+    struct chromosome_load *load = &(*loads)[(*load_num)++];
+    load->first_strand = first_strand;
+    load->strand_num = strand_num;
+    load->begin = begin;
+    load->end = end;
+    load->loaded_begin = (begin > halo) ? begin - halo : 0;
+    load->loaded_end = (end + halo < strand_length) ? end + halo : strand_length;
+    return;
+}
+
+// Plan the loads of [begin, end) of a chromosome of strand_length positions, and return the array of *load_num loads to be freed by the caller.
+// Without regions (set == NULL), one load of both strands with chunk_size == 0,
+// otherwise the chunks of the positive strand followed by those of the negative strand, with halo positions on both sides of each chunk.
+// The negative strand is streamed from its own 5' end, i.e. from the last chunk in the coordinates of the positive strand.
+// With regions, one load of both strands per interval clipped to [begin, end), split into chunks of chunk_size if chunk_size > 0,
+// A chromosome without any position to collect has a single empty load, so that every chromosome has at least one load.
+static struct chromosome_load *plan_chromosome_loads(size_t const strand_length, size_t const begin, size_t const end, size_t const chunk_size, size_t const halo,
+        struct region_set const *set, size_t *load_num){
+    struct chromosome_load *loads = NULL;
+    size_t load_capacity = 0;
+    size_t n = strand_length;
+    *load_num = 0;
+    if(set != NULL){
+        for(size_t x = 0; x < set->num; x++){
+            size_t interval_end = (set->ends[x] < end) ? set->ends[x] : end;
+            for(size_t piece_begin = (set->begins[x] > begin) ? set->begins[x] : begin; piece_begin < interval_end; ){
+                size_t piece_end = (chunk_size > 0 && piece_begin + chunk_size < interval_end) ? piece_begin + chunk_size : interval_end;
+                add_chromosome_load(&loads, load_num, &load_capacity, n, halo, 0, 2, piece_begin, piece_end);
+                piece_begin = piece_end;
+            }
+        }
+    }else if(chunk_size == 0){
+        if(begin < end){
+            add_chromosome_load(&loads, load_num, &load_capacity, n, halo, 0, 2, begin, end);
+        }
+    }else{
+        size_t chunk_num = (end - begin + chunk_size - 1) / chunk_size;
+        for(size_t j = 0; j < 2 * chunk_num; j++){
+            int strand = (j < chunk_num) ? 0 : 1;
+            size_t chunk = (strand == 0) ? j : 2 * chunk_num - 1 - j;
+            size_t chunk_begin = begin + chunk * chunk_size;
+            add_chromosome_load(&loads, load_num, &load_capacity, n, halo, strand, 1, chunk_begin, (chunk_begin + chunk_size < end) ? chunk_begin + chunk_size : end);
+        }
+    }
+    if(*load_num == 0){
+        add_chromosome_load(&loads, load_num, &load_capacity, n, 0, 0, 0, 0, 0);
+    }
+    return loads;
+}
+
+// A chromosome to be processed, found by scan_inputs
+struct chromosome_task {
+    size_t file_index;
+    size_t chromosome_index;
+    // Length of each strand
+    size_t strand_length;
+    // Longest interval clipped to the chromosome with regions, otherwise the strand length
+    size_t span;
+    // Positions of both strands to collect, which estimate the time to process the chromosome
+    size_t positions;
+    // NULL, or the intervals of the chromosome
+    struct region_set const *set;
+    // Positions [begin, end) of the positive strand collected by this task and the opposite ones of the negative strand,
+    // which are the part-th of part_num successive parts of the chromosome split by split_long_tasks, or the whole chromosome
+    size_t begin;
+    size_t end;
+    size_t part;
+    size_t part_num;
+    // Whether a worker has taken the task, see take_task
+    int taken;
+};
+
+// Read-ahead of the chromosomes of tasks in a separate thread.
+// Loads are read in the order of order and plan_chromosome_loads into depth slots, whose buffers are reused.
+// Workers must take the tasks in the same order, and the position of a task in order is its sequence number.
+struct prefetcher {
+    hid_t const *file_ids;
+    struct chromosome_task const *tasks;
+    size_t const *order;
+    size_t task_num;
+    char const *chars;
+    size_t chunk_size;
+    size_t halo;
+    size_t depth;
+    struct prefetch_slot *slots;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+#define SLOT_FREE 0
+#define SLOT_LOADING 1
+#define SLOT_READY 2
+
+// chromosome holds only the name, the length and the loaded part. The name is owned by the consumer of the first load of the chromosome.
+struct prefetch_slot {
+    int state;
+    size_t seq;
+    size_t load;
+    struct chromosome_data chromosome;
+};
+
+static void *prefetch_chromosomes(void *arg){
+    struct prefetcher *prefetcher = (struct prefetcher *)arg;
+    // Paths of data sets of the chromosome being read, whose buffer is reused
+    struct chromosome_data opened;
+    init_chromosome_buffers(&opened);
+    for(size_t seq = 0; seq < prefetcher->task_num; seq++){
+        struct chromosome_task const *task = &prefetcher->tasks[prefetcher->order[seq]];
+        hid_t file_id = prefetcher->file_ids[task->file_index];
+        pthread_mutex_lock(&hdf5_mutex);
+        open_chromosome(file_id, task->chromosome_index, &opened);
+        pthread_mutex_unlock(&hdf5_mutex);
+        size_t load_num;
+        struct chromosome_load *loads = plan_chromosome_loads(opened.strand_length, task->begin, task->end, prefetcher->chunk_size, prefetcher->halo, task->set, &load_num);
+        for(size_t j = 0; j < load_num; j++){
+            // Wait for a free slot
+            pthread_mutex_lock(&prefetcher->mutex);
+            struct prefetch_slot *slot = NULL;
+            while(slot == NULL){
+                for(size_t x = 0; x < prefetcher->depth && slot == NULL; x++){
+                    if(prefetcher->slots[x].state == SLOT_FREE){
+                        slot = &prefetcher->slots[x];
+                    }
+                }
+                if(slot == NULL){
+                    pthread_cond_wait(&prefetcher->cond, &prefetcher->mutex);
+                }
+            }
+            slot->state = SLOT_LOADING;
+            pthread_mutex_unlock(&prefetcher->mutex);
+
+            struct chromosome_load const *load = &loads[j];
+            struct chromosome_data *chromosome = &slot->chromosome;
+            chromosome->name = opened.name;
+            chromosome->dim = opened.dim;
+            chromosome->strand_length = opened.strand_length;
+            chromosome->tMean_name = opened.tMean_name;
+            chromosome->base_name = opened.base_name;
+            chromosome->modelPrediction_name = opened.modelPrediction_name;
+            chromosome->coverage_name = opened.coverage_name;
+            reserve_chromosome_buffers(chromosome, (load->loaded_end - load->loaded_begin) * load->strand_num);
+            pthread_mutex_lock(&hdf5_mutex);
+            load_chromosome(file_id, prefetcher->chars, chromosome, load->first_strand, load->strand_num, load->loaded_begin, load->loaded_end);
+            pthread_mutex_unlock(&hdf5_mutex);
+
+            pthread_mutex_lock(&prefetcher->mutex);
+            slot->seq = seq;
+            slot->load = j;
+            slot->state = SLOT_READY;
+            pthread_cond_broadcast(&prefetcher->cond);
+            pthread_mutex_unlock(&prefetcher->mutex);
+        }
+        free(loads);
+        // The name is owned by the consumer
+        opened.name = NULL;
+    }
+    free_chromosome(&opened);
+    return NULL;
+}
+
+// Start reading the chromosomes of task_num tasks in the order of order in a separate thread
+static void start_prefetcher(struct prefetcher *prefetcher, hid_t const *file_ids, struct chromosome_task const *tasks, size_t const *order, size_t const task_num,
+        char const *chars, size_t const k, size_t const outside_length, size_t const chunk_size, size_t const depth){
+    prefetcher->file_ids = file_ids;
+    prefetcher->tasks = tasks;
+    prefetcher->order = order;
+    prefetcher->task_num = task_num;
+    prefetcher->chars = chars;
+    prefetcher->chunk_size = chunk_size;
+    prefetcher->halo = ipd_segment_halo(k, outside_length) / 2;
+    prefetcher->depth = depth;
+    prefetcher->slots = (struct prefetch_slot *)malloc(depth * sizeof(struct prefetch_slot));
+    if(prefetcher->slots == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for prefetch slots\n"); exit(EXIT_FAILURE); }
+    for(size_t x = 0; x < depth; x++){
+        prefetcher->slots[x].state = SLOT_FREE;
+        init_chromosome_buffers(&prefetcher->slots[x].chromosome);
+    }
+    pthread_mutex_init(&prefetcher->mutex, NULL);
+    pthread_cond_init(&prefetcher->cond, NULL);
+    if(pthread_create(&prefetcher->thread, NULL, prefetch_chromosomes, prefetcher) != 0){
+        fprintf(stderr, "ERROR: Cannot create thread\n"); exit(EXIT_FAILURE);
+    }
+    return;
+}
+
+// Wait for the j-th load of the chromosome of sequence number seq. It must be returned by release_prefetched before taking the next one.
+static struct prefetch_slot *take_prefetched(struct prefetcher *prefetcher, size_t const seq, size_t const j){
+    pthread_mutex_lock(&prefetcher->mutex);
+    struct prefetch_slot *slot = NULL;
+    while(slot == NULL){
+        for(size_t x = 0; x < prefetcher->depth && slot == NULL; x++){
+            struct prefetch_slot *candidate = &prefetcher->slots[x];
+            if(candidate->state == SLOT_READY && candidate->seq == seq && candidate->load == j){
+                slot = candidate;
+            }
+        }
+        if(slot == NULL){
+            pthread_cond_wait(&prefetcher->cond, &prefetcher->mutex);
+        }
+    }
+    pthread_mutex_unlock(&prefetcher->mutex);
+    return slot;
+}
+
+static void release_prefetched(struct prefetcher *prefetcher, struct prefetch_slot *slot){
+    pthread_mutex_lock(&prefetcher->mutex);
+    slot->state = SLOT_FREE;
+    pthread_cond_broadcast(&prefetcher->cond);
+    pthread_mutex_unlock(&prefetcher->mutex);
+    return;
+}
+
+// Wait for the thread, which finishes after all the loads are taken
+static void stop_prefetcher(struct prefetcher *prefetcher){
+    pthread_join(prefetcher->thread, NULL);
+    for(size_t x = 0; x < prefetcher->depth; x++){
+        free_chromosome_buffers(&prefetcher->slots[x].chromosome);
+    }
+    free(prefetcher->slots);
+    pthread_cond_destroy(&prefetcher->cond);
+    pthread_mutex_destroy(&prefetcher->mutex);
+    return;
+}
+
+// State shared by the threads processing the tasks [begin, end), which are taken by take_task.
+// Results of AGGREGATE_CHROMOSOME are written in the order of tasks, i.e. the order of files and chromosomes, whatever order they are processed in.
+struct hdf5_job {
+    // Input files indexed by file_index of tasks
+    hid_t const *file_ids;
+    // Chromosomes to process in the order of output
+    struct chromosome_task *tasks;
+    // Indices of tasks in the order of taking them; [begin, end) of order is a permutation of [begin, end)
+    size_t const *order;
+    size_t begin;
+    size_t end;
+    // Number of threads taking tasks
+    size_t thread_num;
+    // Lengths of k-mers collected in the same pass, in ascending order
+    size_t k_num;
+    size_t const *ks;
+    size_t outside_length;
+    size_t chars_size;
+    char const *chars;
+    size_t coverage_threshold;
+    size_t segment_num;
+    // Number of positions of each strand read at once, or 0 to read whole chromosomes
+    size_t chunk_size;
+    // AGGREGATE_CHROMOSOME clears and writes the accumulators per chromosome, and the others keep accumulating
+    int aggregate;
+    // Output per length of k-mers
+    struct ipd_output *outputs;
+    // Only for AGGREGATE_CHROMOSOME with split chromosomes: sums of the parts written so far of the chromosome being written, one table per length
+    struct ipd_table *merged;
+    // NULL, or the thread reading chromosomes ahead in the order of order
+    struct prefetcher *prefetcher;
+    // Position in order of the next task to take, skipping the tasks taken out of order
+    size_t next_position;
+    // First task not taken in the order of output
+    size_t next_untaken;
+    // Positions of the tasks not taken
+    size_t remaining_positions;
+    // Index of the next task to be written
+    size_t next_output;
+    // Only for AGGREGATE_CHROMOSOME: number of slots of results not written yet.
+    // A worker holds a slot from taking a task until its results are written, so that no more than thread_num tasks are ahead of the output.
+    size_t free_slots;
+    // Only for asynchronous output: results of tasks handed to the writer thread, indexed by task - begin,
+    // and the sets of spare accumulators (k_num tables each) not holding results
+    struct pending_output *pending;
+    struct ipd_table **free_spares;
+    size_t free_spare_num;
+    pthread_mutex_t mutex;
+    pthread_cond_t output_cond;
+};
+
+struct hdf5_worker {
+    struct hdf5_job *job;
+    // Buffers of the chromosome being processed, reused across chromosomes and files
+    struct chromosome_data *chromosome;
+    // segment_num sets of accumulators per length of k-mers, i.e. sums[kk * segment_num + j] for the j-th segment of ks[kk]
+    struct ipd_table *sums;
+};
+
+// Results of a task waiting for the writer thread. tables (one per length of k-mers) is NULL until the task is finished.
+struct pending_output {
+    char *name;
+    struct ipd_table *tables;
+};
+
+// A segment [begin, end) of the positive strand of a chromosome and the opposite segment of the negative strand.
+// Values of [precompute_begin, precompute_end), which includes [begin, end), are precomputed by this task.
+struct segment_task {
+    struct hdf5_job const *job;
+    struct chromosome_data *chromosome;
+    // Accumulators of this segment for ks[0], followed by those of the other lengths at intervals of segment_num
+    struct ipd_table *sums;
+    size_t begin;
+    size_t end;
+    size_t precompute_begin;
+    size_t precompute_end;
+};
+
+// Elements of a buffer from shift, keeping NULL for a buffer not allocated for the statistics collected
+static inline float *shift_floats(float *buf, size_t const shift){
+    return (buf != NULL) ? buf + shift : NULL;
+}
+
+static inline double *shift_doubles(double *buf, size_t const shift){
+    return (buf != NULL) ? buf + shift : NULL;
+}
+
+// Precompute values for the elements of a segment
+static void *precompute_segment(void *arg){
+    struct segment_task *task = (struct segment_task *)arg;
+    struct chromosome_data *chromosome = task->chromosome;
+    int check_outside_coverage = 1;
+    size_t m = chromosome->loaded_end - chromosome->loaded_begin;
+    size_t length = task->precompute_end - task->precompute_begin;
+    for(int j = 0; j < chromosome->strand_num; j++){
+        // The segment on the reversed negative strand starts from the end of the segment on the positive strand
+        size_t begin = j * m + ((chromosome->first_strand + j == 0) ?
+                task->precompute_begin - chromosome->loaded_begin : chromosome->loaded_end - task->precompute_end);
+        precompute_ipd_values(chromosome->tMean_buf + begin, shift_floats(chromosome->modelPrediction_buf, begin), chromosome->coverage_buf + begin, length,
+                task->job->coverage_threshold, check_outside_coverage,
+                shift_doubles(chromosome->tMean_log2_buf, begin), shift_doubles(chromosome->prediction_log2_buf, begin), chromosome->flag_buf + begin);
+    }
+    return NULL;
+}
+
+// Collect IPD of a segment for all the lengths of k-mers after all the loaded values are precomputed
+static void *process_segment(void *arg){
+    struct segment_task *task = (struct segment_task *)arg;
+    struct hdf5_job const *job = task->job;
+    struct chromosome_data const *chromosome = task->chromosome;
+    struct ipd_table *sums = task->sums;
+    size_t n = chromosome->strand_length;
+    size_t m = chromosome->loaded_end - chromosome->loaded_begin;
+    size_t strand_offset[2] = {chromosome->loaded_begin, n - chromosome->loaded_end};
+    size_t strand_begin[2] = {task->begin, n - task->end};
+    size_t strand_end[2] = {task->end, n - task->begin};
+    for(size_t kk = 0; kk < job->k_num; kk++){
+        for(int j = 0; j < chromosome->strand_num; j++){
+            int strand = chromosome->first_strand + j;
+            size_t shift = j * m;
+            collect_ipd_by_kmer_strand(job->ks[kk], job->chars, chromosome->tMean_buf + shift, shift_doubles(chromosome->tMean_log2_buf, shift), chromosome->base_buf + shift, n,
+                    &sums[kk * job->segment_num], shift_floats(chromosome->modelPrediction_buf, shift), shift_doubles(chromosome->prediction_log2_buf, shift), chromosome->flag_buf + shift, job->outside_length,
+                    strand_offset[strand], m, strand_begin[strand], strand_end[strand]);
+        }
+    }
+    return NULL;
+}
+
+// Run func for all the segments in parallel
+static void run_segments(void *(*func)(void *), struct segment_task *tasks, size_t const segment_num){
+    pthread_t threads[segment_num];
+    for(size_t i = 1; i < segment_num; i++){
+        if(pthread_create(&threads[i], NULL, func, &tasks[i]) != 0){
+            fprintf(stderr, "ERROR: Cannot create thread\n"); exit(EXIT_FAILURE);
+        }
+    }
+    func(&tasks[0]);
+    for(size_t i = 1; i < segment_num; i++){
+        pthread_join(threads[i], NULL);
+    }
+    return;
+}
+
+// Split [begin, end) of the loaded part of a chromosome into job->segment_num segments,
+// and add IPD of the i-th segment to sums[kk * segment_num + i] for each length ks[kk] in parallel.
+// The loaded part must cover the halo of [begin, end).
+static void collect_ipd_by_kmer_in_segments(struct hdf5_job const *job, struct chromosome_data *chromosome, size_t const begin, size_t const end,
+        struct ipd_table *sums){
+    size_t segment_num = job->segment_num;
+    size_t n = end - begin;
+    struct segment_task tasks[segment_num];
+    for(size_t i = 0; i < segment_num; i++){
+        tasks[i].job = job;
+        tasks[i].chromosome = chromosome;
+        tasks[i].sums = &sums[i];
+        tasks[i].begin = begin + n * i / segment_num;
+        tasks[i].end = begin + n * (i + 1) / segment_num;
+        // The first and last segments also precompute the halo
+        tasks[i].precompute_begin = (i == 0) ? chromosome->loaded_begin : tasks[i].begin;
+        tasks[i].precompute_end = (i + 1 == segment_num) ? chromosome->loaded_end : tasks[i].end;
+    }
+    // Every segment reads the precomputed values in its halo, so all of them must be ready before collecting IPD
+    run_segments(precompute_segment, tasks, segment_num);
+    run_segments(process_segment, tasks, segment_num);
+    return;
+}
+
+// Collect IPD of the chromosome of task into sums[kk * segment_num] for each length ks[kk], using job->segment_num sets of accumulators per length.
+// position is the position of task in job->order, which is the sequence number of its loads with the prefetcher.
+// Values read and precomputed once are shared by all the lengths, and the loads cover the halo of the longest one.
+// Unless job->aggregate is AGGREGATE_CHROMOSOME, IPD is added to the current values of sums without merging them into sums[0].
+// With job->chunk_size > 0, each strand is streamed in chunks of chunk_size positions plus the halo on both sides,
+// so that memory does not depend on the length of the chromosome.
+// With regions, only the intervals of the chromosome are read with the halo on both sides, see plan_chromosome_loads.
+// A part of a split chromosome is read in the same way, and only its positions are collected.
+// Strands are streamed one after another, and the negative strand from its own 5' end,
+// so that every cell receives values in the same order as from the whole strands and the results are identical.
+// Counts are the same as the serial computation, and sums with segment_num > 1 differ only by rounding errors of the addition order
+// (relative error of about segment_num * DBL_EPSILON).
+static void collect_ipd_by_kmer_in_chromosome(struct hdf5_job *job, struct chromosome_task const *task, size_t const position,
+        struct chromosome_data *chromosome, struct ipd_table *sums){
+    size_t table_num = job->k_num * job->segment_num;
+    for(size_t j = 0; job->aggregate == AGGREGATE_CHROMOSOME && j < table_num; j++){
+        clear_ipd_table(&sums[j]);
+    }
+    size_t halo = ipd_segment_halo(job->ks[job->k_num - 1], job->outside_length) / 2;
+    struct region_set const *set = task->set;
+    hid_t file_id = job->file_ids[task->file_index];
+    size_t i = task->chromosome_index;
+    if(job->prefetcher != NULL){
+        // Only the name and the length are set in chromosome, and the buffers in the slots are used
+        size_t seq = position;
+        size_t load_num = 1;
+        struct chromosome_load *loads = NULL;
+        for(size_t j = 0; j < load_num; j++){
+            struct prefetch_slot *slot = take_prefetched(job->prefetcher, seq, j);
+            if(j == 0){
+                chromosome->name = slot->chromosome.name;
+                chromosome->strand_length = slot->chromosome.strand_length;
+                loads = plan_chromosome_loads(chromosome->strand_length, task->begin, task->end, job->chunk_size, halo, set, &load_num);
+            }
+            collect_ipd_by_kmer_in_segments(job, &slot->chromosome, loads[j].begin, loads[j].end, sums);
+            release_prefetched(job->prefetcher, slot);
+        }
+        free(loads);
+    } else if(job->chunk_size == 0 && set == NULL && task->part_num == 1){
+        pthread_mutex_lock(&hdf5_mutex);
+        read_chromosome(file_id, i, job->chars, chromosome);
+        pthread_mutex_unlock(&hdf5_mutex);
+        collect_ipd_by_kmer_in_segments(job, chromosome, 0, chromosome->strand_length, sums);
+    } else {
+        pthread_mutex_lock(&hdf5_mutex);
+        open_chromosome(file_id, i, chromosome);
+        pthread_mutex_unlock(&hdf5_mutex);
+        size_t load_num;
+        struct chromosome_load *loads = plan_chromosome_loads(chromosome->strand_length, task->begin, task->end, job->chunk_size, halo, set, &load_num);
+        // Buffers grow to the largest load
+        for(size_t j = 0; j < load_num; j++){
+            struct chromosome_load const *load = &loads[j];
+            reserve_chromosome_buffers(chromosome, (load->loaded_end - load->loaded_begin) * load->strand_num);
+            pthread_mutex_lock(&hdf5_mutex);
+            load_chromosome(file_id, job->chars, chromosome, load->first_strand, load->strand_num, load->loaded_begin, load->loaded_end);
+            pthread_mutex_unlock(&hdf5_mutex);
+            collect_ipd_by_kmer_in_segments(job, chromosome, load->begin, load->end, sums);
+        }
+        free(loads);
+    }
+    for(size_t kk = 0; job->aggregate == AGGREGATE_CHROMOSOME && kk < job->k_num; kk++){
+        struct ipd_table *k_sums = &sums[kk * job->segment_num];
+        for(size_t j = 1; j < job->segment_num; j++){
+            add_ipd_table(&k_sums[0], &k_sums[j]);
+        }
+    }
+    return;
+}
+
+// Take the next task in job->order, which must be called with job->mutex locked, and return 0 if no task is left.
+// With AGGREGATE_CHROMOSOME, a task is taken ahead of the output only if it is long enough to finish last otherwise,
+// i.e. it has at least 1 / thread_num of the remaining positions, and the others are taken in the order of output.
+// Each task holds a slot until its results are written, and the last free slot is always given to the first task not taken,
+// so that the task the output waits for has always been taken and the workers never wait for each other in a cycle.
+// With the prefetcher, tasks are taken strictly in job->order, which is the order of output for AGGREGATE_CHROMOSOME.
+static int take_task(struct hdf5_job *job, size_t *position, size_t *task_index){
+    while(1){
+        while(job->next_position < job->end && job->tasks[job->order[job->next_position]].taken){
+            job->next_position++;
+        }
+        if(job->next_position >= job->end){
+            return 0;
+        }
+        if(job->aggregate != AGGREGATE_CHROMOSOME || job->free_slots > 0){
+            break;
+        }
+        pthread_cond_wait(&job->output_cond, &job->mutex);
+    }
+    size_t t = job->order[job->next_position];
+    if(job->aggregate == AGGREGATE_CHROMOSOME){
+        if(job->prefetcher == NULL){
+            while(job->tasks[job->next_untaken].taken){
+                job->next_untaken++;
+            }
+            if(job->free_slots == 1 || job->tasks[t].positions * job->thread_num < job->remaining_positions){
+                t = job->next_untaken;
+            }
+        }
+        job->free_slots--;
+    }
+    job->tasks[t].taken = 1;
+    job->remaining_positions -= job->tasks[t].positions;
+    *position = job->next_position;
+    *task_index = t;
+    return 1;
+}
+
+// Write the results of task, which must be called in the order of tasks.
+// The table of ks[kk] is tables[kk * stride].
+static void write_chromosome_output(struct hdf5_job *job, struct chromosome_task const *task, char const *name, struct ipd_table const *tables, size_t const stride){
+    // HDF5 output also needs the lock because HDF5 library may not be thread-safe
+    int use_hdf5 = (job->outputs[0].format == FORMAT_HDF5) ? 1 : 0;
+    if(use_hdf5){
+        pthread_mutex_lock(&hdf5_mutex);
+    }
+    int print_header = starts_output_file(&job->outputs[0], task->file_index);
+    for(size_t kk = 0; kk < job->k_num; kk++){
+        write_ipd_output(&job->outputs[kk], name, task->file_index, task->chromosome_index, &tables[kk * stride], print_header);
+    }
+    if(use_hdf5){
+        pthread_mutex_unlock(&hdf5_mutex);
+    }
+    return;
+}
+
+// Write the results of task, or add them to job->merged if task is a part of a split chromosome and write the sums after the last part.
+// Must be called in the order of tasks, like write_chromosome_output.
+static void output_task(struct hdf5_job *job, struct chromosome_task const *task, char const *name, struct ipd_table *tables, size_t const stride){
+    if(task->part_num == 1){
+        write_chromosome_output(job, task, name, tables, stride);
+        return;
+    }
+    for(size_t kk = 0; kk < job->k_num; kk++){
+        add_ipd_table(&job->merged[kk], &tables[kk * stride]);
+    }
+    if(task->part + 1 == task->part_num){
+        write_chromosome_output(job, task, name, job->merged, 1);
+        for(size_t kk = 0; kk < job->k_num; kk++){
+            clear_ipd_table(&job->merged[kk]);
+        }
+    }
+    return;
+}
+
+// Write the results handed over by process_chromosomes in the order of tasks.
+// A worker can go on to the next task as soon as it hands over the results, and the spare accumulators and the slot are freed when they are written.
+static void *write_chromosomes(void *arg){
+    struct hdf5_job *job = (struct hdf5_job *)arg;
+    for(size_t t = job->begin; t < job->end; t++){
+        struct pending_output *pending = &job->pending[t - job->begin];
+        pthread_mutex_lock(&job->mutex);
+        while(pending->tables == NULL){
+            pthread_cond_wait(&job->output_cond, &job->mutex);
+        }
+        pthread_mutex_unlock(&job->mutex);
+        output_task(job, &job->tasks[t], pending->name, pending->tables, 1);
+        pthread_mutex_lock(&job->mutex);
+        job->free_spares[job->free_spare_num++] = pending->tables;
+        job->free_slots++;
+        pthread_cond_broadcast(&job->output_cond);
+        pthread_mutex_unlock(&job->mutex);
+        free(pending->name);
+    }
+    return NULL;
+}
+
+static void *process_chromosomes(void *arg){
+    struct hdf5_worker *worker = (struct hdf5_worker *)arg;
+    struct hdf5_job *job = worker->job;
+    struct ipd_table *sums = worker->sums;
+    while(1){
+        size_t position, t;
+        pthread_mutex_lock(&job->mutex);
+        int taken = take_task(job, &position, &t);
+        pthread_mutex_unlock(&job->mutex);
+        if(!taken){
+            break;
+        }
 
         // Summarize IPD
-        // TODO: It may be effective to parallelize this call
-        // For example, using pthread at the expence of memory usage
-        int check_outside_coverage = 1;
-        collect_ipd_by_kmer(k, chars, tMean_buf, base_buf, (size_t)tMean_dim, tMean_sum, tMean_sq_sum, tMean_log2_sum, tMean_log2_sq_sum,
-                prediction_sum, prediction_sq_sum, prediction_log2_sum, prediction_log2_sq_sum, count, modelPrediction_buf, coverage_buf, coverage_threshold, outside_length, check_outside_coverage);
+        struct chromosome_task const *task = &job->tasks[t];
+        struct chromosome_data *chromosome = worker->chromosome;
+        collect_ipd_by_kmer_in_chromosome(job, task, position, chromosome, sums);
 
-        // Write data per chromosome
-        int print_header = (i == 0) ? 1 : 0;
-        write_ipd_by_kmer(k, outside_length, chars_size, chars, name, file_index,
-                tMean_sum, tMean_sq_sum, tMean_log2_sum, tMean_log2_sq_sum, prediction_sum, prediction_sq_sum, prediction_log2_sum, prediction_log2_sq_sum, count, print_header, output);
+        // Aggregated results are written after all the chromosomes
+        if(job->aggregate != AGGREGATE_CHROMOSOME){
+            close_chromosome(chromosome);
+            continue;
+        }
+
+        if(job->pending != NULL){
+            // Hand the results to the writer thread, and continue with a free set of spare accumulators.
+            // One of them is always free, because the results waiting for the writer hold the other slots than that of this task.
+            pthread_mutex_lock(&job->mutex);
+            struct ipd_table *spare = job->free_spares[--job->free_spare_num];
+            for(size_t kk = 0; kk < job->k_num; kk++){
+                struct ipd_table finished = sums[kk * job->segment_num];
+                sums[kk * job->segment_num] = spare[kk];
+                spare[kk] = finished;
+            }
+            job->pending[t - job->begin].name = chromosome->name;
+            job->pending[t - job->begin].tables = spare;
+            chromosome->name = NULL;
+            pthread_cond_broadcast(&job->output_cond);
+            pthread_mutex_unlock(&job->mutex);
+            continue;
+        }
+
+        // Write data per chromosome after all the preceding tasks are written
+        pthread_mutex_lock(&job->mutex);
+        while(job->next_output != t){
+            pthread_cond_wait(&job->output_cond, &job->mutex);
+        }
+        pthread_mutex_unlock(&job->mutex);
+        output_task(job, task, chromosome->name, sums, job->segment_num);
+        pthread_mutex_lock(&job->mutex);
+        job->next_output = t + 1;
+        job->free_slots++;
+        pthread_cond_broadcast(&job->output_cond);
+        pthread_mutex_unlock(&job->mutex);
 
         // Ending process
-        // TODO: save "free" and use "realloc" for performance
-        free(tMean_buf);
-        free(base_buf[0]);
-        free(base_buf);
-        free(modelPrediction_buf);
-        free(coverage_buf);
-        free(name);
-        free(tMean_name);
-        free(base_name);
-    }
-    H5Fclose(file_id);
+        close_chromosome(chromosome);
+    }
+    return NULL;
+}
+
+// Merge the accumulators of each length of k-mers into the first ones, write them as the aggregated results, and clear all of them for the next aggregation.
+// sums: array of thread_num * k_num * segment_num sets of accumulators laid out as in collect_ipd_by_kmer_from_hdf5
+static void write_aggregated_output(struct ipd_output *outputs, size_t const k_num, size_t const file_index, struct ipd_table *sums,
+        size_t const thread_num, size_t const segment_num){
+    for(size_t kk = 0; kk < k_num; kk++){
+        struct ipd_table *total = &sums[kk * segment_num];
+        for(size_t t = 0; t < thread_num; t++){
+            for(size_t j = 0; j < segment_num; j++){
+                struct ipd_table *table = &sums[(t * k_num + kk) * segment_num + j];
+                if(table != total){
+                    add_ipd_table(total, table);
+                }
+            }
+        }
+        pthread_mutex_lock(&hdf5_mutex);
+        write_ipd_output(&outputs[kk], AGGREGATE_NAME, file_index, 0, total, 1);
+        pthread_mutex_unlock(&hdf5_mutex);
+    }
+    for(size_t j = 0; j < thread_num * k_num * segment_num; j++){
+        clear_ipd_table(&sums[j]);
+    }
+    return;
+}
+
+// Chromosomes to be processed in all the input files, scanned from the metadata by scan_inputs
+struct input_summary {
+    size_t chromosome_num;
+    // Task of each chromosome in the order of files and chromosomes
+    struct chromosome_task *tasks;
+    // Positions of both strands to collect in all the chromosomes, and in the chromosome with the most of them
+    size_t positions;
+    size_t max_chromosome_positions;
+};
+
+// Scan the lengths of the chromosomes in the shard and the regions without reading the data sets, and make their tasks
+static void scan_inputs(char **file_paths, size_t const file_num, size_t const shard_index, size_t const shard_num,
+        struct region_list const *regions, struct input_summary *summary){
+    size_t capacity = 16;
+    summary->chromosome_num = 0;
+    summary->tasks = (struct chromosome_task *)malloc(capacity * sizeof(struct chromosome_task));
+    if(summary->tasks == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for input summary\n"); exit(EXIT_FAILURE); }
+    summary->positions = 0;
+    summary->max_chromosome_positions = 0;
+    for(size_t f = 0; f < file_num; f++){
+        hid_t file_id = H5Fopen(file_paths[f], H5F_ACC_RDONLY, H5P_DEFAULT);
+        if(file_id < 0) { fprintf(stderr, "ERROR: Cannot open file in HDF5 format: %s\n", file_paths[f]); exit(EXIT_FAILURE); }
+        H5G_info_t ginfo;
+        H5Gget_info_by_name(file_id, "/", &ginfo, H5P_DEFAULT);
+        for(size_t i = 0; i < ginfo.nlinks; i++){
+            if(!in_shard(f, i, shard_index, shard_num)){
+                continue;
+            }
+            char *name = get_chromosome_name(file_id, i);
+            struct region_set const *set = (regions != NULL) ? find_region_set(regions, name) : NULL;
+            if(regions != NULL && set == NULL){
+                free(name);
+                continue;
+            }
+            char *tMean_name = (char *)malloc(strlen(name) + strlen("tMean") + 3);
+            if(tMean_name == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for tMean_name\n"); exit(EXIT_FAILURE); }
+            sprintf(tMean_name, "/%s/tMean", name);
+            hsize_t dim = 0;
+            if(H5LTget_dataset_info(file_id, tMean_name, &dim, NULL, NULL) < 0) { fprintf(stderr, "ERROR: Failure in opening %s\n", tMean_name); exit(EXIT_FAILURE); }
+            free(tMean_name);
+            free(name);
+            size_t n = dim / 2;
+            size_t span = n;
+            size_t positions = 2 * n;
+            if(set != NULL){
+                span = 0;
+                positions = 0;
+                for(size_t x = 0; x < set->num && set->begins[x] < n; x++){
+                    size_t length = ((set->ends[x] < n) ? set->ends[x] : n) - set->begins[x];
+                    span = (length > span) ? length : span;
+                    positions += 2 * length;
+                }
+            }
+            if(summary->chromosome_num == capacity){
+                capacity *= 2;
+                summary->tasks = (struct chromosome_task *)realloc(summary->tasks, capacity * sizeof(struct chromosome_task));
+                if(summary->tasks == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for input summary\n"); exit(EXIT_FAILURE); }
+            }
+            struct chromosome_task *task = &summary->tasks[summary->chromosome_num++];
+            task->file_index = f;
+            task->chromosome_index = i;
+            task->strand_length = n;
+            task->span = span;
+            task->positions = positions;
+            task->set = set;
+            task->begin = 0;
+            task->end = n;
+            task->part = 0;
+            task->part_num = 1;
+            task->taken = 0;
+            summary->positions += positions;
+            if(positions > summary->max_chromosome_positions){
+                summary->max_chromosome_positions = positions;
+            }
+        }
+        H5Fclose(file_id);
+    }
+    return;
+}
+
+// Bytes per position of the buffers of loaded strands: tMean, base, coverage and flags,
+// and modelPrediction and the two log2 values if they are needed by the statistics collected
+static size_t buffer_bytes_per_position(void){
+    size_t bytes = sizeof(float) + sizeof(uint8_t) + sizeof(unsigned int) + sizeof(unsigned char);
+    if(collected_stats & (IPD_STAT_PRED | IPD_STAT_PRED_LOG2)){
+        bytes += sizeof(float);
+    }
+    if(collected_stats & IPD_STAT_IPD_LOG2){
+        bytes += sizeof(double);
+    }
+    if(collected_stats & IPD_STAT_PRED_LOG2){
+        bytes += sizeof(double);
+    }
+    return bytes;
+}
+// Smallest chunk size chosen by plan_memory
+#define MIN_PLANNED_CHUNK_SIZE 16384
+
+// Settings that determine the peak memory, and the estimate of it in bytes by estimate_memory
+struct memory_plan {
+    size_t thread_num;
+    size_t segment_num;
+    size_t chunk_size;
+    size_t prefetch_depth;
+    // Whether the tables of each length of k-mers are sparse
+    int *sparse;
+    double table_bytes;
+    double buffer_bytes;
+};
+
+// Number of sets of accumulators per length of k-mers: thread_num * segment_num, thread_num more for asynchronous output,
+// and one more to merge the parts of chromosomes split by split_long_tasks with more than one thread
+static size_t count_planned_tables(struct memory_plan const *plan, int const async_output, int const aggregate){
+    size_t table_num = plan->thread_num * plan->segment_num;
+    if(aggregate == AGGREGATE_CHROMOSOME){
+        table_num += (async_output ? plan->thread_num : 0) + ((plan->thread_num > 1) ? 1 : 0);
+    }
+    return table_num;
+}
+
+// Estimate the peak memory of the accumulators and the buffers of loaded chromosomes with the settings in plan.
+// Each thread holds the largest load of the chromosome it processes, or the prefetcher holds prefetch_depth loads instead,
+// and HDF5 reads need one more buffer of the interleaved strands at a time.
+// Sparse tables are assumed to observe distinct k-mers at all the positions a table can receive until it is cleared.
+static void estimate_memory(struct memory_plan *plan, struct input_summary const *summary, int const has_regions,
+        size_t const k_num, size_t const *ks, size_t const outside_length, size_t const chars_size, int const async_output, int const aggregate){
+    size_t halo = ipd_segment_halo(ks[k_num - 1], outside_length) / 2;
+    size_t observed = (aggregate == AGGREGATE_CHROMOSOME) ? summary->max_chromosome_positions : summary->positions;
+    size_t table_num = count_planned_tables(plan, async_output, aggregate);
+    plan->table_bytes = 0.0;
+    for(size_t kk = 0; kk < k_num; kk++){
+        size_t kmers_size = (size_t)(pow(chars_size, ks[kk]) + 0.5);
+        plan->table_bytes += (double)table_num * estimate_ipd_table_bytes(kmers_size, ks[kk] + 2 * outside_length, plan->sparse[kk], observed);
+    }
+    // Elements of the largest load of each chromosome
+    size_t *loads = (size_t *)malloc((summary->chromosome_num + 1) * sizeof(size_t));
+    if(loads == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for loads\n"); exit(EXIT_FAILURE); }
+    size_t max_strand_load = 0;
+    for(size_t c = 0; c < summary->chromosome_num; c++){
+        size_t n = summary->tasks[c].strand_length;
+        size_t strand_load = n;
+        int strand_num = 2;
+        if(has_regions){
+            size_t span = summary->tasks[c].span;
+            size_t piece = (plan->chunk_size > 0 && plan->chunk_size < span) ? plan->chunk_size : span;
+            strand_load = (piece + 2 * halo < n) ? piece + 2 * halo : n;
+        }else if(plan->chunk_size > 0){
+            strand_load = (plan->chunk_size + 2 * halo < n) ? plan->chunk_size + 2 * halo : n;
+            strand_num = 1;
+        }
+        loads[c] = strand_load * strand_num;
+        max_strand_load = (strand_load > max_strand_load) ? strand_load : max_strand_load;
+    }
+    qsort(loads, summary->chromosome_num, sizeof(size_t), compare_size);
+    size_t holder_num = (plan->prefetch_depth > 0) ? plan->prefetch_depth : plan->thread_num;
+    plan->buffer_bytes = 2.0 * max_strand_load * sizeof(float);
+    for(size_t x = 0; x < holder_num && x < summary->chromosome_num; x++){
+        // The prefetcher may hold the largest load in every slot
+        size_t elements = (plan->prefetch_depth > 0) ? loads[summary->chromosome_num - 1] : loads[summary->chromosome_num - 1 - x];
+        plan->buffer_bytes += (double)elements * buffer_bytes_per_position();
+    }
+    free(loads);
+    return;
+}
+
+// Choose sparse tables for --table auto, and fit the settings in max_megabytes (0 for no limit) if needed by the smaller kind of tables for --table auto,
+// fewer threads and segments until the accumulators fit, a chunk size unless it is given, and fewer prefetched loads, threads and segments in this order.
+// Exit with the estimate if it does not fit with all of them. With verbose, the choice of tables and the estimate are reported.
+static void plan_memory(struct memory_plan *plan, struct input_summary const *summary, int const has_regions,
+        size_t const k_num, size_t const *ks, size_t const outside_length, size_t const chars_size, int const async_output, int const aggregate,
+        int const table, size_t const dense_limit, size_t const max_megabytes, int const verbose){
+    double const megabyte = 1024.0 * 1024.0;
+    // Dense tables unless sparse ones are requested, or dense ones exceed dense_limit or have more k-mers than positions
+    for(size_t kk = 0; kk < k_num; kk++){
+        plan->sparse[kk] = (table == TABLE_SPARSE) ? 1 : 0;
+    }
+    estimate_memory(plan, summary, has_regions, k_num, ks, outside_length, chars_size, async_output, aggregate);
+    for(size_t kk = 0; table == TABLE_AUTO && kk < k_num; kk++){
+        size_t kmers_size = (size_t)(pow(chars_size, ks[kk]) + 0.5);
+        size_t table_num = count_planned_tables(plan, async_output, aggregate);
+        double dense_megabytes = (double)table_num * estimate_ipd_table_bytes(kmers_size, ks[kk] + 2 * outside_length, 0, 0) / megabyte;
+        plan->sparse[kk] = (dense_megabytes > dense_limit || kmers_size > summary->positions) ? 1 : 0;
+        if(verbose){
+            fprintf(stderr, "INFO: dense tables of k = %zu would take %.1f MB; using %s tables\n", ks[kk], dense_megabytes, plan->sparse[kk] ? "sparse" : "dense");
+        }
+    }
+    estimate_memory(plan, summary, has_regions, k_num, ks, outside_length, chars_size, async_output, aggregate);
+    double budget = (double)max_megabytes * megabyte;
+    if(max_megabytes > 0 && plan->table_bytes + plan->buffer_bytes > budget){
+        fprintf(stderr, "INFO: estimated memory %.1f MB exceeds --max-memory %zu MB; adjusting the settings\n",
+                (plan->table_bytes + plan->buffer_bytes) / megabyte, max_megabytes);
+        // The smaller kind of tables
+        for(size_t kk = 0; table == TABLE_AUTO && kk < k_num; kk++){
+            size_t kmers_size = (size_t)(pow(chars_size, ks[kk]) + 0.5);
+            size_t observed = (aggregate == AGGREGATE_CHROMOSOME) ? summary->max_chromosome_positions : summary->positions;
+            size_t row_length = ks[kk] + 2 * outside_length;
+            plan->sparse[kk] = (estimate_ipd_table_bytes(kmers_size, row_length, 1, observed) < estimate_ipd_table_bytes(kmers_size, row_length, 0, 0)) ? 1 : 0;
+        }
+        estimate_memory(plan, summary, has_regions, k_num, ks, outside_length, chars_size, async_output, aggregate);
+        // Accumulators grow with threads and segments, which no chunk size can make up for
+        while(plan->table_bytes > budget && (plan->thread_num > 1 || plan->segment_num > 1)){
+            if(plan->thread_num > 1){
+                plan->thread_num--;
+            }else{
+                plan->segment_num--;
+            }
+            estimate_memory(plan, summary, has_regions, k_num, ks, outside_length, chars_size, async_output, aggregate);
+        }
+        // The largest chunk size that fits, or the smallest one
+        if(plan->chunk_size == 0 && plan->table_bytes + plan->buffer_bytes > budget){
+            size_t max_length = 0;
+            for(size_t c = 0; c < summary->chromosome_num; c++){
+                max_length = (summary->tasks[c].span > max_length) ? summary->tasks[c].span : max_length;
+            }
+            size_t chunk_size = MIN_PLANNED_CHUNK_SIZE;
+            while(chunk_size * 2 < max_length){
+                chunk_size *= 2;
+            }
+            plan->chunk_size = chunk_size;
+            estimate_memory(plan, summary, has_regions, k_num, ks, outside_length, chars_size, async_output, aggregate);
+            while(plan->chunk_size > MIN_PLANNED_CHUNK_SIZE && plan->table_bytes + plan->buffer_bytes > budget){
+                plan->chunk_size /= 2;
+                estimate_memory(plan, summary, has_regions, k_num, ks, outside_length, chars_size, async_output, aggregate);
+            }
+        }
+        while(plan->prefetch_depth > 1 && plan->table_bytes + plan->buffer_bytes > budget){
+            plan->prefetch_depth--;
+            estimate_memory(plan, summary, has_regions, k_num, ks, outside_length, chars_size, async_output, aggregate);
+        }
+        while(plan->thread_num > 1 && plan->table_bytes + plan->buffer_bytes > budget){
+            plan->thread_num--;
+            estimate_memory(plan, summary, has_regions, k_num, ks, outside_length, chars_size, async_output, aggregate);
+        }
+        while(plan->segment_num > 1 && plan->table_bytes + plan->buffer_bytes > budget){
+            plan->segment_num--;
+            estimate_memory(plan, summary, has_regions, k_num, ks, outside_length, chars_size, async_output, aggregate);
+        }
+        if(plan->table_bytes + plan->buffer_bytes > budget){
+            fprintf(stderr, "ERROR: at least %.1f MB (accumulators %.1f MB, chromosome buffers %.1f MB) is needed with threads = %zu, segments = %zu, "
+                    "chunk_size = %zu and prefetch = %zu, which exceeds --max-memory %zu MB\n", (plan->table_bytes + plan->buffer_bytes) / megabyte,
+                    plan->table_bytes / megabyte, plan->buffer_bytes / megabyte, plan->thread_num, plan->segment_num, plan->chunk_size, plan->prefetch_depth,
+                    max_megabytes);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(verbose){
+        fprintf(stderr, "INFO: estimated peak memory %.1f MB (accumulators %.1f MB, chromosome buffers %.1f MB) with threads = %zu, segments = %zu, chunk_size = %zu, prefetch = %zu\n",
+                (plan->table_bytes + plan->buffer_bytes) / megabyte, plan->table_bytes / megabyte, plan->buffer_bytes / megabyte,
+                plan->thread_num, plan->segment_num, plan->chunk_size, plan->prefetch_depth);
+    }
+    return;
+}
+
+// Collect IPD of the tasks [begin, end) of tasks taken in the order of order, see take_task.
+// file_ids: input files indexed by file_index of tasks
+// ks: k_num lengths of k-mers in ascending order, written to outputs[kk] for each ks[kk]
+// sums: array of thread_num * k_num * segment_num sets of accumulators; each thread uses k_num * segment_num sets of them
+// spares: NULL, or array of thread_num * k_num sets of accumulators to write the results in a separate thread
+// chromosomes: array of thread_num chromosomes initialized by init_chromosome_buffers, whose buffers are reused by each thread across files
+// prefetcher: NULL, or the thread reading the tasks ahead in the order of order
+// aggregate: AGGREGATE_CHROMOSOME writes the results per task, and the others leave them accumulated in sums.
+// sums must be cleared before the first task unless aggregate is AGGREGATE_CHROMOSOME.
+static void collect_ipd_by_kmer_in_tasks(hid_t const *file_ids, struct chromosome_task *tasks, size_t const *order, size_t const begin, size_t const end,
+        size_t const k_num, size_t const *ks, size_t const outside_length,
+        size_t const chars_size, char const *chars, size_t const coverage_threshold, struct ipd_output *outputs,
+        struct ipd_table *sums, struct ipd_table *spares, struct chromosome_data *chromosomes, struct prefetcher *prefetcher,
+        size_t const thread_num, size_t const segment_num, size_t const chunk_size, int const aggregate){
+    // No need to start more threads than tasks
+    size_t worker_num = (thread_num < end - begin) ? thread_num : end - begin;
+    struct hdf5_job job = {
+        .file_ids = file_ids,
+        .tasks = tasks,
+        .order = order,
+        .begin = begin,
+        .end = end,
+        .thread_num = worker_num,
+        .k_num = k_num,
+        .ks = ks,
+        .outside_length = outside_length,
+        .chars_size = chars_size,
+        .chars = chars,
+        .coverage_threshold = coverage_threshold,
+        .segment_num = segment_num,
+        .chunk_size = chunk_size,
+        .aggregate = aggregate,
+        .outputs = outputs,
+        .merged = NULL,
+        .prefetcher = prefetcher,
+        .next_position = begin,
+        .next_untaken = begin,
+        .remaining_positions = 0,
+        .next_output = begin,
+        .free_slots = thread_num,
+        .pending = NULL,
+        .free_spares = NULL,
+        .free_spare_num = 0,
+    };
+    int has_parts = 0;
+    for(size_t t = begin; t < end; t++){
+        job.remaining_positions += tasks[t].positions;
+        has_parts |= (tasks[t].part_num > 1) ? 1 : 0;
+    }
+    if(has_parts && aggregate == AGGREGATE_CHROMOSOME){
+        job.merged = (struct ipd_table *)malloc(k_num * sizeof(struct ipd_table));
+        if(job.merged == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for merged sums\n"); exit(EXIT_FAILURE); }
+        for(size_t kk = 0; kk < k_num; kk++){
+            struct ipd_table const *table = &sums[kk * segment_num];
+            alloc_ipd_table(&job.merged[kk], table->kmers_size, table->row_length, table->sparse);
+            clear_ipd_table(&job.merged[kk]);
+        }
+    }
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.output_cond, NULL);
+    pthread_t writer_thread;
+    if(spares != NULL && end > begin){
+        job.pending = (struct pending_output *)calloc(end - begin, sizeof(struct pending_output));
+        job.free_spares = (struct ipd_table **)malloc(thread_num * sizeof(struct ipd_table *));
+        if(job.pending == NULL || job.free_spares == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for pending outputs\n"); exit(EXIT_FAILURE); }
+        for(size_t i = 0; i < thread_num; i++){
+            job.free_spares[job.free_spare_num++] = &spares[i * k_num];
+        }
+        if(pthread_create(&writer_thread, NULL, write_chromosomes, &job) != 0){
+            fprintf(stderr, "ERROR: Cannot create thread\n"); exit(EXIT_FAILURE);
+        }
+    }
+    struct hdf5_worker workers[thread_num];
+    pthread_t threads[thread_num];
+    for(size_t i = 0; i < thread_num; i++){
+        workers[i].job = &job;
+        workers[i].chromosome = &chromosomes[i];
+        workers[i].sums = &sums[i * k_num * segment_num];
+    }
+    // The calling thread works as the first worker
+    for(size_t i = 1; i < worker_num; i++){
+        if(pthread_create(&threads[i], NULL, process_chromosomes, &workers[i]) != 0){
+            fprintf(stderr, "ERROR: Cannot create thread\n"); exit(EXIT_FAILURE);
+        }
+    }
+    if(worker_num > 0){
+        process_chromosomes(&workers[0]);
+    }
+    for(size_t i = 1; i < worker_num; i++){
+        pthread_join(threads[i], NULL);
+    }
+    if(job.pending != NULL){
+        pthread_join(writer_thread, NULL);
+        free(job.pending);
+        free(job.free_spares);
+    }
+    for(size_t kk = 0; job.merged != NULL && kk < k_num; kk++){
+        free_ipd_table(&job.merged[kk]);
+    }
+    free(job.merged);
+    pthread_cond_destroy(&job.output_cond);
+    pthread_mutex_destroy(&job.mutex);
     return;
 }
 
+// Number of positions of a strand of task in [begin, end)
+static size_t count_task_positions(struct chromosome_task const *task, size_t const begin, size_t const end){
+    if(task->set == NULL){
+        return end - begin;
+    }
+    size_t positions = 0;
+    for(size_t x = 0; x < task->set->num; x++){
+        size_t interval_begin = (task->set->begins[x] > begin) ? task->set->begins[x] : begin;
+        size_t interval_end = (task->set->ends[x] < end) ? task->set->ends[x] : end;
+        positions += (interval_begin < interval_end) ? interval_end - interval_begin : 0;
+    }
+    return positions;
+}
+
+// Position of a strand of task before which count_task_positions(task, 0, position) == rank, where rank < that of the whole strand
+static size_t find_task_position(struct chromosome_task const *task, size_t rank){
+    if(task->set == NULL){
+        return rank;
+    }
+    for(size_t x = 0; x < task->set->num; x++){
+        size_t interval_end = (task->set->ends[x] < task->strand_length) ? task->set->ends[x] : task->strand_length;
+        size_t length = (task->set->begins[x] < interval_end) ? interval_end - task->set->begins[x] : 0;
+        if(rank < length){
+            return task->set->begins[x] + rank;
+        }
+        rank -= length;
+    }
+    return task->strand_length;
+}
+
+// Number of parts of task with up to limit positions each, but at least one position of each strand
+static size_t count_task_parts(struct chromosome_task const *task, size_t const limit){
+    size_t part_num = (task->positions + limit - 1) / limit;
+    if(part_num > task->positions / 2){
+        part_num = task->positions / 2;
+    }
+    return (part_num > 1) ? part_num : 1;
+}
+
+// Split the tasks of chromosomes with more than 1 / thread_num of all the positions into parts with about the same number of positions,
+// so that no long chromosome is left to one thread at the end while the others are idle. The parts of a chromosome are successive tasks
+// replacing the task of the chromosome, and the array of *task_num tasks is returned, freeing tasks if it is replaced.
+// The parts are collected with the halo like intervals of regions, and their sums are merged in the order of parts before writing,
+// so that the counts are the same as those of the whole chromosome and the sums differ only by rounding errors of the addition order.
+static struct chromosome_task *split_long_tasks(struct chromosome_task *tasks, size_t *task_num, size_t const positions, size_t const thread_num){
+    if(thread_num <= 1 || positions == 0){
+        return tasks;
+    }
+    size_t limit = (positions + thread_num - 1) / thread_num;
+    size_t split_num = 0;
+    for(size_t t = 0; t < *task_num; t++){
+        split_num += count_task_parts(&tasks[t], limit);
+    }
+    if(split_num == *task_num){
+        return tasks;
+    }
+    struct chromosome_task *split = (struct chromosome_task *)malloc(split_num * sizeof(struct chromosome_task));
+    if(split == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for tasks\n"); exit(EXIT_FAILURE); }
+    size_t s = 0;
+    for(size_t t = 0; t < *task_num; t++){
+        struct chromosome_task const *whole = &tasks[t];
+        size_t part_num = count_task_parts(whole, limit);
+        size_t strand_positions = whole->positions / 2;
+        size_t begin = whole->begin;
+        for(size_t p = 0; p < part_num; p++){
+            struct chromosome_task *task = &split[s++];
+            *task = *whole;
+            task->part = p;
+            task->part_num = part_num;
+            task->begin = begin;
+            task->end = (p + 1 == part_num) ? whole->end : find_task_position(whole, strand_positions * (p + 1) / part_num);
+            task->positions = 2 * count_task_positions(whole, task->begin, task->end);
+            begin = task->end;
+        }
+    }
+    fprintf(stderr, "INFO: chromosomes with more than %zu positions are split into parts, making %zu tasks of %zu chromosomes\n", limit, split_num, *task_num);
+    free(tasks);
+    *task_num = split_num;
+    return split;
+}
+
+// Key to sort tasks into the order of taking them
+struct task_key {
+    // Tasks are grouped by this value, e.g. files, in ascending order
+    size_t group;
+    size_t positions;
+    size_t task;
+};
+
+// Compare task keys by group, longer tasks first, and then by the order of output to make the order deterministic
+static int compare_task_key(void const *a, void const *b){
+    struct task_key const *x = (struct task_key const *)a;
+    struct task_key const *y = (struct task_key const *)b;
+    if(x->group != y->group){
+        return (x->group < y->group) ? -1 : 1;
+    }
+    if(x->positions != y->positions){
+        return (x->positions > y->positions) ? -1 : 1;
+    }
+    return (x->task > y->task) - (x->task < y->task);
+}
+
+// Order of taking task_num tasks, to be freed by the caller.
+// Longer tasks are taken first, so that no long chromosome is left to the end while the other threads are idle.
+// With by_file, the tasks of each file are ordered separately, and with in_output_order, tasks are taken in the order of output.
+static size_t *order_tasks(struct chromosome_task const *tasks, size_t const task_num, int const by_file, int const in_output_order){
+    size_t *order = (size_t *)malloc((task_num + 1) * sizeof(size_t));
+    struct task_key *keys = (struct task_key *)malloc((task_num + 1) * sizeof(struct task_key));
+    if(order == NULL || keys == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for the order of tasks\n"); exit(EXIT_FAILURE); }
+    for(size_t t = 0; t < task_num; t++){
+        keys[t].group = by_file ? tasks[t].file_index : 0;
+        keys[t].positions = in_output_order ? 0 : tasks[t].positions;
+        keys[t].task = t;
+    }
+    qsort(keys, task_num, sizeof(struct task_key), compare_task_key);
+    for(size_t t = 0; t < task_num; t++){
+        order[t] = keys[t].task;
+    }
+    free(keys);
+    return order;
+}
+
 int main(int argc, char **argv){
     // Default parameters
     struct arguments arguments = {
         .file_paths = NULL,
         .file_num = 0,
-        .k = 2,
+        .ks = NULL,
+        .k_num = 0,
         .outside_length = 20,
         .chars = "ACGT",
         .coverage_threshold = 25,
         .output_path = NULL,
+        .thread_num = 1,
+        .segment_num = 1,
+        .simd_level = IPD_SIMD_AVX2,
+        .specialized_kernels = 1,
+        .chunk_size = 0,
+        .table = TABLE_AUTO,
+        .dense_limit = 1024,
+        .format = FORMAT_CSV,
+        .min_count = 0,
+        .stats = IPD_STAT_ALL,
+        .async_output = 0,
+        .prefetch_depth = 0,
+        .aggregate = AGGREGATE_CHROMOSOME,
+        .shard_index = 0,
+        .shard_num = 0,
+        .regions_path = NULL,
+        .max_memory = 0,
+        .huge_pages = 0,
+        .verbose = 0,
     };
     // Change default parameters
     // arguments.k = 10;
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
-    fprintf(stderr, "INFO: k = %zu, outside_length = %zu, chars = %s, coverage_threshold = %zu, output_path = %s\n",
-            arguments.k, arguments.outside_length, arguments.chars, arguments.coverage_threshold, (arguments.output_path!=NULL) ? arguments.output_path : "(NONE)");
+    static char const *simd_names[] = {"none", "sse4", "avx2"};
+    int simd_level = set_ipd_simd_level(arguments.simd_level);
+    set_ipd_specialized_kernels(arguments.specialized_kernels);
+    set_ipd_stats(arguments.stats);
+    collected_stats = arguments.stats;
+    static char const *stat_names[] = {"ipd", "ipd_log2", "pred", "pred_log2"};
+    char stat_list[64] = "";
+    for(int s = 0; s < 4; s++){
+        if(arguments.stats & (1 << s)){
+            sprintf(stat_list + strlen(stat_list), (stat_list[0] == '\0') ? "%s" : ",%s", stat_names[s]);
+        }
+    }
+    char k_list[256] = "";
+    for(size_t kk = 0; kk < arguments.k_num && strlen(k_list) + 24 < sizeof(k_list); kk++){
+        sprintf(k_list + strlen(k_list), (kk == 0) ? "%zu" : ",%zu", arguments.ks[kk]);
+    }
+    fprintf(stderr, "INFO: k = %s, outside_length = %zu, chars = %s, coverage_threshold = %zu, output_path = %s, threads = %zu, segments = %zu, chunk_size = %zu, simd = %s, kernel = %s, stats = %s\n",
+            k_list, arguments.outside_length, arguments.chars, arguments.coverage_threshold, (arguments.output_path!=NULL) ? arguments.output_path : "(NONE)",
+            arguments.thread_num, arguments.segment_num, arguments.chunk_size, simd_names[simd_level],
+            arguments.specialized_kernels ? "specialized" : "generic", stat_list);
     for(size_t i = 0; i < arguments.file_num; ++i){
         fprintf(stderr, "INFO: file[%zu] = %s\n", i, arguments.file_paths[i]);
         FILE *tmp_fp = fopen(arguments.file_paths[i], "r");
@@ -308,56 +2007,165 @@ int main(int argc, char **argv){
             fclose(tmp_fp);
         }
     }
-    FILE *output;
-    if(arguments.output_path == NULL){
-        output = stdout;
-    } else {
-        output = fopen(arguments.output_path, "w");
-        if(output == NULL){
-            fprintf(stderr, "ERROR: Cannot create/truncate file: %s\n", arguments.output_path); exit(EXIT_FAILURE);
+    size_t chars_size = strlen(arguments.chars);
+    size_t k_num = arguments.k_num;
+    size_t k_max = arguments.ks[k_num - 1];
+    if(pow(chars_size, k_max) >= (double)SIZE_MAX){ fprintf(stderr, "ERROR: k is too large to index k-mers\n"); exit(EXIT_FAILURE); }
+    struct region_list regions;
+    if(arguments.regions_path != NULL){
+        read_regions(arguments.regions_path, &regions);
+        size_t interval_num = 0;
+        size_t region_length = 0;
+        for(size_t x = 0; x < regions.num; x++){
+            interval_num += regions.sets[x].num;
+            for(size_t y = 0; y < regions.sets[x].num; y++){
+                region_length += regions.sets[x].ends[y] - regions.sets[x].begins[y];
+            }
+        }
+        fprintf(stderr, "INFO: regions = %s, %zu intervals of %zu positions in %zu chromosomes\n", arguments.regions_path, interval_num, region_length, regions.num);
+    }
+    // Plan memory from the lengths of chromosomes before allocating anything large
+    struct input_summary summary;
+    scan_inputs(arguments.file_paths, arguments.file_num, arguments.shard_index, arguments.shard_num,
+            (arguments.regions_path != NULL) ? &regions : NULL, &summary);
+    struct memory_plan plan = {
+        .thread_num = arguments.thread_num,
+        .segment_num = arguments.segment_num,
+        .chunk_size = arguments.chunk_size,
+        .prefetch_depth = arguments.prefetch_depth,
+        .sparse = (int *)malloc(k_num * sizeof(int)),
+    };
+    if(plan.sparse == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for sparse\n"); exit(EXIT_FAILURE); }
+    plan_memory(&plan, &summary, (arguments.regions_path != NULL) ? 1 : 0, k_num, arguments.ks, arguments.outside_length, chars_size,
+            arguments.async_output, arguments.aggregate, arguments.table, arguments.dense_limit, arguments.max_memory, arguments.verbose);
+    arguments.thread_num = plan.thread_num;
+    arguments.segment_num = plan.segment_num;
+    arguments.chunk_size = plan.chunk_size;
+    arguments.prefetch_depth = plan.prefetch_depth;
+    int *sparse = plan.sparse;
+    size_t task_num = summary.chromosome_num;
+    struct chromosome_task *tasks = split_long_tasks(summary.tasks, &task_num, summary.positions, arguments.thread_num);
+    // Each thread owns one set of accumulators per segment and length of k-mers, and another set per length for asynchronous output
+    size_t sums_num = arguments.thread_num * k_num * arguments.segment_num;
+    // Aggregated results are written only once per file or run, and need no asynchronous output
+    size_t spares_num = (arguments.async_output && arguments.aggregate == AGGREGATE_CHROMOSOME) ? arguments.thread_num * k_num : 0;
+    struct ipd_output *outputs = (struct ipd_output *)malloc(k_num * sizeof(struct ipd_output));
+    if(outputs == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for outputs\n"); exit(EXIT_FAILURE); }
+    for(size_t kk = 0; kk < k_num; kk++){
+        size_t k = arguments.ks[kk];
+        size_t kmers_size = (size_t)(pow(chars_size, k) + 0.5);
+        char *output_path = (k_num > 1) ? k_output_path(arguments.output_path, k) : arguments.output_path;
+        open_ipd_output(&outputs[kk], arguments.format, output_path, k, arguments.outside_length, chars_size, arguments.chars, kmers_size, arguments.stats, arguments.min_count,
+                arguments.shard_index, arguments.shard_num);
+        if(k_num > 1){
+            fprintf(stderr, "INFO: k = %zu is written to %s\n", k, output_path);
+            free(output_path);
+        }
+    }
+    // sums[(t * k_num + kk) * segment_num + j] is for the j-th segment of ks[kk] in the t-th thread, and spares[t * k_num + kk] for ks[kk] in the t-th thread
+    struct ipd_table *sums = (struct ipd_table *)malloc(sums_num * sizeof(struct ipd_table));
+    if(sums == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for sums\n"); exit(EXIT_FAILURE); }
+    for(size_t i = 0; i < sums_num; ++i){
+        size_t kk = i / arguments.segment_num % k_num;
+        size_t k = arguments.ks[kk];
+        alloc_ipd_table(&sums[i], (size_t)(pow(chars_size, k) + 0.5), k + 2 * arguments.outside_length, sparse[kk]);
+        clear_ipd_table(&sums[i]);
+    }
+    struct ipd_table *spares = NULL;
+    if(spares_num > 0){
+        spares = (struct ipd_table *)malloc(spares_num * sizeof(struct ipd_table));
+        if(spares == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for spares\n"); exit(EXIT_FAILURE); }
+        for(size_t i = 0; i < spares_num; ++i){
+            size_t kk = i % k_num;
+            size_t k = arguments.ks[kk];
+            alloc_ipd_table(&spares[i], (size_t)(pow(chars_size, k) + 0.5), k + 2 * arguments.outside_length, sparse[kk]);
         }
     }
-    size_t chars_size = strlen(arguments.chars);
-    size_t kmers_size = (size_t)(pow(chars_size, arguments.k) + 0.5);
-    size_t total_length = kmers_size * (arguments.k + 2 * arguments.outside_length);
-    double *tMean_sum = (double *)malloc(total_length * sizeof(double));
-    if(tMean_sum == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for tMean_sum\n"); exit(EXIT_FAILURE); }
-    double *tMean_sq_sum = (double *)malloc(total_length * sizeof(double));
-    if(tMean_sq_sum == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for tMean_sq_sum\n"); exit(EXIT_FAILURE); }
-    double *tMean_log2_sum = (double *)malloc(total_length * sizeof(double));
-    if(tMean_log2_sum == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for tMean_log2_sum\n"); exit(EXIT_FAILURE); }
-    double *tMean_log2_sq_sum = (double *)malloc(total_length * sizeof(double));
-    if(tMean_log2_sq_sum == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for tMean_log2_sq_sum\n"); exit(EXIT_FAILURE); }
-    double *prediction_sum = (double *)malloc(total_length * sizeof(double));
-    if(prediction_sum == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for prediction_sum\n"); exit(EXIT_FAILURE); }
-    double *prediction_sq_sum = (double *)malloc(total_length * sizeof(double));
-    if(prediction_sq_sum == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for prediction_sq_sum\n"); exit(EXIT_FAILURE); }
-    double *prediction_log2_sum = (double *)malloc(total_length * sizeof(double));
-    if(prediction_log2_sum == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for prediction_log2_sum\n"); exit(EXIT_FAILURE); }
-    double *prediction_log2_sq_sum = (double *)malloc(total_length * sizeof(double));
-    if(prediction_log2_sq_sum == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for prediction_log2_sq_sum\n"); exit(EXIT_FAILURE); }
-    size_t *count = (size_t *)malloc(total_length * sizeof(size_t));
-    if(count == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for count\n"); exit(EXIT_FAILURE); }
 
+    // Buffers of chromosomes are allocated when they are read, and grow to the largest load of each thread
+    use_huge_pages = arguments.huge_pages;
+    struct chromosome_data *chromosomes = (struct chromosome_data *)malloc(arguments.thread_num * sizeof(struct chromosome_data));
+    if(chromosomes == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for chromosomes\n"); exit(EXIT_FAILURE); }
+    for(size_t i = 0; i < arguments.thread_num; ++i){
+        init_chromosome_buffers(&chromosomes[i]);
+    }
+
+    if(sizeof(hsize_t) < sizeof(size_t)){
+        fprintf(stderr, "WARNING: sizeof(hsize_t) == %zu < sizeof(size_t) == %zu: the result may be incorrect\n", sizeof(hsize_t), sizeof(size_t));
+    }
+    hid_t *file_ids = (hid_t *)malloc(arguments.file_num * sizeof(hid_t));
+    if(file_ids == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for file_ids\n"); exit(EXIT_FAILURE); }
     for(size_t i = 0; i < arguments.file_num; ++i){
         size_t file_path_len = strlen(arguments.file_paths[i]);
         if(strcmp(arguments.file_paths[i] + file_path_len - 3, ".h5") != 0){
             fprintf(stderr, "WARNING: %s may not be a HDF5 file. Continuing.", arguments.file_paths[i]);
         }
-        collect_ipd_by_kmer_from_hdf5(arguments.file_paths[i], i, arguments.k, arguments.outside_length, chars_size, arguments.chars, kmers_size, arguments.coverage_threshold, output,
-                tMean_sum, tMean_sq_sum, tMean_log2_sum, tMean_log2_sq_sum, prediction_sum, prediction_sq_sum, prediction_log2_sum, prediction_log2_sq_sum, count);
+        file_ids[i] = H5Fopen(arguments.file_paths[i], H5F_ACC_RDONLY, H5P_DEFAULT);
+        if(file_ids[i] < 0) { fprintf(stderr, "ERROR: Cannot open file in HDF5 format: %s\n", arguments.file_paths[i]); exit(EXIT_FAILURE); }
+        H5G_info_t ginfo;
+        H5Gget_info_by_name(file_ids[i], "/", &ginfo, H5P_DEFAULT);
+        fprintf(stderr, "INFO: # chromosomes: %d\n", (int)ginfo.nlinks);
+    }
+    // Tasks of all the files are taken by one pool of threads, longest first, except that the prefetcher reads them
+    // in the order of output for AGGREGATE_CHROMOSOME, and AGGREGATE_FILE writes the results of each file before the next one
+    int by_file = (arguments.aggregate == AGGREGATE_FILE) ? 1 : 0;
+    int in_output_order = (arguments.aggregate == AGGREGATE_CHROMOSOME && arguments.prefetch_depth > 0) ? 1 : 0;
+    size_t *order = order_tasks(tasks, task_num, by_file, in_output_order);
+    struct prefetcher prefetcher;
+    if(arguments.prefetch_depth > 0){
+        start_prefetcher(&prefetcher, file_ids, tasks, order, task_num, arguments.chars,
+                k_max, arguments.outside_length, arguments.chunk_size, arguments.prefetch_depth);
     }
+    size_t run_begin = 0;
+    for(size_t i = 0; i < arguments.file_num; ++i){
+        // Tasks are in the order of files
+        size_t run_end = run_begin;
+        while(run_end < task_num && (!by_file || tasks[run_end].file_index == i)){
+            run_end++;
+        }
+        collect_ipd_by_kmer_in_tasks(file_ids, tasks, order, run_begin, run_end, k_num, arguments.ks, arguments.outside_length, chars_size, arguments.chars,
+                arguments.coverage_threshold, outputs, sums, spares, chromosomes, (arguments.prefetch_depth > 0) ? &prefetcher : NULL,
+                arguments.thread_num, arguments.segment_num, arguments.chunk_size, arguments.aggregate);
+        run_begin = run_end;
+        if(by_file){
+            write_aggregated_output(outputs, k_num, i, sums, arguments.thread_num, arguments.segment_num);
+        }
+    }
+    if(arguments.aggregate == AGGREGATE_ALL){
+        write_aggregated_output(outputs, k_num, FILE_INDEX_ALL, sums, arguments.thread_num, arguments.segment_num);
+    }
+    if(arguments.prefetch_depth > 0){
+        stop_prefetcher(&prefetcher);
+    }
+    for(size_t i = 0; i < arguments.file_num; ++i){
+        H5Fclose(file_ids[i]);
+    }
+    free(file_ids);
+    free(order);
+    free(tasks);
 
-    fclose(output);
+    for(size_t kk = 0; kk < k_num; kk++){
+        close_ipd_output(&outputs[kk]);
+    }
+    free(outputs);
+    free(sparse);
     free(arguments.file_paths);
-    free(tMean_sum);
-    free(tMean_sq_sum);
-    free(tMean_log2_sum);
-    free(tMean_log2_sq_sum);
-    free(prediction_sum);
-    free(prediction_sq_sum);
-    free(prediction_log2_sum);
-    free(prediction_log2_sq_sum);
-    free(count);
+    free(arguments.ks);
+    if(arguments.regions_path != NULL){
+        free_regions(&regions);
+    }
+    for(size_t i = 0; i < sums_num; ++i){
+        free_ipd_table(&sums[i]);
+    }
+    free(sums);
+    for(size_t i = 0; i < spares_num; ++i){
+        free_ipd_table(&spares[i]);
+    }
+    free(spares);
+    for(size_t i = 0; i < arguments.thread_num; ++i){
+        free_chromosome(&chromosomes[i]);
+    }
+    free(chromosomes);
+    free_interleaved_buffer();
     return 0;
 }
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "collect_ipd_format.h"
+
+// Shortest round-trip formatting of doubles by Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with Integers", 2010).
+// The digits always parse back to the same double, and are the shortest ones in almost all cases.
+
+// Floating-point number f * 2^e with a 64-bit significand
+struct diy_fp {
+    uint64_t f;
+    int e;
+};
+
+// Normalized 10^k for k = -348, -340, ..., 340
+static struct diy_fp const cached_powers[87] = {
+    {UINT64_C(0xfa8fd5a0081c0288), -1220}, {UINT64_C(0xbaaee17fa23ebf76), -1193}, {UINT64_C(0x8b16fb203055ac76), -1166},
+    {UINT64_C(0xcf42894a5dce35ea), -1140}, {UINT64_C(0x9a6bb0aa55653b2d), -1113}, {UINT64_C(0xe61acf033d1a45df), -1087},
+    {UINT64_C(0xab70fe17c79ac6ca), -1060}, {UINT64_C(0xff77b1fcbebcdc4f), -1034}, {UINT64_C(0xbe5691ef416bd60c), -1007},
+    {UINT64_C(0x8dd01fad907ffc3c), -980}, {UINT64_C(0xd3515c2831559a83), -954}, {UINT64_C(0x9d71ac8fada6c9b5), -927},
+    {UINT64_C(0xea9c227723ee8bcb), -901}, {UINT64_C(0xaecc49914078536d), -874}, {UINT64_C(0x823c12795db6ce57), -847},
+    {UINT64_C(0xc21094364dfb5637), -821}, {UINT64_C(0x9096ea6f3848984f), -794}, {UINT64_C(0xd77485cb25823ac7), -768},
+    {UINT64_C(0xa086cfcd97bf97f4), -741}, {UINT64_C(0xef340a98172aace5), -715}, {UINT64_C(0xb23867fb2a35b28e), -688},
+    {UINT64_C(0x84c8d4dfd2c63f3b), -661}, {UINT64_C(0xc5dd44271ad3cdba), -635}, {UINT64_C(0x936b9fcebb25c996), -608},
+    {UINT64_C(0xdbac6c247d62a584), -582}, {UINT64_C(0xa3ab66580d5fdaf6), -555}, {UINT64_C(0xf3e2f893dec3f126), -529},
+    {UINT64_C(0xb5b5ada8aaff80b8), -502}, {UINT64_C(0x87625f056c7c4a8b), -475}, {UINT64_C(0xc9bcff6034c13053), -449},
+    {UINT64_C(0x964e858c91ba2655), -422}, {UINT64_C(0xdff9772470297ebd), -396}, {UINT64_C(0xa6dfbd9fb8e5b88f), -369},
+    {UINT64_C(0xf8a95fcf88747d94), -343}, {UINT64_C(0xb94470938fa89bcf), -316}, {UINT64_C(0x8a08f0f8bf0f156b), -289},
+    {UINT64_C(0xcdb02555653131b6), -263}, {UINT64_C(0x993fe2c6d07b7fac), -236}, {UINT64_C(0xe45c10c42a2b3b06), -210},
+    {UINT64_C(0xaa242499697392d3), -183}, {UINT64_C(0xfd87b5f28300ca0e), -157}, {UINT64_C(0xbce5086492111aeb), -130},
+    {UINT64_C(0x8cbccc096f5088cc), -103}, {UINT64_C(0xd1b71758e219652c), -77}, {UINT64_C(0x9c40000000000000), -50},
+    {UINT64_C(0xe8d4a51000000000), -24}, {UINT64_C(0xad78ebc5ac620000), 3}, {UINT64_C(0x813f3978f8940984), 30},
+    {UINT64_C(0xc097ce7bc90715b3), 56}, {UINT64_C(0x8f7e32ce7bea5c70), 83}, {UINT64_C(0xd5d238a4abe98068), 109},
+    {UINT64_C(0x9f4f2726179a2245), 136}, {UINT64_C(0xed63a231d4c4fb27), 162}, {UINT64_C(0xb0de65388cc8ada8), 189},
+    {UINT64_C(0x83c7088e1aab65db), 216}, {UINT64_C(0xc45d1df942711d9a), 242}, {UINT64_C(0x924d692ca61be758), 269},
+    {UINT64_C(0xda01ee641a708dea), 295}, {UINT64_C(0xa26da3999aef774a), 322}, {UINT64_C(0xf209787bb47d6b85), 348},
+    {UINT64_C(0xb454e4a179dd1877), 375}, {UINT64_C(0x865b86925b9bc5c2), 402}, {UINT64_C(0xc83553c5c8965d3d), 428},
+    {UINT64_C(0x952ab45cfa97a0b3), 455}, {UINT64_C(0xde469fbd99a05fe3), 481}, {UINT64_C(0xa59bc234db398c25), 508},
+    {UINT64_C(0xf6c69a72a3989f5c), 534}, {UINT64_C(0xb7dcbf5354e9bece), 561}, {UINT64_C(0x88fcf317f22241e2), 588},
+    {UINT64_C(0xcc20ce9bd35c78a5), 614}, {UINT64_C(0x98165af37b2153df), 641}, {UINT64_C(0xe2a0b5dc971f303a), 667},
+    {UINT64_C(0xa8d9d1535ce3b396), 694}, {UINT64_C(0xfb9b7cd9a4a7443c), 720}, {UINT64_C(0xbb764c4ca7a44410), 747},
+    {UINT64_C(0x8bab8eefb6409c1a), 774}, {UINT64_C(0xd01fef10a657842c), 800}, {UINT64_C(0x9b10a4e5e9913129), 827},
+    {UINT64_C(0xe7109bfba19c0c9d), 853}, {UINT64_C(0xac2820d9623bf429), 880}, {UINT64_C(0x80444b5e7aa7cf85), 907},
+    {UINT64_C(0xbf21e44003acdd2d), 933}, {UINT64_C(0x8e679c2f5e44ff8f), 960}, {UINT64_C(0xd433179d9c8cb841), 986},
+    {UINT64_C(0x9e19db92b4e31ba9), 1013}, {UINT64_C(0xeb96bf6ebadf77d9), 1039}, {UINT64_C(0xaf87023b9bf0ee6b), 1066},
+};
+
+static uint64_t const pow10_u64[20] = {
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000), UINT64_C(10000), UINT64_C(100000), UINT64_C(1000000), UINT64_C(10000000),
+    UINT64_C(100000000), UINT64_C(1000000000), UINT64_C(10000000000), UINT64_C(100000000000), UINT64_C(1000000000000),
+    UINT64_C(10000000000000), UINT64_C(100000000000000), UINT64_C(1000000000000000), UINT64_C(10000000000000000),
+    UINT64_C(100000000000000000), UINT64_C(1000000000000000000), UINT64_C(10000000000000000000),
+};
+
+static struct diy_fp multiply_diy_fp(struct diy_fp const x, struct diy_fp const y) {
+    unsigned __int128 p = (unsigned __int128)x.f * y.f;
+    uint64_t h = (uint64_t)(p >> 64);
+    // Round to nearest
+    h += ((uint64_t)p >> 63) & 1;
+    struct diy_fp r = {h, x.e + y.e + 64};
+    return r;
+}
+
+static struct diy_fp normalize_diy_fp(struct diy_fp x) {
+    int s = __builtin_clzll(x.f);
+    x.f <<= s;
+    x.e -= s;
+    return x;
+}
+
+// Move the last digit down while the digits stay in the rounding interval and get closer to the exact value
+static void round_grisu(char *digits, int const length, uint64_t const delta, uint64_t rest, uint64_t const ten_kappa, uint64_t const wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+    return;
+}
+
+// Generate the digits of a positive finite value, which is digits * 10^(*K) on return
+static int generate_digits(double const value, char *digits, int *K) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint64_t const hidden = UINT64_C(1) << 52;
+    int biased_e = (int)((bits >> 52) & 0x7FF);
+    uint64_t significand = bits & (hidden - 1);
+    struct diy_fp v;
+    if (biased_e != 0) {
+        v.f = significand + hidden;
+        v.e = biased_e - 1075;
+    } else {
+        v.f = significand;
+        v.e = -1074;
+    }
+    // Boundaries m- and m+ of the rounding interval, with the same exponent
+    struct diy_fp plus = {(v.f << 1) + 1, v.e - 1};
+    plus = normalize_diy_fp(plus);
+    struct diy_fp minus = (v.f == hidden) ? (struct diy_fp){(v.f << 2) - 1, v.e - 2} : (struct diy_fp){(v.f << 1) - 1, v.e - 1};
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    // Cached power c = 10^-K such that the exponent of plus * c is in [-60, -32]
+    double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    if (dk - k > 0.0) {
+        k++;
+    }
+    unsigned index = (unsigned)((k >> 3) + 1);
+    *K = -(-348 + (int)(index << 3));
+    struct diy_fp c = cached_powers[index];
+    struct diy_fp w = multiply_diy_fp(normalize_diy_fp(v), c);
+    struct diy_fp wp = multiply_diy_fp(plus, c);
+    struct diy_fp wm = multiply_diy_fp(minus, c);
+    wm.f++;
+    wp.f--;
+    uint64_t delta = wp.f - wm.f;
+    uint64_t wp_w = wp.f - w.f;
+    // Integral part p1 and fractional part p2 of wp
+    int shift = -wp.e;
+    uint64_t one = UINT64_C(1) << shift;
+    uint32_t p1 = (uint32_t)(wp.f >> shift);
+    uint64_t p2 = wp.f & (one - 1);
+    int kappa = 10;
+    while (kappa > 0 && p1 < pow10_u64[kappa - 1]) {
+        kappa--;
+    }
+    int length = 0;
+    while (kappa > 0) {
+        uint32_t d = p1 / (uint32_t)pow10_u64[kappa - 1];
+        p1 %= (uint32_t)pow10_u64[kappa - 1];
+        if (d != 0 || length != 0) {
+            digits[length++] = (char)('0' + d);
+        }
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << shift) + p2;
+        if (rest <= delta) {
+            *K += kappa;
+            round_grisu(digits, length, delta, rest, pow10_u64[kappa] << shift, wp_w);
+            return length;
+        }
+    }
+    while (1) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> shift);
+        if (d != 0 || length != 0) {
+            digits[length++] = (char)('0' + d);
+        }
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            round_grisu(digits, length, delta, p2, one, wp_w * ((-kappa < 20) ? pow10_u64[-kappa] : 0));
+            return length;
+        }
+    }
+}
+
+// Write an exponent of at least two digits with its sign like printf
+static size_t format_exponent(int const exponent, char *buffer) {
+    size_t n = 0;
+    buffer[n++] = 'e';
+    buffer[n++] = (exponent < 0) ? '-' : '+';
+    unsigned e = (exponent < 0) ? -exponent : exponent;
+    if (e >= 100) {
+        buffer[n++] = (char)('0' + e / 100);
+        e %= 100;
+    }
+    buffer[n++] = (char)('0' + e / 10);
+    buffer[n++] = (char)('0' + e % 10);
+    return n;
+}
+
+// Write a decimal representation of value that parses back to value into buffer of at least IPD_DOUBLE_BUFFER_SIZE bytes,
+// in the notation of printf("%g") with enough precision, and return its length. buffer is not null-terminated.
+// The digits are the shortest ones in almost all cases, but Grisu2 gives one more digit than needed for a few values.
+size_t format_double(double const value, char *buffer) {
+    if (!isfinite(value)) {
+        int n = snprintf(buffer, IPD_DOUBLE_BUFFER_SIZE, "%.17g", value);
+        return (size_t)n;
+    }
+    size_t n = 0;
+    double v = value;
+    if (signbit(v)) {
+        buffer[n++] = '-';
+        v = -v;
+    }
+    if (v == 0.0) {
+        buffer[n++] = '0';
+        return n;
+    }
+    char digits[20];
+    int K;
+    int length = generate_digits(v, digits, &K);
+    // Decimal exponent of the first digit, i.e. value = d.ddd * 10^x
+    int x = length + K - 1;
+    if (x < -4 || x >= 17) {
+        buffer[n++] = digits[0];
+        if (length > 1) {
+            buffer[n++] = '.';
+            memcpy(buffer + n, digits + 1, length - 1);
+            n += length - 1;
+        }
+        n += format_exponent(x, buffer + n);
+    } else if (x < 0) {
+        buffer[n++] = '0';
+        buffer[n++] = '.';
+        for (int i = x + 1; i < 0; i++) {
+            buffer[n++] = '0';
+        }
+        memcpy(buffer + n, digits, length);
+        n += length;
+    } else if (x + 1 >= length) {
+        memcpy(buffer + n, digits, length);
+        n += length;
+        for (int i = length; i <= x; i++) {
+            buffer[n++] = '0';
+        }
+    } else {
+        memcpy(buffer + n, digits, x + 1);
+        n += x + 1;
+        buffer[n++] = '.';
+        memcpy(buffer + n, digits + x + 1, length - x - 1);
+        n += length - x - 1;
+    }
+    return n;
+}
+
+// Write the decimal representation of value into buffer of at least IPD_DOUBLE_BUFFER_SIZE bytes and return its length
+size_t format_size(size_t value, char *buffer) {
+    char digits[20];
+    size_t length = 0;
+    do {
+        digits[length++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = digits[length - 1 - i];
+    }
+    return length;
+}
+
+// Output to fp through a buffer of capacity bytes, which must be at least IPD_DOUBLE_BUFFER_SIZE
+void init_buffered_writer(struct buffered_writer *writer, FILE *fp, size_t const capacity) {
+    writer->fp = fp;
+    writer->capacity = (capacity > IPD_DOUBLE_BUFFER_SIZE) ? capacity : IPD_DOUBLE_BUFFER_SIZE;
+    writer->length = 0;
+    writer->buffer = (char *)malloc(writer->capacity);
+    if(writer->buffer == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for output buffer\n"); exit(EXIT_FAILURE); }
+    return;
+}
+
+void flush_buffered_writer(struct buffered_writer *writer) {
+    if (writer->length > 0 && fwrite(writer->buffer, 1, writer->length, writer->fp) != writer->length) {
+        fprintf(stderr, "ERROR: Cannot write output\n"); exit(EXIT_FAILURE);
+    }
+    writer->length = 0;
+    return;
+}
+
+// Flush the buffer and free it. fp is not closed.
+void free_buffered_writer(struct buffered_writer *writer) {
+    flush_buffered_writer(writer);
+    free(writer->buffer);
+    return;
+}
+
+// Make room for size bytes
+static inline void reserve_buffered_writer(struct buffered_writer *writer, size_t const size) {
+    if (writer->length + size > writer->capacity) {
+        flush_buffered_writer(writer);
+    }
+    return;
+}
+
+void write_string(struct buffered_writer *writer, char const *s) {
+    size_t size = strlen(s);
+    if (size > writer->capacity) {
+        flush_buffered_writer(writer);
+        if (fwrite(s, 1, size, writer->fp) != size) { fprintf(stderr, "ERROR: Cannot write output\n"); exit(EXIT_FAILURE); }
+        return;
+    }
+    reserve_buffered_writer(writer, size);
+    memcpy(writer->buffer + writer->length, s, size);
+    writer->length += size;
+    return;
+}
+
+void write_char(struct buffered_writer *writer, char const c) {
+    reserve_buffered_writer(writer, 1);
+    writer->buffer[writer->length++] = c;
+    return;
+}
+
+void write_size(struct buffered_writer *writer, size_t const value) {
+    reserve_buffered_writer(writer, IPD_DOUBLE_BUFFER_SIZE);
+    writer->length += format_size(value, writer->buffer + writer->length);
+    return;
+}
+
+void write_int(struct buffered_writer *writer, int const value) {
+    reserve_buffered_writer(writer, IPD_DOUBLE_BUFFER_SIZE);
+    size_t magnitude = (size_t)value;
+    if (value < 0) {
+        writer->buffer[writer->length++] = '-';
+        magnitude = (size_t)(-(long long)value);
+    }
+    writer->length += format_size(magnitude, writer->buffer + writer->length);
+    return;
+}
+
+void write_double(struct buffered_writer *writer, double const value) {
+    reserve_buffered_writer(writer, IPD_DOUBLE_BUFFER_SIZE);
+    writer->length += format_double(value, writer->buffer + writer->length);
+    return;
+}
@@ -0,0 +1,50 @@
+#ifndef COLLECT_IPD_FORMAT_H
+#define COLLECT_IPD_FORMAT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Text output of CSV: numbers formatted without printf and written through a user-space buffer.
+// format_double gives digits that always parse back to the same double. They are the shortest ones in almost all cases,
+// but not always: Grisu2 gives one more digit than needed for a few values.
+
+// Size of buffers for format_double and format_size
+#define IPD_DOUBLE_BUFFER_SIZE 32
+
+// Output through a user-space buffer, see init_buffered_writer
+struct buffered_writer {
+    FILE *fp;
+    char *buffer;
+    size_t capacity;
+    size_t length;
+};
+
+    size_t format_double(double const value, char *buffer);
+
+    size_t format_size(size_t value, char *buffer);
+
+    void init_buffered_writer(struct buffered_writer *writer, FILE *fp, size_t const capacity);
+
+    void flush_buffered_writer(struct buffered_writer *writer);
+
+    void free_buffered_writer(struct buffered_writer *writer);
+
+    void write_string(struct buffered_writer *writer, char const *s);
+
+    void write_char(struct buffered_writer *writer, char const c);
+
+    void write_size(struct buffered_writer *writer, size_t const value);
+
+    void write_int(struct buffered_writer *writer, int const value);
+
+    void write_double(struct buffered_writer *writer, double const value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <argp.h>
+
+#include <hdf5_hl.h>
+#include "collect_ipd_module.h"
+#include "collect_ipd_output.h"
+
+// Prepare for argp_parse
+char const *argp_program_version = "collect_ipd_merge 1.0";
+char const *argp_program_bug_address = "<example@u-tokyo.ac.jp>";
+static char doc[] = "collect_ipd_merge -- a program to sum partial files written by collect_ipd --shard (or --format partial) into the final results, "
+    "optionally deriving the results of shorter k-mers and outside lengths from the sums without reading the kinetics data again.";
+static char args_doc[] = "PARTIAL1 [PARTIAL2...]";
+// Keys for options without short-options
+#define OPT_FORMAT 1
+#define OPT_SKIP_EMPTY 2
+#define OPT_MIN_COUNT 3
+#define OPT_KMER_OFFSET 4
+#define OPT_STATS 5
+// Tables larger than this are sparse
+#define DENSE_LIMIT_MEGABYTES 1024
+static struct argp_option options[] = {
+    {"output", 'o', "FILE", 0, "Write IPD sum per k-mer to FILE. Default: standard output"},
+    {"format", OPT_FORMAT, "NAME", 0, "Write the output in the format NAME (csv, hdf5, columnar or partial) of collect_ipd. Binary formats require --output. Default: csv"},
+    {"skip-empty", OPT_SKIP_EMPTY, 0, 0, "Write only the cells observed at least once in CSV. Same as --min-count 1"},
+    {"min-count", OPT_MIN_COUNT, "INTEGER", 0, "Write only the cells observed at least INTEGER times in CSV. 0 writes all the cells. Default: 0"},
+    {"stats", OPT_STATS, "LIST", 0, "Write only the statistics in LIST, a comma-separated list of ipd, ipd_log2, pred, pred_log2 or all, as in collect_ipd. Statistics not collected by collect_ipd are 0. count is always written. Default: all"},
+    {0, 'k', "LENGTHS", 0, "Derive the results of k-mers of LENGTHS, a comma-separated list of lengths or ranges up to k of the partial files, "
+        "each of which is written to FILE with .kLENGTH inserted before the extension if LENGTHS has more than one length. "
+        "Shorter k-mers are counted only where the bases dropped from the k-mers of the partial files are also covered. Default: k of the partial files"},
+    {0, 'l', "LENGTH", 0, "Derive the results of the outside length LENGTH, which can be up to that of the partial files plus the bases dropped on each side of k-mers. Default: outside length of the partial files"},
+    {"kmer-offset", OPT_KMER_OFFSET, "INTEGER", 0, "Take the shorter k-mers of -k from the INTEGER-th base (0-origin) of the k-mers of the partial files. Default: 0"},
+    {0}
+};
+struct arguments {
+    char **file_paths;
+    size_t file_num;
+    char *output_path;
+    int format;
+    size_t min_count;
+    int stats;
+    // NULL to keep k of the partial files
+    size_t *ks;
+    size_t k_num;
+    // SIZE_MAX to keep outside_length of the partial files
+    size_t outside_length;
+    size_t kmer_offset;
+};
+static int parse_opt(int key, char *arg, struct argp_state *state){
+    struct arguments *arguments = state->input;
+    char *remain;
+    long lparsed;
+    switch(key){
+        case 'o':
+            arguments->output_path = arg;
+            break;
+        case OPT_FORMAT:
+            if(strcmp(arg, "csv") == 0){
+                arguments->format = FORMAT_CSV;
+            }else if(strcmp(arg, "hdf5") == 0){
+                arguments->format = FORMAT_HDF5;
+            }else if(strcmp(arg, "columnar") == 0){
+                arguments->format = FORMAT_COLUMNAR;
+            }else if(strcmp(arg, "partial") == 0){
+                arguments->format = FORMAT_PARTIAL;
+            }else{
+                fprintf(stderr, "ERROR: Invalid argument for format\n"); argp_usage(state);
+            }
+            break;
+        case OPT_SKIP_EMPTY:
+            if(arguments->min_count == 0){
+                arguments->min_count = 1;
+            }
+            break;
+        case OPT_MIN_COUNT:
+            lparsed = strtol(arg, &remain, 10);
+            if(arg[0] == '\0' || remain[0] != '\0' || lparsed < 0){
+                fprintf(stderr, "ERROR: Invalid argument for min-count\n"); argp_usage(state);
+            }
+            arguments->min_count = lparsed;
+            break;
+        case OPT_STATS:
+            if(!parse_stat_list(arg, &arguments->stats)){
+                fprintf(stderr, "ERROR: Invalid argument for stats\n"); argp_usage(state);
+            }
+            break;
+        case 'k':
+            if(!parse_k_list(arg, &arguments->ks, &arguments->k_num)){
+                fprintf(stderr, "ERROR: Invalid argument for k\n"); argp_usage(state);
+            }
+            break;
+        case 'l':
+            lparsed = strtol(arg, &remain, 10);
+            if(arg[0] == '\0' || remain[0] != '\0' || lparsed < 0){
+                fprintf(stderr, "ERROR: Invalid argument for l\n"); argp_usage(state);
+            }
+            arguments->outside_length = lparsed;
+            break;
+        case OPT_KMER_OFFSET:
+            lparsed = strtol(arg, &remain, 10);
+            if(arg[0] == '\0' || remain[0] != '\0' || lparsed < 0){
+                fprintf(stderr, "ERROR: Invalid argument for kmer-offset\n"); argp_usage(state);
+            }
+            arguments->kmer_offset = lparsed;
+            break;
+        case ARGP_KEY_ARG:
+            arguments->file_num++;
+            arguments->file_paths = (char **)realloc(arguments->file_paths, sizeof(char *) * arguments->file_num);
+            if(arguments->file_paths == NULL){ fprintf(stderr, "ERROR: Cannot realloc file_paths\n"); exit(EXIT_FAILURE); }
+            arguments->file_paths[arguments->file_num - 1] = arg;
+            break;
+        case ARGP_KEY_END:
+            if(state->arg_num < 1){
+                fprintf(stderr, "ERROR: Too few arguments\n"); argp_usage(state);
+            }
+            if(arguments->k_num > 1 && arguments->output_path == NULL){
+                fprintf(stderr, "ERROR: Multiple lengths of k-mers require --output\n"); argp_usage(state);
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+// An entry and the partial file containing it
+struct merge_entry {
+    struct partial_entry entry;
+    size_t partial_index;
+};
+
+// Order of the results of collect_ipd: files, chromosomes in each file, and then aggregated results
+static int compare_merge_entry(void const *a, void const *b){
+    struct partial_entry const *x = &((struct merge_entry const *)a)->entry;
+    struct partial_entry const *y = &((struct merge_entry const *)b)->entry;
+    if(x->file_index != y->file_index){
+        return (x->file_index > y->file_index) - (x->file_index < y->file_index);
+    }
+    if(x->chromosome_index != y->chromosome_index){
+        return (x->chromosome_index > y->chromosome_index) - (x->chromosome_index < y->chromosome_index);
+    }
+    return strcmp(x->name, y->name);
+}
+
+int main(int argc, char **argv){
+    struct arguments arguments = {
+        .file_paths = NULL,
+        .file_num = 0,
+        .output_path = NULL,
+        .format = FORMAT_CSV,
+        .min_count = 0,
+        .ks = NULL,
+        .k_num = 0,
+        .outside_length = SIZE_MAX,
+        .kmer_offset = 0,
+        .stats = IPD_STAT_ALL,
+    };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    size_t partial_num = arguments.file_num;
+    FILE **partials = (FILE **)malloc(partial_num * sizeof(FILE *));
+    struct partial_header *headers = (struct partial_header *)malloc(partial_num * sizeof(struct partial_header));
+    if(partials == NULL || headers == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for partial files\n"); exit(EXIT_FAILURE); }
+    for(size_t p = 0; p < partial_num; p++){
+        partials[p] = fopen(arguments.file_paths[p], "rb");
+        if(partials[p] == NULL) { fprintf(stderr, "ERROR: Cannot open file: %s\n", arguments.file_paths[p]); exit(EXIT_FAILURE); }
+        read_partial_header(partials[p], arguments.file_paths[p], &headers[p]);
+        struct partial_header const *h = &headers[p];
+        fprintf(stderr, "INFO: partial[%zu] = %s, shard %zu/%zu\n", p, arguments.file_paths[p], h->shard_index, h->shard_num);
+        if(h->k != headers[0].k || h->outside_length != headers[0].outside_length || strcmp(h->chars, headers[0].chars) != 0
+                || h->kmers_size != headers[0].kmers_size || h->row_length != headers[0].row_length){
+            fprintf(stderr, "ERROR: %s has different k, outside_length or chars from %s\n", arguments.file_paths[p], arguments.file_paths[0]); exit(EXIT_FAILURE);
+        }
+        // The same shard twice would double its results
+        for(size_t q = 0; q < p; q++){
+            if(headers[q].shard_num == h->shard_num && headers[q].shard_index == h->shard_index && h->shard_num > 1){
+                fprintf(stderr, "ERROR: %s and %s are the same shard\n", arguments.file_paths[q], arguments.file_paths[p]); exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if(partial_num < headers[0].shard_num){
+        fprintf(stderr, "WARNING: %zu partial files are given for %zu shards\n", partial_num, headers[0].shard_num);
+    }
+    struct partial_header const *header = &headers[0];
+    fprintf(stderr, "INFO: k = %zu, outside_length = %zu, chars = %s, output_path = %s\n",
+            header->k, header->outside_length, header->chars, (arguments.output_path!=NULL) ? arguments.output_path : "(NONE)");
+
+    // Index all the entries
+    size_t entry_num = 0;
+    size_t entry_capacity = 16;
+    struct merge_entry *entries = (struct merge_entry *)malloc(entry_capacity * sizeof(struct merge_entry));
+    if(entries == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for entries\n"); exit(EXIT_FAILURE); }
+    for(size_t p = 0; p < partial_num; p++){
+        while(1){
+            if(entry_num == entry_capacity){
+                entry_capacity *= 2;
+                entries = (struct merge_entry *)realloc(entries, entry_capacity * sizeof(struct merge_entry));
+                if(entries == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for entries\n"); exit(EXIT_FAILURE); }
+            }
+            if(!read_partial_entry(partials[p], arguments.file_paths[p], header->row_length, &entries[entry_num].entry)){
+                break;
+            }
+            entries[entry_num].partial_index = p;
+            entry_num++;
+        }
+    }
+    qsort(entries, entry_num, sizeof(struct merge_entry), compare_merge_entry);
+
+    // Results to write: the summed table itself, or the tables derived from it
+    if(arguments.ks == NULL){
+        arguments.ks = (size_t *)malloc(sizeof(size_t));
+        if(arguments.ks == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for ks\n"); exit(EXIT_FAILURE); }
+        arguments.ks[0] = header->k;
+        arguments.k_num = 1;
+    }
+    if(arguments.outside_length == SIZE_MAX){
+        arguments.outside_length = header->outside_length;
+    }
+    size_t k_num = arguments.k_num;
+    size_t chars_size = strlen(header->chars);
+    int derive = (k_num > 1 || arguments.ks[0] != header->k || arguments.outside_length != header->outside_length || arguments.kmer_offset != 0) ? 1 : 0;
+    struct ipd_table *derived = (struct ipd_table *)malloc(k_num * sizeof(struct ipd_table));
+    struct ipd_output *outputs = (struct ipd_output *)malloc(k_num * sizeof(struct ipd_output));
+    if(derived == NULL || outputs == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for outputs\n"); exit(EXIT_FAILURE); }
+    for(size_t kk = 0; kk < k_num; kk++){
+        size_t k = arguments.ks[kk];
+        if(k + arguments.kmer_offset > header->k){
+            fprintf(stderr, "ERROR: k = %zu from the base %zu is not a substring of k = %zu\n", k, arguments.kmer_offset, header->k); exit(EXIT_FAILURE);
+        }
+        size_t trailing = header->k - arguments.kmer_offset - k;
+        if(arguments.outside_length > header->outside_length + ((arguments.kmer_offset < trailing) ? arguments.kmer_offset : trailing)){
+            fprintf(stderr, "ERROR: outside_length = %zu is longer than that of k = %zu\n", arguments.outside_length, k); exit(EXIT_FAILURE);
+        }
+        size_t kmers_size = (size_t)(pow(chars_size, k) + 0.5);
+        size_t row_length = k + 2 * arguments.outside_length;
+        if(derive){
+            double megabytes = (double)kmers_size * row_length * sizeof(struct ipd_cell) / (1024.0 * 1024.0);
+            alloc_ipd_table(&derived[kk], kmers_size, row_length, (megabytes > DENSE_LIMIT_MEGABYTES) ? 1 : 0);
+        }
+        char *output_path = (k_num > 1) ? k_output_path(arguments.output_path, k) : arguments.output_path;
+        open_ipd_output(&outputs[kk], arguments.format, output_path, k, arguments.outside_length, chars_size, header->chars,
+                kmers_size, arguments.stats, arguments.min_count, 0, 1);
+        if(derive){
+            fprintf(stderr, "INFO: k = %zu, outside_length = %zu is derived from the base %zu and written to %s\n",
+                    k, arguments.outside_length, arguments.kmer_offset, (output_path != NULL) ? output_path : "(NONE)");
+        }
+        if(k_num > 1){
+            free(output_path);
+        }
+    }
+
+    // Sum the entries of the same chromosome and file, and write them in the order of collect_ipd
+    double dense_megabytes = (double)header->kmers_size * header->row_length * sizeof(struct ipd_cell) / (1024.0 * 1024.0);
+    struct ipd_table table;
+    alloc_ipd_table(&table, header->kmers_size, header->row_length, (dense_megabytes > DENSE_LIMIT_MEGABYTES) ? 1 : 0);
+    size_t written_num = 0;
+    for(size_t e = 0; e < entry_num; ){
+        size_t group_end = e + 1;
+        while(group_end < entry_num && compare_merge_entry(&entries[e], &entries[group_end]) == 0){
+            group_end++;
+        }
+        clear_ipd_table(&table);
+        for(size_t x = e; x < group_end; x++){
+            size_t p = entries[x].partial_index;
+            add_partial_rows(partials[p], arguments.file_paths[p], &entries[x].entry, &table);
+        }
+        // CSV has a header per file as collect_ipd writes
+        struct partial_entry const *entry = &entries[e].entry;
+        int print_header = starts_output_file(&outputs[0], entry->file_index);
+        for(size_t kk = 0; kk < k_num; kk++){
+            if(derive){
+                clear_ipd_table(&derived[kk]);
+                derive_ipd_table(&derived[kk], arguments.ks[kk], arguments.outside_length, &table, header->k, header->outside_length, chars_size, arguments.kmer_offset);
+            }
+            write_ipd_output(&outputs[kk], entry->name, entry->file_index, entry->chromosome_index, derive ? &derived[kk] : &table, print_header);
+        }
+        written_num++;
+        e = group_end;
+    }
+    fprintf(stderr, "INFO: %zu entries are merged into %zu tables\n", entry_num, written_num);
+    for(size_t kk = 0; kk < k_num; kk++){
+        close_ipd_output(&outputs[kk]);
+        if(derive){
+            free_ipd_table(&derived[kk]);
+        }
+    }
+    free(outputs);
+    free(derived);
+    free(arguments.ks);
+
+    free_ipd_table(&table);
+    for(size_t e = 0; e < entry_num; e++){
+        free(entries[e].entry.name);
+    }
+    free(entries);
+    for(size_t p = 0; p < partial_num; p++){
+        fclose(partials[p]);
+        free(headers[p].chars);
+    }
+    free(headers);
+    free(partials);
+    free(arguments.file_paths);
+    return 0;
+}
@@ -2,8 +2,794 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
-//#include <stdint.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IPD_X86 1
+#endif
+#include "collect_ipd_module.h"
+
+// Length of the margin required on each side of a segment
+size_t ipd_segment_halo(size_t const k, size_t const outside_length) {
+    return 2 * (k + outside_length);
+}
+
+// Add the statistics in cells to the separate arrays of each statistic
+void add_ipd_cells_to_arrays(struct ipd_cell const *cells, size_t const size,
+        double *tMean_sum, double *tMean_sq_sum, double *tMean_log2_sum, double *tMean_log2_sq_sum,
+        double *prediction_sum, double *prediction_sq_sum, double *prediction_log2_sum, double *prediction_log2_sq_sum, size_t *count) {
+    for (size_t i = 0; i < size; i++) {
+        tMean_sum[i] += cells[i].tMean_sum;
+        tMean_sq_sum[i] += cells[i].tMean_sq_sum;
+        tMean_log2_sum[i] += cells[i].tMean_log2_sum;
+        tMean_log2_sq_sum[i] += cells[i].tMean_log2_sq_sum;
+        prediction_sum[i] += cells[i].prediction_sum;
+        prediction_sq_sum[i] += cells[i].prediction_sq_sum;
+        prediction_log2_sum[i] += cells[i].prediction_log2_sum;
+        prediction_log2_sq_sum[i] += cells[i].prediction_log2_sq_sum;
+        count[i] += cells[i].count;
+    }
+    return;
+}
+
+// Loop of precompute_ipd_values with constant choices of the log2 values to compute
+static inline __attribute__((always_inline)) void precompute_values(float const *tMeans, float const *modelPredictions, unsigned int const *coverage,
+        size_t const length, unsigned int const coverage_threshold, int const check_outside_coverage,
+        int const tMean_log2, int const prediction_log2, double *tMean_log2s, double *prediction_log2s, unsigned char *flags) {
+    for (size_t i = 0; i < length; i++) {
+        unsigned char flag = 0;
+        if (coverage[i] >= coverage_threshold) {
+            flag |= IPD_COVERED;
+        }
+        int valid = tMeans[i] > 0.0 && (check_outside_coverage != 1 || coverage[i] >= coverage_threshold);
+        if (valid) {
+            flag |= IPD_VALID;
+        }
+        if (tMean_log2) {
+            tMean_log2s[i] = valid ? log2(tMeans[i]) : 0.0;
+        }
+        if (prediction_log2) {
+            prediction_log2s[i] = valid ? log2(modelPredictions[i]) : 0.0;
+        }
+        flags[i] = flag;
+    }
+    return;
+}
+
+// Precompute values used repeatedly by collect_ipd_by_kmer_strand for each element of input arrays of length length.
+// Every element is used in up to k + 2 * outside_length windows, so this saves calls of log2 and the checks of validity.
+// tMean_log2s and prediction_log2s are set to 0 where IPD_VALID is not set.
+// Either of them may be NULL if its statistics are not collected, which skips its log2 calls; modelPredictions is read only for prediction_log2s.
+void precompute_ipd_values(float const *tMeans, float const *modelPredictions, unsigned int const *coverage, size_t const length,
+        unsigned int const coverage_threshold, int const check_outside_coverage,
+        double *tMean_log2s, double *prediction_log2s, unsigned char *flags) {
+    if (tMean_log2s != NULL && prediction_log2s != NULL) {
+        precompute_values(tMeans, modelPredictions, coverage, length, coverage_threshold, check_outside_coverage, 1, 1, tMean_log2s, prediction_log2s, flags);
+    } else if (tMean_log2s != NULL) {
+        precompute_values(tMeans, modelPredictions, coverage, length, coverage_threshold, check_outside_coverage, 1, 0, tMean_log2s, prediction_log2s, flags);
+    } else if (prediction_log2s != NULL) {
+        precompute_values(tMeans, modelPredictions, coverage, length, coverage_threshold, check_outside_coverage, 0, 1, tMean_log2s, prediction_log2s, flags);
+    } else {
+        precompute_values(tMeans, modelPredictions, coverage, length, coverage_threshold, check_outside_coverage, 0, 0, tMean_log2s, prediction_log2s, flags);
+    }
+    return;
+}
+
+// Encode n bases, each of which is the first character of an elem_size-byte string in bases, into codes:
+// the index in chars, or IPD_BASE_NULL for a null character. codes may be the same array as bases.
+void encode_bases(char const *chars, char const *bases, size_t const elem_size, size_t const n, uint8_t *codes) {
+    size_t chars_size = strlen(chars);
+    if(chars_size >= IPD_BASE_NULL){ fprintf(stderr, "ERROR: Too many characters in chars: %zu\n", chars_size); exit(EXIT_FAILURE); }
+    // Table to encode a base character; characters not in chars are -1
+    int base_codes[256];
+    for (size_t j = 0; j < 256; j++) {
+        base_codes[j] = -1;
+    }
+    for (size_t j = 0; j < chars_size; j++) {
+        base_codes[(unsigned char)chars[j]] = j;
+    }
+    base_codes[0] = IPD_BASE_NULL;
+    for (size_t i = 0; i < n; i++) {
+        char cur_base = bases[i * elem_size];
+        int base_code = base_codes[(unsigned char)cur_base];
+        if(base_code < 0) {
+            fprintf(stderr, "ERROR: Unexpected base was observed: %c\n", cur_base);
+            exit(EXIT_FAILURE);
+        }
+        codes[i] = base_code;
+    }
+    return;
+}
+
+// Copy an array interleaving the positive and negative strands (x_1 y_1 x_2 y_2 ... x_n y_n) of elem_size-byte elements
+// into pos (x_1 x_2 ... x_n) and neg (y_n ... y_2 y_1), i.e. each strand ordered from its own 5' end.
+// pos or neg may be NULL to skip the strand.
+void split_strands(void const *src, size_t const elem_size, size_t const n, void *pos, void *neg) {
+    char const *s = (char const *)src;
+    char *p = (char *)pos;
+    char *q = (char *)neg;
+    if (p != NULL && q != NULL) {
+        for (size_t i = 0; i < n; i++) {
+            memcpy(p + i * elem_size, s + (2 * i) * elem_size, elem_size);
+            memcpy(q + (n - 1 - i) * elem_size, s + (2 * i + 1) * elem_size, elem_size);
+        }
+    } else if (p != NULL) {
+        for (size_t i = 0; i < n; i++) {
+            memcpy(p + i * elem_size, s + (2 * i) * elem_size, elem_size);
+        }
+    } else if (q != NULL) {
+        for (size_t i = 0; i < n; i++) {
+            memcpy(q + (n - 1 - i) * elem_size, s + (2 * i + 1) * elem_size, elem_size);
+        }
+    }
+    return;
+}
+
+// Reverse an array of n elements of elem_size bytes in place
+void reverse_elements(void *buf, size_t const elem_size, size_t const n) {
+    char *b = (char *)buf;
+    char tmp[elem_size];
+    for (size_t i = 0; i < n / 2; i++) {
+        memcpy(tmp, b + i * elem_size, elem_size);
+        memcpy(b + i * elem_size, b + (n - 1 - i) * elem_size, elem_size);
+        memcpy(b + (n - 1 - i) * elem_size, tmp, elem_size);
+    }
+    return;
+}
+
+// Number of slots of a sparse table when it is allocated or cleared
+#define IPD_TABLE_INITIAL_SLOTS 1024
+
+// Allocate a table of kmers_size k-mers with rows of row_length cells. Call clear_ipd_table before use.
+// A sparse table grows as k-mers are observed, so its memory depends on the number of distinct k-mers instead of kmers_size.
+void alloc_ipd_table(struct ipd_table *table, size_t const kmers_size, size_t const row_length, int const sparse) {
+    table->kmers_size = kmers_size;
+    table->row_length = row_length;
+    table->sparse = sparse;
+    table->keys = NULL;
+    table->slot_num = 0;
+    table->used_num = 0;
+    size_t row_num = sparse ? IPD_TABLE_INITIAL_SLOTS : kmers_size;
+    if(row_length == 0 || row_num > SIZE_MAX / sizeof(struct ipd_cell) / row_length) { fprintf(stderr, "ERROR: malloc will overflow\n"); exit(EXIT_FAILURE); }
+    table->cells = (struct ipd_cell *)malloc(row_num * row_length * sizeof(struct ipd_cell));
+    if(table->cells == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for cells\n"); exit(EXIT_FAILURE); }
+    if(sparse) {
+        table->keys = (size_t *)malloc(row_num * sizeof(size_t));
+        if(table->keys == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for keys\n"); exit(EXIT_FAILURE); }
+        table->slot_num = row_num;
+    }
+    return;
+}
+
+// Upper bound of the bytes of a table of kmers_size k-mers with rows of row_length cells after at most kmers_observed distinct k-mers are added.
+// A sparse table grows by doubling its slots to keep the load factor at most 1/2.
+// The memory planner passes the number of positions as kmers_observed, i.e. assumes that every position is a distinct k-mer,
+// so its estimate of sparse tables is far above their size unless k is long enough to make most k-mers unique.
+size_t estimate_ipd_table_bytes(size_t const kmers_size, size_t const row_length, int const sparse, size_t const kmers_observed) {
+    size_t row_bytes = row_length * sizeof(struct ipd_cell);
+    if(!sparse) {
+        return kmers_size * row_bytes;
+    }
+    size_t rows = (kmers_observed < kmers_size) ? kmers_observed : kmers_size;
+    size_t slot_num = IPD_TABLE_INITIAL_SLOTS;
+    while(slot_num < 2 * rows) {
+        slot_num *= 2;
+    }
+    return slot_num * (row_bytes + sizeof(size_t));
+}
+
+// Reset all the sums to 0. A sparse table keeps its slots for the next use.
+void clear_ipd_table(struct ipd_table *table) {
+    if(table->sparse) {
+        memset(table->keys, 0xFF, table->slot_num * sizeof(size_t));
+        table->used_num = 0;
+    } else {
+        memset(table->cells, 0, table->kmers_size * table->row_length * sizeof(struct ipd_cell));
+    }
+    return;
+}
+
+// Slot of kmer in a sparse table, which is either the slot of kmer or the empty slot to insert it
+static size_t find_ipd_table_slot(struct ipd_table const *table, size_t const kmer) {
+    size_t mask = table->slot_num - 1;
+    // Fibonacci hashing spreads successive k-mer indices
+    size_t slot = (size_t)(((uint64_t)kmer * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & mask;
+    while(table->keys[slot] != kmer && table->keys[slot] != SIZE_MAX) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Double the slots of a sparse table, moving the used rows
+static void grow_ipd_table(struct ipd_table *table) {
+    struct ipd_table old = *table;
+    if(old.slot_num > SIZE_MAX / 2 / sizeof(struct ipd_cell) / old.row_length) { fprintf(stderr, "ERROR: malloc will overflow\n"); exit(EXIT_FAILURE); }
+    table->slot_num = old.slot_num * 2;
+    table->cells = (struct ipd_cell *)malloc(table->slot_num * table->row_length * sizeof(struct ipd_cell));
+    if(table->cells == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for cells\n"); exit(EXIT_FAILURE); }
+    table->keys = (size_t *)malloc(table->slot_num * sizeof(size_t));
+    if(table->keys == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for keys\n"); exit(EXIT_FAILURE); }
+    memset(table->keys, 0xFF, table->slot_num * sizeof(size_t));
+    for(size_t i = 0; i < old.slot_num; i++) {
+        if(old.keys[i] != SIZE_MAX) {
+            size_t slot = find_ipd_table_slot(table, old.keys[i]);
+            table->keys[slot] = old.keys[i];
+            memcpy(table->cells + slot * table->row_length, old.cells + i * old.row_length, old.row_length * sizeof(struct ipd_cell));
+        }
+    }
+    free(old.cells);
+    free(old.keys);
+    return;
+}
+
+static struct ipd_cell *get_sparse_ipd_table_row(struct ipd_table *table, size_t const kmer) {
+    size_t slot = find_ipd_table_slot(table, kmer);
+    if(table->keys[slot] == SIZE_MAX) {
+        // Keep the load factor at most 1/2 so that probing stays short
+        if(2 * (table->used_num + 1) > table->slot_num) {
+            grow_ipd_table(table);
+            slot = find_ipd_table_slot(table, kmer);
+        }
+        table->keys[slot] = kmer;
+        table->used_num++;
+        memset(table->cells + slot * table->row_length, 0, table->row_length * sizeof(struct ipd_cell));
+    }
+    return table->cells + slot * table->row_length;
+}
+
+static inline struct ipd_cell *ipd_table_row(struct ipd_table *table, size_t const kmer) {
+    if(table->sparse) {
+        return get_sparse_ipd_table_row(table, kmer);
+    }
+    return table->cells + kmer * table->row_length;
+}
+
+// Row of kmer to add values to, which is inserted with zeros into a sparse table if kmer has not been observed.
+// The row may be moved by the next call for a sparse table.
+struct ipd_cell *get_ipd_table_row(struct ipd_table *table, size_t const kmer) {
+    return ipd_table_row(table, kmer);
+}
+
+// Row of kmer, or NULL if kmer has not been observed in a sparse table
+struct ipd_cell const *find_ipd_table_row(struct ipd_table const *table, size_t const kmer) {
+    if(table->sparse) {
+        size_t slot = find_ipd_table_slot(table, kmer);
+        return (table->keys[slot] == SIZE_MAX) ? NULL : table->cells + slot * table->row_length;
+    }
+    return table->cells + kmer * table->row_length;
+}
+
+// Add size successive cells of s to those of d
+void add_ipd_cells(struct ipd_cell *d, struct ipd_cell const *s, size_t const size) {
+    for(size_t j = 0; j < size; j++) {
+        d[j].tMean_sum += s[j].tMean_sum;
+        d[j].tMean_sq_sum += s[j].tMean_sq_sum;
+        d[j].tMean_log2_sum += s[j].tMean_log2_sum;
+        d[j].tMean_log2_sq_sum += s[j].tMean_log2_sq_sum;
+        d[j].prediction_sum += s[j].prediction_sum;
+        d[j].prediction_sq_sum += s[j].prediction_sq_sum;
+        d[j].prediction_log2_sum += s[j].prediction_log2_sum;
+        d[j].prediction_log2_sq_sum += s[j].prediction_log2_sq_sum;
+        d[j].count += s[j].count;
+    }
+    return;
+}
+
+// Add the sums of src to dst of the same k-mers and row length
+void add_ipd_table(struct ipd_table *dst, struct ipd_table const *src) {
+    size_t row_num = src->sparse ? src->slot_num : src->kmers_size;
+    for(size_t i = 0; i < row_num; i++) {
+        if(src->sparse && src->keys[i] == SIZE_MAX) {
+            continue;
+        }
+        add_ipd_cells(ipd_table_row(dst, src->sparse ? src->keys[i] : i), src->cells + i * src->row_length, src->row_length);
+    }
+    return;
+}
+
+// Add the table of k-mers of length k with outside_length collected from src, a table of length src_k with src_outside_length, to dst.
+// The k-mer of dst is the substring of the k-mer of src starting at kmer_offset, i.e. the row of each k-mer of src is added to the row of
+// its substring, and the cells of the window of the substring are taken from the row, which requires
+// k + kmer_offset <= src_k and outside_length <= src_outside_length + min(kmer_offset, src_k - kmer_offset - k).
+// Windows clipped by the ends of strands are handled in the same way as collect_ipd_by_kmer_strand.
+// Occurrences of the substring are observed only as parts of src k-mers, so the result counts those whose flanking bases
+// within the src k-mer are also covered and not null. It is identical to collecting directly if k == src_k and kmer_offset == 0.
+void derive_ipd_table(struct ipd_table *dst, size_t const k, size_t const outside_length, struct ipd_table const *src,
+        size_t const src_k, size_t const src_outside_length, size_t const chars_size, size_t const kmer_offset) {
+    if(k == 0 || k + kmer_offset > src_k) { fprintf(stderr, "ERROR: %zu-mer at %zu is not a substring of %zu-mer\n", k, kmer_offset, src_k); exit(EXIT_FAILURE); }
+    size_t const trailing = src_k - kmer_offset - k;
+    if(outside_length > src_outside_length + ((kmer_offset < trailing) ? kmer_offset : trailing)) {
+        fprintf(stderr, "ERROR: outside_length %zu is not covered by the rows of %zu-mers\n", outside_length, src_k); exit(EXIT_FAILURE);
+    }
+    if(dst->row_length != k + 2 * outside_length || src->row_length != src_k + 2 * src_outside_length) {
+        fprintf(stderr, "ERROR: rows of the table do not match k and outside_length\n"); exit(EXIT_FAILURE);
+    }
+    // The k-mer index has the first base as the highest digit, so the substring is (index / chars_size ^ trailing) % chars_size ^ k
+    size_t divisor = 1;
+    for(size_t j = 0; j < trailing; j++) {
+        divisor *= chars_size;
+    }
+    size_t const first_cell = src_outside_length + kmer_offset - outside_length;
+    size_t row_num = src->sparse ? src->slot_num : src->kmers_size;
+    for(size_t i = 0; i < row_num; i++) {
+        if(src->sparse && src->keys[i] == SIZE_MAX) {
+            continue;
+        }
+        size_t kmer = (src->sparse ? src->keys[i] : i) / divisor % dst->kmers_size;
+        add_ipd_cells(ipd_table_row(dst, kmer), src->cells + i * src->row_length + first_cell, dst->row_length);
+    }
+    return;
+}
+
+void free_ipd_table(struct ipd_table *table) {
+    free(table->cells);
+    free(table->keys);
+    return;
+}
+
+// Statistics collected by collect_ipd_by_kmer_strand, see set_ipd_stats
+static int ipd_stats = IPD_STAT_ALL;
+
+// Select the statistics collected by collect_ipd_by_kmer_strand as a combination of IPD_STAT_*.
+// Each selection runs its own kernel, which reads only the input arrays of the selected statistics,
+// and the cells of the other statistics are left untouched. count is always collected.
+// This is not thread-safe; call it before starting threads.
+void set_ipd_stats(int const stats) {
+    if(stats <= 0 || stats > IPD_STAT_ALL){ fprintf(stderr, "ERROR: invalid selection of statistics: %d\n", stats); exit(EXIT_FAILURE); }
+    ipd_stats = stats;
+    return;
+}
+
+// Add the values of length successive elements from first to length successive cells, skipping elements without IPD_VALID.
+// Only the statistics in stats, a constant combination of IPD_STAT_*, are added, and the input arrays of the others are not read.
+// tMean_log2s and prediction_log2s must be 0 where IPD_VALID is not set, as precompute_ipd_values does.
+typedef void (*add_window_func)(int const stats, struct ipd_cell *cells, float const *tMeans, double const *tMean_log2s,
+        float const *modelPredictions, double const *prediction_log2s, unsigned char const *flags, size_t const first, size_t const length);
+
+// Add the values of one element to a cell
+static inline __attribute__((always_inline)) void add_element(int const stats, struct ipd_cell *cell, float const tMean, double const tMean_log2,
+        float const modelPrediction, double const prediction_log2) {
+    double prediction = modelPrediction;
+    if (stats & IPD_STAT_IPD) {
+        cell->tMean_sum += tMean;
+        cell->tMean_sq_sum += (double)tMean * tMean;
+    }
+    if (stats & IPD_STAT_IPD_LOG2) {
+        cell->tMean_log2_sum += tMean_log2;
+        cell->tMean_log2_sq_sum += tMean_log2 * tMean_log2;
+    }
+    if (stats & IPD_STAT_PRED) {
+        cell->prediction_sum += prediction;
+        cell->prediction_sq_sum += prediction * prediction;
+    }
+    if (stats & IPD_STAT_PRED_LOG2) {
+        cell->prediction_log2_sum += prediction_log2;
+        cell->prediction_log2_sq_sum += prediction_log2 * prediction_log2;
+    }
+    cell->count += 1;
+    return;
+}
+
+// Add the element x of the input arrays to cell
+static inline __attribute__((always_inline)) void add_element_at(int const stats, struct ipd_cell *cell, float const *tMeans, double const *tMean_log2s,
+        float const *modelPredictions, double const *prediction_log2s, size_t const x) {
+    add_element(stats, cell, (stats & IPD_STAT_IPD) ? tMeans[x] : 0.0f, (stats & IPD_STAT_IPD_LOG2) ? tMean_log2s[x] : 0.0,
+            (stats & IPD_STAT_PRED) ? modelPredictions[x] : 0.0f, (stats & IPD_STAT_PRED_LOG2) ? prediction_log2s[x] : 0.0);
+    return;
+}
+
+static inline __attribute__((always_inline)) void add_window_scalar(int const stats, struct ipd_cell *cells, float const *tMeans, double const *tMean_log2s,
+        float const *modelPredictions, double const *prediction_log2s, unsigned char const *flags, size_t const first, size_t const length) {
+    for (size_t i = 0; i < length; i++) {
+        if (flags[first + i] & IPD_VALID) {
+            add_element_at(stats, &cells[i], tMeans, tMean_log2s, modelPredictions, prediction_log2s, first + i);
+        }
+    }
+    return;
+}
+
+#ifdef IPD_X86
+// The vectorized versions add {x, x * x} and {log2(x), log2(x) * log2(x)} of tMean and modelPrediction at once,
+// so each pair of fields must be contiguous, and AVX2 adds the four fields of x and log2(x) at once if both are selected.
+_Static_assert(offsetof(struct ipd_cell, tMean_sq_sum) == offsetof(struct ipd_cell, tMean_sum) + sizeof(double)
+        && offsetof(struct ipd_cell, tMean_log2_sum) == offsetof(struct ipd_cell, tMean_sum) + 2 * sizeof(double)
+        && offsetof(struct ipd_cell, tMean_log2_sq_sum) == offsetof(struct ipd_cell, tMean_sum) + 3 * sizeof(double)
+        && offsetof(struct ipd_cell, prediction_sq_sum) == offsetof(struct ipd_cell, prediction_sum) + sizeof(double)
+        && offsetof(struct ipd_cell, prediction_log2_sum) == offsetof(struct ipd_cell, prediction_sum) + 2 * sizeof(double)
+        && offsetof(struct ipd_cell, prediction_log2_sq_sum) == offsetof(struct ipd_cell, prediction_sum) + 3 * sizeof(double),
+        "unexpected layout of struct ipd_cell");
+
+// The sums of the j-th cell from the cell of sums, at the same field
+static inline __attribute__((always_inline)) double *next_cell_sums(double *sums, size_t const j) {
+    return (double *)((char *)sums + j * sizeof(struct ipd_cell));
+}
+
+// Add each pair of {x, x * x} of two elements to the two cells from sums
+__attribute__((target("sse4.1")))
+static inline __attribute__((always_inline)) void add_pairs_sse4(double *sums, __m128d const x) {
+    __m128d x_sq = _mm_mul_pd(x, x);
+    __m128d pairs[2] = {_mm_unpacklo_pd(x, x_sq), _mm_unpackhi_pd(x, x_sq)};
+    for (int j = 0; j < 2; j++) {
+        double *cell_sums = next_cell_sums(sums, j);
+        _mm_storeu_pd(cell_sums, _mm_add_pd(_mm_loadu_pd(cell_sums), pairs[j]));
+    }
+    return;
+}
+
+// Two elements at a time: values are converted to double and masked by IPD_VALID,
+// and then each pair of {x, x * x} and {log2(x), log2(x) * log2(x)} is added to a cell.
+__attribute__((target("sse4.1")))
+static inline __attribute__((always_inline)) void add_window_sse4(int const stats, struct ipd_cell *cells, float const *tMeans, double const *tMean_log2s,
+        float const *modelPredictions, double const *prediction_log2s, unsigned char const *flags, size_t const first, size_t const length) {
+    __m128i const valid = _mm_set1_epi64x(IPD_VALID);
+    size_t i = 0;
+    for (; i + 2 <= length; i += 2) {
+        size_t x = first + i;
+        uint16_t flag_pair;
+        memcpy(&flag_pair, flags + x, sizeof(flag_pair));
+        __m128i valid_bits = _mm_and_si128(_mm_cvtepu8_epi64(_mm_cvtsi32_si128(flag_pair)), valid);
+        __m128d mask = _mm_castsi128_pd(_mm_cmpeq_epi64(valid_bits, valid));
+        if (_mm_movemask_pd(mask) == 0) {
+            continue;
+        }
+        struct ipd_cell *cell = &cells[i];
+        if (stats & IPD_STAT_IPD) {
+            add_pairs_sse4(&cell->tMean_sum, _mm_and_pd(_mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((__m128i const *)(tMeans + x)))), mask));
+        }
+        if (stats & IPD_STAT_IPD_LOG2) {
+            add_pairs_sse4(&cell->tMean_log2_sum, _mm_loadu_pd(tMean_log2s + x));
+        }
+        if (stats & IPD_STAT_PRED) {
+            add_pairs_sse4(&cell->prediction_sum, _mm_and_pd(_mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((__m128i const *)(modelPredictions + x)))), mask));
+        }
+        if (stats & IPD_STAT_PRED_LOG2) {
+            add_pairs_sse4(&cell->prediction_log2_sum, _mm_loadu_pd(prediction_log2s + x));
+        }
+        for (int j = 0; j < 2; j++) {
+            cell[j].count += flags[x + j] & IPD_VALID;
+        }
+    }
+    for (; i < length; i++) {
+        if (flags[first + i] & IPD_VALID) {
+            add_element_at(stats, &cells[i], tMeans, tMean_log2s, modelPredictions, prediction_log2s, first + i);
+        }
+    }
+    return;
+}
+
+// Add each pair of {x, x * x} of four elements to the four cells from sums
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void add_pairs_avx2(double *sums, __m256d const x) {
+    __m256d x_sq = _mm256_mul_pd(x, x);
+    // {x_0 xx_0 x_2 xx_2}, {x_1 xx_1 x_3 xx_3}
+    __m256d x_even = _mm256_unpacklo_pd(x, x_sq);
+    __m256d x_odd = _mm256_unpackhi_pd(x, x_sq);
+    __m128d pairs[4] = {
+        _mm256_castpd256_pd128(x_even),
+        _mm256_castpd256_pd128(x_odd),
+        _mm256_extractf128_pd(x_even, 1),
+        _mm256_extractf128_pd(x_odd, 1),
+    };
+    for (int j = 0; j < 4; j++) {
+        double *cell_sums = next_cell_sums(sums, j);
+        _mm_storeu_pd(cell_sums, _mm_add_pd(_mm_loadu_pd(cell_sums), pairs[j]));
+    }
+    return;
+}
+
+// Add {x, x * x, l, l * l} of four elements to the four cells from sums, transposing the 4x4 block
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void add_quads_avx2(double *sums, __m256d const x, __m256d const l) {
+    // {x_0 xx_0 x_2 xx_2}, {x_1 xx_1 x_3 xx_3}, {l_0 ll_0 l_2 ll_2}, {l_1 ll_1 l_3 ll_3}
+    __m256d x_sq = _mm256_mul_pd(x, x);
+    __m256d l_sq = _mm256_mul_pd(l, l);
+    __m256d x_even = _mm256_unpacklo_pd(x, x_sq);
+    __m256d x_odd = _mm256_unpackhi_pd(x, x_sq);
+    __m256d l_even = _mm256_unpacklo_pd(l, l_sq);
+    __m256d l_odd = _mm256_unpackhi_pd(l, l_sq);
+    __m256d rows[4] = {
+        _mm256_permute2f128_pd(x_even, l_even, 0x20),
+        _mm256_permute2f128_pd(x_odd, l_odd, 0x20),
+        _mm256_permute2f128_pd(x_even, l_even, 0x31),
+        _mm256_permute2f128_pd(x_odd, l_odd, 0x31),
+    };
+    for (int j = 0; j < 4; j++) {
+        double *cell_sums = next_cell_sums(sums, j);
+        _mm256_storeu_pd(cell_sums, _mm256_add_pd(_mm256_loadu_pd(cell_sums), rows[j]));
+    }
+    return;
+}
+
+// Four elements at a time: values are converted to double and masked by IPD_VALID,
+// and then the pairs {x, x * x} and {log2(x), log2(x) * log2(x)} are transposed to be added to four cells.
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void add_window_avx2(int const stats, struct ipd_cell *cells, float const *tMeans, double const *tMean_log2s,
+        float const *modelPredictions, double const *prediction_log2s, unsigned char const *flags, size_t const first, size_t const length) {
+    __m256i const valid = _mm256_set1_epi64x(IPD_VALID);
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        size_t x = first + i;
+        uint32_t flag_quad;
+        memcpy(&flag_quad, flags + x, sizeof(flag_quad));
+        __m256i valid_bits = _mm256_and_si256(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(flag_quad)), valid);
+        __m256d mask = _mm256_castsi256_pd(_mm256_cmpeq_epi64(valid_bits, valid));
+        if (_mm256_movemask_pd(mask) == 0) {
+            continue;
+        }
+        struct ipd_cell *cell = &cells[i];
+        if ((stats & IPD_STAT_IPD) && (stats & IPD_STAT_IPD_LOG2)) {
+            add_quads_avx2(&cell->tMean_sum, _mm256_and_pd(_mm256_cvtps_pd(_mm_loadu_ps(tMeans + x)), mask), _mm256_loadu_pd(tMean_log2s + x));
+        } else if (stats & IPD_STAT_IPD) {
+            add_pairs_avx2(&cell->tMean_sum, _mm256_and_pd(_mm256_cvtps_pd(_mm_loadu_ps(tMeans + x)), mask));
+        } else if (stats & IPD_STAT_IPD_LOG2) {
+            add_pairs_avx2(&cell->tMean_log2_sum, _mm256_loadu_pd(tMean_log2s + x));
+        }
+        if ((stats & IPD_STAT_PRED) && (stats & IPD_STAT_PRED_LOG2)) {
+            add_quads_avx2(&cell->prediction_sum, _mm256_and_pd(_mm256_cvtps_pd(_mm_loadu_ps(modelPredictions + x)), mask), _mm256_loadu_pd(prediction_log2s + x));
+        } else if (stats & IPD_STAT_PRED) {
+            add_pairs_avx2(&cell->prediction_sum, _mm256_and_pd(_mm256_cvtps_pd(_mm_loadu_ps(modelPredictions + x)), mask));
+        } else if (stats & IPD_STAT_PRED_LOG2) {
+            add_pairs_avx2(&cell->prediction_log2_sum, _mm256_loadu_pd(prediction_log2s + x));
+        }
+        for (int j = 0; j < 4; j++) {
+            cell[j].count += flags[x + j] & IPD_VALID;
+        }
+    }
+    for (; i < length; i++) {
+        if (flags[first + i] & IPD_VALID) {
+            add_element_at(stats, &cells[i], tMeans, tMean_log2s, modelPredictions, prediction_log2s, first + i);
+        }
+    }
+    return;
+}
+#endif
+
+// Highest instruction set allowed for add_window; -1 before detection
+static int ipd_simd_level = -1;
+
+static int detect_ipd_simd_level(void) {
+#ifdef IPD_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return IPD_SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return IPD_SIMD_SSE4;
+    }
+#endif
+    return IPD_SIMD_NONE;
+}
+
+// Limit the instruction set used to accumulate windows to level (one of IPD_SIMD_*) or lower,
+// and return the level actually used, which is also limited by the CPU.
+// This is not thread-safe; call it before starting threads.
+int set_ipd_simd_level(int const level) {
+    int supported = detect_ipd_simd_level();
+    ipd_simd_level = (level < supported) ? level : supported;
+    return ipd_simd_level;
+}
+
+static int current_ipd_simd_level(void) {
+    if (ipd_simd_level < 0) {
+        ipd_simd_level = detect_ipd_simd_level();
+    }
+    return ipd_simd_level;
+}
+
+// Add the windows of the k-mers whose last base is in [scan_begin, end) to table, skipping those before begin,
+// with the arguments of collect_ipd_by_kmer_strand checked by it.
+// This is inlined into the kernels for each selection of stats, where add_window reads only the arrays of the selected statistics,
+// and into those specialized also for constant k, outside_length and chars_size,
+// where the k-mer index is updated with constant digits, and full windows are added with the constant length k + 2 * outside_length.
+static inline __attribute__((always_inline)) void scan_kmer_windows(size_t const k, size_t const chars_size, size_t const outside_length, int const stats,
+        add_window_func add_window, float const *tMeans, double const *tMean_log2s, uint8_t const *bases, size_t const strand_length,
+        struct ipd_table *table, float const *modelPredictions, double const *prediction_log2s, unsigned char const *flags,
+        size_t const offset, size_t const scan_begin, size_t const begin, size_t const end) {
+    size_t const row_length = k + 2 * outside_length;
+    // Distance from the last base of a k-mer to the first position of its window
+    size_t const lead_length = k + outside_length - 1;
+    // chars_size ^ (k - 1)
+    size_t top_digit = 1;
+    for (size_t j = 0; j + 1 < k; j++) {
+        top_digit *= chars_size;
+    }
+    // Rolling index of the k-mer ending at the current base, where a new base is appended as the lowest digit
+    size_t kmer = 0;
+    // Indicate how many bases is required to collect k successive bases with a valid IPD.
+    // Set to k if the current base is a null character, which means that no valid IPD is at the base
+    int state = k;
+    for (size_t i = scan_begin; i < end; i++) {
+        uint8_t base_code = bases[i - offset];
+        if (base_code == IPD_BASE_NULL) {
+            // Start over because the index cannot hold this base
+            kmer = 0;
+            state = k;
+        } else {
+            kmer = (kmer % top_digit) * chars_size + base_code;
+            if ((flags[i - offset] & IPD_COVERED) == 0) {
+                state = k;
+            } else {
+                state = state - 1;
+            }
+        }
+        // Collect IPD using the k-mer index
+        if(state <= 0 && i >= begin) {
+            // Reset to avoid negative overflow
+            state = 0;
+            struct ipd_cell *row = table->sparse ? get_sparse_ipd_table_row(table, kmer) : table->cells + kmer * row_length;
+            if (i >= lead_length && i + outside_length < strand_length) {
+                add_window(stats, row, tMeans, tMean_log2s, modelPredictions, prediction_log2s, flags, i - lead_length - offset, row_length);
+                continue;
+            }
+            // The window [i - lead_length, i + outside_length] clipped to the strand
+            size_t window_first = (i > lead_length) ? i - lead_length : 0;
+            size_t window_last = (i + outside_length < strand_length) ? i + outside_length : strand_length - 1;
+            add_window(stats, row + (window_first + lead_length - i), tMeans, tMean_log2s, modelPredictions, prediction_log2s, flags,
+                    window_first - offset, window_last - window_first + 1);
+        }
+    }
+    return;
+}
+
+typedef void (*scan_kmer_windows_func)(float const *tMeans, double const *tMean_log2s, uint8_t const *bases, size_t const strand_length,
+        struct ipd_table *table, float const *modelPredictions, double const *prediction_log2s, unsigned char const *flags,
+        size_t const offset, size_t const scan_begin, size_t const begin, size_t const end);
+
+typedef void (*generic_scan_kmer_windows_func)(size_t const k, size_t const chars_size, size_t const outside_length,
+        float const *tMeans, double const *tMean_log2s, uint8_t const *bases, size_t const strand_length,
+        struct ipd_table *table, float const *modelPredictions, double const *prediction_log2s, unsigned char const *flags,
+        size_t const offset, size_t const scan_begin, size_t const begin, size_t const end);
+
+// Generic kernels for any k, outside_length and chars_size, one for each selection of statistics (1 to IPD_STAT_ALL)
+// and each instruction set of add_window
+#define IPD_STAT_SELECTIONS(Y) \
+    Y(1) Y(2) Y(3) Y(4) Y(5) Y(6) Y(7) Y(8) Y(9) Y(10) Y(11) Y(12) Y(13) Y(14) Y(15)
+
+#define DEFINE_GENERIC_SCAN_KMER_WINDOWS(S, NAME, TARGET) \
+    TARGET static void scan_kmer_windows_generic_##S##_##NAME(size_t const k, size_t const chars_size, size_t const outside_length, \
+            float const *tMeans, double const *tMean_log2s, uint8_t const *bases, size_t const strand_length, \
+            struct ipd_table *table, float const *modelPredictions, double const *prediction_log2s, unsigned char const *flags, \
+            size_t const offset, size_t const scan_begin, size_t const begin, size_t const end) { \
+        scan_kmer_windows(k, chars_size, outside_length, S, add_window_##NAME, tMeans, tMean_log2s, bases, strand_length, \
+                table, modelPredictions, prediction_log2s, flags, offset, scan_begin, begin, end); \
+    }
+
+// Kernels specialized for (k, outside_length) with 4 characters, e.g. ACGT, for each instruction set of add_window.
+// The list can be replaced at compile time, e.g. -DIPD_SPECIALIZED_KERNELS='X(3, 15) X(4, 15)', and other settings use the generic kernels.
+// Each (k, outside_length) is specialized for the selections of statistics in IPD_SPECIALIZED_STATS, given as Y(K, L, NAME, STATS).
+#ifndef IPD_SPECIALIZED_KERNELS
+#define IPD_SPECIALIZED_KERNELS \
+    X(1, 10) X(2, 10) X(3, 10) X(4, 10) X(5, 10) X(6, 10) \
+    X(1, 20) X(2, 20) X(3, 20) X(4, 20) X(5, 20) X(6, 20)
+#endif
+#ifndef IPD_SPECIALIZED_STATS
+#define IPD_SPECIALIZED_STATS(Y, K, L) \
+    Y(K, L, all, IPD_STAT_ALL) Y(K, L, ipd, IPD_STAT_IPD)
+#endif
+#define IPD_SPECIALIZED_CHARS_SIZE 4
+
+#define DEFINE_SCAN_KMER_WINDOWS(K, L, S_NAME, S, NAME, TARGET) \
+    TARGET static void scan_kmer_windows_##K##_##L##_##S_NAME##_##NAME(float const *tMeans, double const *tMean_log2s, uint8_t const *bases, size_t const strand_length, \
+            struct ipd_table *table, float const *modelPredictions, double const *prediction_log2s, unsigned char const *flags, \
+            size_t const offset, size_t const scan_begin, size_t const begin, size_t const end) { \
+        scan_kmer_windows(K, IPD_SPECIALIZED_CHARS_SIZE, L, S, add_window_##NAME, tMeans, tMean_log2s, bases, strand_length, \
+                table, modelPredictions, prediction_log2s, flags, offset, scan_begin, begin, end); \
+    }
+
+struct specialized_kernel {
+    size_t k;
+    size_t outside_length;
+    int stats;
+    // Indexed by IPD_SIMD_*
+    scan_kmer_windows_func scan[3];
+};
+
+#ifdef IPD_X86
+#define Y(S) \
+    DEFINE_GENERIC_SCAN_KMER_WINDOWS(S, scalar, ) \
+    DEFINE_GENERIC_SCAN_KMER_WINDOWS(S, sse4, __attribute__((target("sse4.1")))) \
+    DEFINE_GENERIC_SCAN_KMER_WINDOWS(S, avx2, __attribute__((target("avx2"))))
+IPD_STAT_SELECTIONS(Y)
+#undef Y
+#define Y(S) [S] = {scan_kmer_windows_generic_##S##_scalar, scan_kmer_windows_generic_##S##_sse4, scan_kmer_windows_generic_##S##_avx2},
+#else
+#define Y(S) DEFINE_GENERIC_SCAN_KMER_WINDOWS(S, scalar, )
+IPD_STAT_SELECTIONS(Y)
+#undef Y
+#define Y(S) [S] = {scan_kmer_windows_generic_##S##_scalar, scan_kmer_windows_generic_##S##_scalar, scan_kmer_windows_generic_##S##_scalar},
+#endif
+// Indexed by the selection of statistics and IPD_SIMD_*
+static generic_scan_kmer_windows_func const generic_kernels[IPD_STAT_ALL + 1][3] = {
+    IPD_STAT_SELECTIONS(Y)
+};
+#undef Y
+
+#ifdef IPD_X86
+#define Y(K, L, S_NAME, S) \
+    DEFINE_SCAN_KMER_WINDOWS(K, L, S_NAME, S, scalar, ) \
+    DEFINE_SCAN_KMER_WINDOWS(K, L, S_NAME, S, sse4, __attribute__((target("sse4.1")))) \
+    DEFINE_SCAN_KMER_WINDOWS(K, L, S_NAME, S, avx2, __attribute__((target("avx2"))))
+#define X(K, L) IPD_SPECIALIZED_STATS(Y, K, L)
+IPD_SPECIALIZED_KERNELS
+#undef X
+#undef Y
+#define Y(K, L, S_NAME, S) {K, L, S, {scan_kmer_windows_##K##_##L##_##S_NAME##_scalar, scan_kmer_windows_##K##_##L##_##S_NAME##_sse4, \
+    scan_kmer_windows_##K##_##L##_##S_NAME##_avx2}},
+#else
+#define Y(K, L, S_NAME, S) DEFINE_SCAN_KMER_WINDOWS(K, L, S_NAME, S, scalar, )
+#define X(K, L) IPD_SPECIALIZED_STATS(Y, K, L)
+IPD_SPECIALIZED_KERNELS
+#undef X
+#undef Y
+#define Y(K, L, S_NAME, S) {K, L, S, {scan_kmer_windows_##K##_##L##_##S_NAME##_scalar, scan_kmer_windows_##K##_##L##_##S_NAME##_scalar, \
+    scan_kmer_windows_##K##_##L##_##S_NAME##_scalar}},
+#endif
+#define X(K, L) IPD_SPECIALIZED_STATS(Y, K, L)
+static struct specialized_kernel const specialized_kernels[] = {
+    IPD_SPECIALIZED_KERNELS
+};
+#undef X
+#undef Y
+
+// Whether collect_ipd_by_kmer_strand uses the specialized kernels when they match the settings
+static int use_specialized_kernels = 1;
+
+// Enable or disable the kernels specialized at compile time, which give exactly the same results as the generic kernels.
+// This is not thread-safe; call it before starting threads.
+void set_ipd_specialized_kernels(int const enabled) {
+    use_specialized_kernels = enabled;
+    return;
+}
+
+static scan_kmer_windows_func select_specialized_kernel(size_t const k, size_t const chars_size, size_t const outside_length,
+        int const stats, int const simd_level) {
+    if (!use_specialized_kernels || chars_size != IPD_SPECIALIZED_CHARS_SIZE) {
+        return NULL;
+    }
+    for (size_t x = 0; x < sizeof(specialized_kernels) / sizeof(specialized_kernels[0]); x++) {
+        if (specialized_kernels[x].k == k && specialized_kernels[x].outside_length == outside_length && specialized_kernels[x].stats == stats) {
+            return specialized_kernels[x].scan[simd_level];
+        }
+    }
+    return NULL;
+}
+
+// Collect IPD values by k-mer on one strand, only for k-mers whose last (3'-most) base is in [begin, end).
+// Input arrays are ordered from 5' to 3' of the strand of length strand_length, and hold its elements [offset, offset + length),
+// which must cover [begin - halo, end + halo) clipped to [0, strand_length), where halo == k + outside_length.
+// tMean_log2s, prediction_log2s and flags are precomputed by precompute_ipd_values.
+// Only the statistics selected by set_ipd_stats are added, and the arrays of the others are not read and may be NULL:
+// tMeans for IPD_STAT_IPD, tMean_log2s for IPD_STAT_IPD_LOG2, modelPredictions for IPD_STAT_PRED and prediction_log2s for IPD_STAT_PRED_LOG2.
+// Sums are added to table, where the cell of position j (0 <= j < k + 2 * outside_length) around k-mer index x is the j-th cell of the row of x,
+// and j == outside_length is the 5' end of the k-mer.
+void collect_ipd_by_kmer_strand(size_t const k, char const *chars, float const *tMeans, double const *tMean_log2s, uint8_t const *bases, size_t const strand_length,
+        struct ipd_table *table, float const *modelPredictions, double const *prediction_log2s, unsigned char const *flags, size_t const outside_length,
+        size_t const offset, size_t const length, size_t const begin, size_t const end) {
+    if(k > strand_length){ fprintf(stderr, "ERROR: length of input kinetics data is shorter than the length of k-mer\n"); exit(EXIT_FAILURE); }
+    if(begin > end || end > strand_length){ fprintf(stderr, "ERROR: invalid segment: [%zu, %zu)\n", begin, end); exit(EXIT_FAILURE); }
+    if(begin == end){ return; }
+    // Distance from the last base of a k-mer to the first position of its window
+    size_t const lead_length = k + outside_length - 1;
+    // Bases before the segment are scanned only to fill the k-mer index
+    size_t const scan_begin = (begin > k - 1) ? begin - (k - 1) : 0;
+    size_t const window_begin = (begin > lead_length) ? begin - lead_length : 0;
+    size_t const window_end = (end + outside_length < strand_length) ? end + outside_length : strand_length;
+    if(offset > window_begin || offset + length < window_end){
+        fprintf(stderr, "ERROR: input data [%zu, %zu) does not cover the halo of segment [%zu, %zu)\n", offset, offset + length, begin, end); exit(EXIT_FAILURE);
+    }
+    size_t chars_size = strlen(chars);
+    if(table->row_length != k + 2 * outside_length){ fprintf(stderr, "ERROR: rows of the table do not match k and outside_length\n"); exit(EXIT_FAILURE); }
+    int simd_level = current_ipd_simd_level();
+    scan_kmer_windows_func scan = select_specialized_kernel(k, chars_size, outside_length, ipd_stats, simd_level);
+    if (scan != NULL) {
+        scan(tMeans, tMean_log2s, bases, strand_length, table, modelPredictions, prediction_log2s, flags, offset, scan_begin, begin, end);
+        return;
+    }
+    generic_kernels[ipd_stats][simd_level](k, chars_size, outside_length, tMeans, tMean_log2s, bases, strand_length,
+            table, modelPredictions, prediction_log2s, flags, offset, scan_begin, begin, end);
+    return;
+}
 
 // Collect IPD values by k-mer.
 // k-mer is represented as a number with a radix of the size of chars,
@@ -13,121 +799,60 @@
 // where, for example,
 // x    | A C G T
 // T[x] | 0 1 2 3
+// bases are encoded by encode_bases.
 //
 // coverage_threshold: IPD with coverage >= coverage_threshold will be used
 // check_outside_coverage: whether to check coverage condition outside k-mer (1: true)
-void collect_ipd_by_kmer(size_t const k, char const *chars, float const *tMeans, char **bases, size_t const dim,
+void collect_ipd_by_kmer(size_t const k, char const *chars, float const *tMeans, uint8_t const *bases, size_t const dim,
         double *tMean_sum, double *tMean_sq_sum, double *tMean_log2_sum, double *tMean_log2_sq_sum,
         double *prediction_sum, double *prediction_sq_sum, double *prediction_log2_sum, double *prediction_log2_sq_sum, size_t *count, float const *modelPredictions,
         unsigned int const *coverage, unsigned int const coverage_threshold,
         size_t const outside_length, int const check_outside_coverage) {
     if(dim % 2 != 0){ fprintf(stderr, "ERROR: length of input kinetics data must be even\n"); exit(EXIT_FAILURE); }
-    if(k > dim / 2){ fprintf(stderr, "ERROR: length of input kinetics data is shorter than the length of k-mer\n"); exit(EXIT_FAILURE); }
-    size_t chars_size = strlen(chars);
-    size_t total_length = k + 2 * outside_length;
-    // Prepare context holders for positive and negative strands
-    int pos_context[k];
-    int neg_context[k];
-    int *context;
-    // Indicate how many bases is required to collect k successive bases with a valid IPD.
-    // Set to k if the current base is a null character, which means that no valid IPD is at the base
-    int pos_state = k;
-    int neg_state = k;
-    int *state;
-    // holders of tMean values for the surrounding region (useless?)
-    //float pos_tMean_holder[k + 2 * outside_length];
-    //float neg_tMean_holder[k + 2 * outside_length];
-    for (size_t i = 0; i < dim; i++) {
-        // Detect the current strand
-        int isPositive = (i % 2 == 0);
-        if(isPositive) {
-            context = pos_context;
-            state = &pos_state;
-        } else {
-            context = neg_context;
-            state = &neg_state;
-        }
-        // Update context
-        // Each context is oriented from 5' to 3' of the positive strand
-        // For example, given a sequence
-        // positive: 5'- ... x_1 x_2 ... x_k ... -3'
-        // negative: 3'- ... y_1 y_2 ... y_k ... -5',
-        // then PacBio HDF5 files contain data arrays (such as bases of this code) in the order of x_1 y_1 x_2 y_2 ..., and
-        // pos_context: x_1 x_2 ... x_k
-        // neg_context: y_1 y_2 ... y_k
-        char *base_char = strchr(chars, bases[i][0]);
-        unsigned int cur_coverage = coverage[i];
-        if(base_char == NULL) {
-            fprintf(stderr, "ERROR: Unexpected base was observed: %c\n", bases[i][0]);
-            exit(EXIT_FAILURE);
-        } else {
-            for (size_t j = 0; j < k - 1; j++) {
-                context[j] = context[j + 1];
-            }
-            context[k - 1] = base_char - chars;
-            if (context[k - 1] == chars_size || cur_coverage < coverage_threshold) {
-                *state = k;
-            } else {
-                *state = *state - 1;
-            }
-        }
-        // Collect IPD using context
-        if(*state <= 0) {
-            // Reset to avoid negative overflow
-            *state = 0;
-            size_t sum_idx = 0;
-            for (size_t j = 0; j < k; j++) {
-                size_t context_idx = (isPositive) ? j : k - 1 - j;
-                sum_idx = chars_size * sum_idx + context[context_idx];
-            }
-            sum_idx *= total_length;
-            long long int tMean_idx_min_raw = i - 2 * (k + outside_length - 1);
-            long long int tMean_idx_min = (tMean_idx_min_raw < 0) ? 0 : tMean_idx_min_raw;
-            long long int tMean_idx_max_raw = i + 2 * outside_length;
-            //size_t tMean_idx_max = (tMean_idx_max_raw <= dim) ? tMean_idx_max_raw : (isPositive ? (dim - 2) : (dim - 1));
-            long long int tMean_idx_max = (tMean_idx_max_raw <= dim - 1) ? tMean_idx_max_raw : (dim - 1);
-            // Shift sum_idx when tMean_idx_min or tMean_idx_max is shifted
-            sum_idx += (isPositive) ? (tMean_idx_min - tMean_idx_min_raw) / 2 : (tMean_idx_max_raw - tMean_idx_max) / 2;
-            if(isPositive) {
-                for (long long int tMean_idx = tMean_idx_min; tMean_idx <= tMean_idx_max; tMean_idx += 2) {
-                    double tMean = tMeans[tMean_idx];
-                    double prediction = modelPredictions[tMean_idx];
-                    if (tMean > 0.0 && (check_outside_coverage != 1 || coverage[tMean_idx] >= coverage_threshold)) {
-                        tMean_sum[sum_idx] += tMean;
-                        tMean_sq_sum[sum_idx] += tMean * tMean;
-                        double tMean_log2 = log2(tMean);
-                        tMean_log2_sum[sum_idx] += tMean_log2;
-                        tMean_log2_sq_sum[sum_idx] += tMean_log2 * tMean_log2;
-                        prediction_sum[sum_idx] += prediction;
-                        prediction_sq_sum[sum_idx] += prediction * prediction;
-                        double prediction_log2 = log2(prediction);
-                        prediction_log2_sum[sum_idx] += prediction_log2;
-                        prediction_log2_sq_sum[sum_idx] += prediction_log2 * prediction_log2;
-                        count[sum_idx] += 1;
-                    }
-                    ++sum_idx;
-                }
-            } else {
-                for (long long int tMean_idx = tMean_idx_max; tMean_idx >= tMean_idx_min; tMean_idx -= 2) {
-                    double tMean = tMeans[tMean_idx];
-                    double prediction = modelPredictions[tMean_idx];
-                    if (tMean > 0.0 && (check_outside_coverage != 1 || coverage[tMean_idx] >= coverage_threshold)) {
-                        tMean_sum[sum_idx] += tMean;
-                        tMean_sq_sum[sum_idx] += tMean * tMean;
-                        double tMean_log2 = log2(tMean);
-                        tMean_log2_sum[sum_idx] += tMean_log2;
-                        tMean_log2_sq_sum[sum_idx] += tMean_log2 * tMean_log2;
-                        prediction_sum[sum_idx] += prediction;
-                        prediction_sq_sum[sum_idx] += prediction * prediction;
-                        double prediction_log2 = log2(prediction);
-                        prediction_log2_sum[sum_idx] += prediction_log2;
-                        prediction_log2_sq_sum[sum_idx] += prediction_log2 * prediction_log2;
-                        count[sum_idx] += 1;
-                    }
-                    ++sum_idx;
-                }
-            }
+    struct ipd_table table;
+    alloc_ipd_table(&table, (size_t)(pow(strlen(chars), k) + 0.5), k + 2 * outside_length, 0);
+    clear_ipd_table(&table);
+    // Each strand is processed separately from its own 5' end
+    size_t n = dim / 2;
+    float *strand_tMeans[2];
+    float *strand_modelPredictions[2];
+    unsigned int *strand_coverage[2];
+    uint8_t *strand_bases[2];
+    for (int strand = 0; strand < 2; strand++) {
+        strand_tMeans[strand] = (float *)malloc(n * sizeof(float));
+        strand_modelPredictions[strand] = (float *)malloc(n * sizeof(float));
+        strand_coverage[strand] = (unsigned int *)malloc(n * sizeof(unsigned int));
+        strand_bases[strand] = (uint8_t *)malloc(n * sizeof(uint8_t));
+        if(strand_tMeans[strand] == NULL || strand_modelPredictions[strand] == NULL || strand_coverage[strand] == NULL || strand_bases[strand] == NULL) {
+            fprintf(stderr, "ERROR: Cannot allocate memory for strands\n"); exit(EXIT_FAILURE);
         }
     }
+    split_strands(tMeans, sizeof(float), n, strand_tMeans[0], strand_tMeans[1]);
+    split_strands(modelPredictions, sizeof(float), n, strand_modelPredictions[0], strand_modelPredictions[1]);
+    split_strands(coverage, sizeof(unsigned int), n, strand_coverage[0], strand_coverage[1]);
+    split_strands(bases, sizeof(uint8_t), n, strand_bases[0], strand_bases[1]);
+    double *tMean_log2s = (double *)malloc(n * sizeof(double));
+    if(tMean_log2s == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for tMean_log2s\n"); exit(EXIT_FAILURE); }
+    double *prediction_log2s = (double *)malloc(n * sizeof(double));
+    if(prediction_log2s == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for prediction_log2s\n"); exit(EXIT_FAILURE); }
+    unsigned char *flags = (unsigned char *)malloc(n * sizeof(unsigned char));
+    if(flags == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for flags\n"); exit(EXIT_FAILURE); }
+    for (int strand = 0; strand < 2; strand++) {
+        precompute_ipd_values(strand_tMeans[strand], strand_modelPredictions[strand], strand_coverage[strand], n, coverage_threshold, check_outside_coverage,
+                (ipd_stats & IPD_STAT_IPD_LOG2) ? tMean_log2s : NULL, (ipd_stats & IPD_STAT_PRED_LOG2) ? prediction_log2s : NULL, flags);
+        collect_ipd_by_kmer_strand(k, chars, strand_tMeans[strand], tMean_log2s, strand_bases[strand], n, &table,
+                strand_modelPredictions[strand], prediction_log2s, flags, outside_length, 0, n, 0, n);
+        free(strand_tMeans[strand]);
+        free(strand_modelPredictions[strand]);
+        free(strand_coverage[strand]);
+        free(strand_bases[strand]);
+    }
+    add_ipd_cells_to_arrays(table.cells, table.kmers_size * table.row_length, tMean_sum, tMean_sq_sum, tMean_log2_sum, tMean_log2_sq_sum,
+            prediction_sum, prediction_sq_sum, prediction_log2_sum, prediction_log2_sq_sum, count);
+    free_ipd_table(&table);
+    free(tMean_log2s);
+    free(prediction_log2s);
+    free(flags);
     return;
 }
+
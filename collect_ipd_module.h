@@ -1,16 +1,120 @@
 #ifndef COLLECT_IPD_MODULE_H
 #define COLLECT_IPD_MODULE_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-    void collect_ipd_by_kmer(size_t const k, char const *chars, float const *tMeans, char **bases, size_t const dim,
+// Flags of each element of input arrays set by precompute_ipd_values
+// IPD_VALID: the IPD is used in the sums, i.e. tMean > 0 and the coverage condition outside k-mer is satisfied
+// IPD_COVERED: coverage >= coverage_threshold, which is required for all the bases of a k-mer
+#define IPD_VALID 1
+#define IPD_COVERED 2
+
+// Code of a null base, which means that no valid IPD is at the base, given by encode_bases.
+// Other bases are encoded into their index in chars.
+#define IPD_BASE_NULL 0xFF
+
+// Instruction sets to accumulate values, see set_ipd_simd_level
+#define IPD_SIMD_NONE 0
+#define IPD_SIMD_SSE4 1
+#define IPD_SIMD_AVX2 2
+
+// Statistics collected for each cell, see set_ipd_stats. Each selects a pair of a sum and a sum of squares; count is always collected.
+// IPD_STAT_IPD: tMean_sum, tMean_sq_sum
+// IPD_STAT_IPD_LOG2: tMean_log2_sum, tMean_log2_sq_sum
+// IPD_STAT_PRED: prediction_sum, prediction_sq_sum
+// IPD_STAT_PRED_LOG2: prediction_log2_sum, prediction_log2_sq_sum
+#define IPD_STAT_IPD 1
+#define IPD_STAT_IPD_LOG2 2
+#define IPD_STAT_PRED 4
+#define IPD_STAT_PRED_LOG2 8
+#define IPD_STAT_ALL 15
+
+// Accumulators of the values observed at one position around one k-mer.
+// All the statistics of a cell are updated together, so they are kept contiguous.
+struct ipd_cell {
+    double tMean_sum;
+    double tMean_sq_sum;
+    double tMean_log2_sum;
+    double tMean_log2_sq_sum;
+    double prediction_sum;
+    double prediction_sq_sum;
+    double prediction_log2_sum;
+    double prediction_log2_sq_sum;
+    size_t count;
+};
+
+// Accumulators of all the k-mers, each of which has a row of row_length cells.
+// A dense table holds the rows of all kmers_size k-mers in the order of k-mer index,
+// and a sparse table holds only the rows of observed k-mers in an open-addressing hash table keyed by k-mer index.
+struct ipd_table {
+    size_t kmers_size;
+    size_t row_length;
+    int sparse;
+    // Dense: kmers_size rows; sparse: slot_num rows
+    struct ipd_cell *cells;
+    // Sparse only: k-mer index of each slot, or SIZE_MAX for an empty slot
+    size_t *keys;
+    // Sparse only: number of slots, which is a power of 2, and number of used slots
+    size_t slot_num;
+    size_t used_num;
+};
+
+    void collect_ipd_by_kmer(size_t const k, char const *chars, float const *tMeans, uint8_t const *bases, size_t const dim,
         double *tMean_sum, double *tMean_sq_sum, double *tMean_log2_sum, double *tMean_log2_sq_sum,
         double *prediction_sum, double *prediction_sq_sum, double *prediction_log2_sum, double *prediction_log2_sq_sum, size_t *count, float const *modelPredictions,
         unsigned int const *coverage, unsigned int const coverage_threshold,
         size_t const outside_length, int const check_outside_coverage);
 
+    size_t ipd_segment_halo(size_t const k, size_t const outside_length);
+
+    void add_ipd_cells_to_arrays(struct ipd_cell const *cells, size_t const size,
+        double *tMean_sum, double *tMean_sq_sum, double *tMean_log2_sum, double *tMean_log2_sq_sum,
+        double *prediction_sum, double *prediction_sq_sum, double *prediction_log2_sum, double *prediction_log2_sq_sum, size_t *count);
+
+    void precompute_ipd_values(float const *tMeans, float const *modelPredictions, unsigned int const *coverage, size_t const length,
+        unsigned int const coverage_threshold, int const check_outside_coverage,
+        double *tMean_log2s, double *prediction_log2s, unsigned char *flags);
+
+    int set_ipd_simd_level(int const level);
+
+    void set_ipd_specialized_kernels(int const enabled);
+
+    void set_ipd_stats(int const stats);
+
+    void encode_bases(char const *chars, char const *bases, size_t const elem_size, size_t const n, uint8_t *codes);
+
+    void split_strands(void const *src, size_t const elem_size, size_t const n, void *pos, void *neg);
+
+    void reverse_elements(void *buf, size_t const elem_size, size_t const n);
+
+    void alloc_ipd_table(struct ipd_table *table, size_t const kmers_size, size_t const row_length, int const sparse);
+
+    size_t estimate_ipd_table_bytes(size_t const kmers_size, size_t const row_length, int const sparse, size_t const kmers_observed);
+
+    void clear_ipd_table(struct ipd_table *table);
+
+    struct ipd_cell *get_ipd_table_row(struct ipd_table *table, size_t const kmer);
+
+    struct ipd_cell const *find_ipd_table_row(struct ipd_table const *table, size_t const kmer);
+
+    void add_ipd_cells(struct ipd_cell *d, struct ipd_cell const *s, size_t const size);
+
+    void add_ipd_table(struct ipd_table *dst, struct ipd_table const *src);
+
+    void derive_ipd_table(struct ipd_table *dst, size_t const k, size_t const outside_length, struct ipd_table const *src,
+        size_t const src_k, size_t const src_outside_length, size_t const chars_size, size_t const kmer_offset);
+
+    void free_ipd_table(struct ipd_table *table);
+
+    void collect_ipd_by_kmer_strand(size_t const k, char const *chars, float const *tMeans, double const *tMean_log2s, uint8_t const *bases, size_t const strand_length,
+        struct ipd_table *table, float const *modelPredictions, double const *prediction_log2s, unsigned char const *flags, size_t const outside_length,
+        size_t const offset, size_t const length, size_t const begin, size_t const end);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,602 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <hdf5_hl.h>
+#include "collect_ipd_module.h"
+#include "collect_ipd_output.h"
+
+// Statistics of struct ipd_cell written as HDF5 data sets or columnar files, named after the CSV columns.
+// All of them are doubles except for the last one, count.
+static char const *stat_names[STAT_NUM] = {"ipd_sum", "ipd_sq_sum", "log2_ipd_sum", "log2_ipd_sq_sum",
+        "prediction_sum", "prediction_sq_sum", "log2_prediction_sum", "log2_prediction_sq_sum", "count"};
+static size_t const stat_offsets[STAT_NUM] = {offsetof(struct ipd_cell, tMean_sum), offsetof(struct ipd_cell, tMean_sq_sum),
+        offsetof(struct ipd_cell, tMean_log2_sum), offsetof(struct ipd_cell, tMean_log2_sq_sum),
+        offsetof(struct ipd_cell, prediction_sum), offsetof(struct ipd_cell, prediction_sq_sum),
+        offsetof(struct ipd_cell, prediction_log2_sum), offsetof(struct ipd_cell, prediction_log2_sq_sum), offsetof(struct ipd_cell, count)};
+#define STAT_COUNT (STAT_NUM - 1)
+// Selection of IPD_STAT_* that each statistic belongs to; count (0) is always written
+static int const stat_groups[STAT_NUM] = {IPD_STAT_IPD, IPD_STAT_IPD, IPD_STAT_IPD_LOG2, IPD_STAT_IPD_LOG2,
+        IPD_STAT_PRED, IPD_STAT_PRED, IPD_STAT_PRED_LOG2, IPD_STAT_PRED_LOG2, 0};
+
+// Whether the statistic s is written for the selection stats
+static inline int stat_selected(int const stats, int const s){
+    return stat_groups[s] == 0 || (stats & stat_groups[s]) != 0;
+}
+
+int compare_size(void const *a, void const *b){
+    size_t x = *(size_t const *)a;
+    size_t y = *(size_t const *)b;
+    return (x > y) - (x < y);
+}
+
+// Write IPD data per k-mer
+// Column: k-mer index, k-mer string, position (1 == start of k-mer), chromosome name, IPD sum, squared IPD sum, model prediction sum, squared model prediction sum, count
+// Only the columns of the statistics selected by stats, a combination of IPD_STAT_*, are written, and count is always written.
+// Doubles are written in the shortest form that parses back to the same values.
+// min_count: write only the cells with count >= min_count if min_count > 0
+void write_ipd_by_kmer(size_t const k, size_t const outside_length, size_t const chars_size, char const *chars, char const *chromosome_name, size_t const file_idx,
+        struct ipd_table const *table, int const stats, size_t const min_count, int const print_header, struct buffered_writer *output) {
+    size_t kmers_size = (size_t)(pow(chars_size, k) + 0.5);
+    size_t total_length = k + 2 * outside_length;
+    struct ipd_cell const empty_cell = {0};
+    char *kmer_string = (char *)malloc((k + 1) * sizeof(char));
+    if(kmer_string == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for kmer_string\n"); exit(EXIT_FAILURE); }
+    kmer_string[k] = '\0';
+    if(print_header == 1) {
+        write_string(output, "kmer_string,kmer_number,position,chromosome,file_index");
+        for (int s = 0; s < STAT_NUM; ++s) {
+            if (stat_selected(stats, s)) {
+                write_char(output, ',');
+                write_string(output, stat_names[s]);
+            }
+        }
+        write_char(output, '\n');
+    }
+    // Only the k-mers observed in a sparse table have cells to be written with min_count > 0
+    size_t *kmers = NULL;
+    size_t visit_num = kmers_size;
+    if (min_count > 0 && table->sparse) {
+        kmers = (size_t *)malloc((table->used_num + 1) * sizeof(size_t));
+        if(kmers == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for kmers\n"); exit(EXIT_FAILURE); }
+        visit_num = 0;
+        for (size_t slot = 0; slot < table->slot_num; ++slot) {
+            if (table->keys[slot] != SIZE_MAX) {
+                kmers[visit_num++] = table->keys[slot];
+            }
+        }
+        qsort(kmers, visit_num, sizeof(size_t), compare_size);
+    }
+    for (size_t v = 0; v < visit_num; ++v) {
+        size_t kmer = (kmers != NULL) ? kmers[v] : v;
+        // k-mers not observed in a sparse table have no row
+        struct ipd_cell const *row = find_ipd_table_row(table, kmer);
+        if (min_count > 0) {
+            size_t max_count = 0;
+            for (size_t i = 0; row != NULL && i < total_length; ++i) {
+                max_count = (row[i].count > max_count) ? row[i].count : max_count;
+            }
+            if (max_count < min_count) {
+                continue;
+            }
+        }
+        size_t kmer_tmp = kmer;
+        for (int i = (int)k - 1; i >= 0; --i) {
+            kmer_string[i] = chars[kmer_tmp % chars_size];
+            kmer_tmp /= chars_size;
+        }
+        for (size_t i = 0; i < total_length; ++i) {
+            struct ipd_cell const *cell = (row != NULL) ? &row[i] : &empty_cell;
+            if (min_count > 0 && cell->count < min_count) {
+                continue;
+            }
+            write_string(output, kmer_string);
+            write_char(output, ',');
+            write_size(output, kmer);
+            write_char(output, ',');
+            write_int(output, (int)i - (int)outside_length + 1);
+            write_char(output, ',');
+            write_string(output, chromosome_name);
+            write_char(output, ',');
+            if (file_idx == FILE_INDEX_ALL) {
+                write_char(output, '*');
+            } else {
+                write_size(output, file_idx);
+            }
+            double const values[8] = {cell->tMean_sum, cell->tMean_sq_sum, cell->tMean_log2_sum, cell->tMean_log2_sq_sum,
+                    cell->prediction_sum, cell->prediction_sq_sum, cell->prediction_log2_sum, cell->prediction_log2_sq_sum};
+            for (int j = 0; j < 8; ++j) {
+                if (!stat_selected(stats, j)) {
+                    continue;
+                }
+                write_char(output, ',');
+                write_double(output, values[j]);
+            }
+            write_char(output, ',');
+            write_size(output, cell->count);
+            write_char(output, '\n');
+        }
+    }
+    free(kmers);
+    free(kmer_string);
+    return;
+}
+
+// Size of the buffer of CSV output
+#define CSV_BUFFER_SIZE (1 << 20)
+// Number of cells gathered at once for binary formats
+#define OUTPUT_BLOCK_CELLS 65536
+
+// Make a path of a columnar file
+static char *columnar_path(char const *path, char const *name, char const *suffix){
+    char *file_path = (char *)malloc(strlen(path) + strlen(name) + strlen(suffix) + 3);
+    if(file_path == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for file_path\n"); exit(EXIT_FAILURE); }
+    sprintf(file_path, "%s.%s.%s", path, name, suffix);
+    return file_path;
+}
+
+static FILE *create_file(char const *path){
+    FILE *fp = fopen(path, "w");
+    if(fp == NULL){
+        fprintf(stderr, "ERROR: Cannot create/truncate file: %s\n", path); exit(EXIT_FAILURE);
+    }
+    return fp;
+}
+
+// Create an empty data set extensible along the first dimension
+static hid_t create_extensible_dataset(hid_t const file_id, char const *name, hid_t const type_id, int const rank, hsize_t const *dims){
+    hsize_t zero_dims[3] = {0, 0, 0};
+    hsize_t max_dims[3] = {H5S_UNLIMITED, 0, 0};
+    hsize_t chunk_dims[3] = {1, 1, 1};
+    hsize_t chunk_cells = 1;
+    for(int j = 1; j < rank; j++){
+        zero_dims[j] = dims[j];
+        max_dims[j] = dims[j];
+    }
+    // Chunks of about OUTPUT_BLOCK_CELLS elements
+    for(int j = rank - 1; j >= 1; j--){
+        chunk_dims[j] = (dims[j] < OUTPUT_BLOCK_CELLS / chunk_cells) ? dims[j] : OUTPUT_BLOCK_CELLS / chunk_cells;
+        if(chunk_dims[j] == 0){ chunk_dims[j] = 1; }
+        chunk_cells *= chunk_dims[j];
+    }
+    if(rank == 1){ chunk_dims[0] = 256; }
+    hid_t space_id = H5Screate_simple(rank, zero_dims, max_dims);
+    hid_t plist_id = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(plist_id, rank, chunk_dims);
+    hid_t dset_id = H5Dcreate(file_id, name, type_id, space_id, H5P_DEFAULT, plist_id, H5P_DEFAULT);
+    if(dset_id < 0) { fprintf(stderr, "ERROR: Cannot create data set %s\n", name); exit(EXIT_FAILURE); }
+    H5Pclose(plist_id);
+    H5Sclose(space_id);
+    return dset_id;
+}
+
+// Write count elements of buf to the hyperslab of dset_id from start
+static void write_hyperslab(hid_t const dset_id, int const rank, hsize_t const *start, hsize_t const *count,
+        hid_t const mem_type_id, void const *buf){
+    hid_t file_space_id = H5Dget_space(dset_id);
+    H5Sselect_hyperslab(file_space_id, H5S_SELECT_SET, start, NULL, count, NULL);
+    hid_t mem_space_id = H5Screate_simple(rank, count, NULL);
+    if(H5Dwrite(dset_id, mem_type_id, mem_space_id, file_space_id, H5P_DEFAULT, buf) < 0) { fprintf(stderr, "ERROR: Cannot write a data set\n"); exit(EXIT_FAILURE); }
+    H5Sclose(mem_space_id);
+    H5Sclose(file_space_id);
+    return;
+}
+
+// shard_index and shard_num are recorded only in partial files.
+// stats selects the statistics written by the other formats, and partial files hold whole cells.
+void open_ipd_output(struct ipd_output *output, int const format, char const *path, size_t const k, size_t const outside_length,
+        size_t const chars_size, char const *chars, size_t const kmers_size, int const stats, size_t const min_count,
+        size_t const shard_index, size_t const shard_num){
+    output->format = format;
+    output->k = k;
+    output->outside_length = outside_length;
+    output->chars_size = chars_size;
+    output->chars = chars;
+    output->kmers_size = kmers_size;
+    output->stats = stats;
+    output->min_count = min_count;
+    output->chromosome_num = 0;
+    output->last_file_index = 0;
+    if(format != FORMAT_CSV && path == NULL){ fprintf(stderr, "ERROR: Binary formats require --output\n"); exit(EXIT_FAILURE); }
+    // Binary formats hold all the cells in arrays of fixed dimensions
+    if(format != FORMAT_CSV && min_count > 0){ fprintf(stderr, "ERROR: --skip-empty and --min-count are only for CSV\n"); exit(EXIT_FAILURE); }
+    size_t row_length = k + 2 * outside_length;
+    if(format == FORMAT_CSV){
+        output->csv = (path == NULL) ? stdout : create_file(path);
+        init_buffered_writer(&output->csv_writer, output->csv, CSV_BUFFER_SIZE);
+    }else if(format == FORMAT_PARTIAL){
+        output->partial = create_file(path);
+        size_t chars_length = strlen(chars);
+        uint64_t const values[8] = {sizeof(struct ipd_cell), k, outside_length, kmers_size, row_length, shard_index, shard_num, chars_length};
+        if(fwrite(IPD_PARTIAL_MAGIC, 1, 8, output->partial) != 8 || fwrite(values, sizeof(uint64_t), 8, output->partial) != 8
+                || fwrite(chars, 1, chars_length, output->partial) != chars_length){
+            fprintf(stderr, "ERROR: Cannot write %s\n", path); exit(EXIT_FAILURE);
+        }
+    }else if(format == FORMAT_HDF5){
+        output->file_id = H5Fcreate(path, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+        if(output->file_id < 0) { fprintf(stderr, "ERROR: Cannot create/truncate file: %s\n", path); exit(EXIT_FAILURE); }
+        hsize_t dims[3] = {0, kmers_size, row_length};
+        for(int s = 0; s < STAT_NUM; s++){
+            if(!stat_selected(stats, s)){
+                output->stat_dsets[s] = -1;
+                continue;
+            }
+            output->stat_dsets[s] = create_extensible_dataset(output->file_id, stat_names[s], (s == STAT_COUNT) ? H5T_STD_U64LE : H5T_IEEE_F64LE, 3, dims);
+        }
+        hid_t name_type_id = H5Tcopy(H5T_C_S1);
+        H5Tset_size(name_type_id, H5T_VARIABLE);
+        output->chromosome_dset = create_extensible_dataset(output->file_id, "chromosome", name_type_id, 1, dims);
+        H5Tclose(name_type_id);
+        output->file_index_dset = create_extensible_dataset(output->file_id, "file_index", H5T_STD_U64LE, 1, dims);
+        // The offset j of the data sets corresponds to the position j - outside_length + 1 of CSV, where 1 is the start of k-mer
+        H5LTset_attribute_ulong(output->file_id, "/", "k", (unsigned long const[]){k}, 1);
+        H5LTset_attribute_ulong(output->file_id, "/", "outside_length", (unsigned long const[]){outside_length}, 1);
+        H5LTset_attribute_string(output->file_id, "/", "chars", chars);
+    }else{
+        for(int s = 0; s < STAT_NUM; s++){
+            if(!stat_selected(stats, s)){
+                output->stat_files[s] = NULL;
+                continue;
+            }
+            char *file_path = columnar_path(path, stat_names[s], (s == STAT_COUNT) ? "u64" : "f64");
+            output->stat_files[s] = create_file(file_path);
+            free(file_path);
+        }
+        char *file_path = columnar_path(path, "chromosomes", "csv");
+        output->chromosome_file = create_file(file_path);
+        free(file_path);
+        fprintf(output->chromosome_file, "chromosome,file_index\n");
+        file_path = columnar_path(path, "meta", "csv");
+        FILE *meta = create_file(file_path);
+        free(file_path);
+        fprintf(meta, "key,value\nk,%zu\noutside_length,%zu\nchars,%s\nkmers,%zu\noffsets,%zu\n", k, outside_length, chars, kmers_size, row_length);
+        fclose(meta);
+    }
+    return;
+}
+
+// Copy the statistic s of cells [begin, end) of the table in the order of [kmer][offset] to buf of doubles (or uint64_t for count)
+static void gather_ipd_stat(struct ipd_table const *table, int const s, size_t const begin, size_t const end, void *buf){
+    size_t row_length = table->row_length;
+    size_t offset = stat_offsets[s];
+    size_t kmer = begin / row_length;
+    struct ipd_cell const *row = find_ipd_table_row(table, kmer);
+    for(size_t x = begin; x < end; x++){
+        if(x / row_length != kmer){
+            kmer = x / row_length;
+            row = find_ipd_table_row(table, kmer);
+        }
+        // k-mers not observed in a sparse table have no row
+        if(s == STAT_COUNT){
+            ((uint64_t *)buf)[x - begin] = (row != NULL) ? row[x % row_length].count : 0;
+        }else{
+            ((double *)buf)[x - begin] = (row != NULL) ? *(double const *)((char const *)&row[x % row_length] + offset) : 0.0;
+        }
+    }
+    return;
+}
+
+// Write the rows of the table with any observed cell to a partial file, in ascending order of k-mers.
+// Cells of the other rows are all zero, so that summing partial files gives the same results as a table of all the rows.
+static void write_partial_entry(FILE *fp, char const *chromosome_name, size_t const file_idx, size_t const chromosome_idx, struct ipd_table const *table){
+    size_t row_length = table->row_length;
+    size_t *kmers = NULL;
+    size_t visit_num = table->kmers_size;
+    if(table->sparse){
+        kmers = (size_t *)malloc((table->used_num + 1) * sizeof(size_t));
+        if(kmers == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for kmers\n"); exit(EXIT_FAILURE); }
+        visit_num = 0;
+        for(size_t slot = 0; slot < table->slot_num; ++slot){
+            if(table->keys[slot] != SIZE_MAX){
+                kmers[visit_num++] = table->keys[slot];
+            }
+        }
+        qsort(kmers, visit_num, sizeof(size_t), compare_size);
+    }
+    uint64_t row_num = 0;
+    for(int pass = 0; pass < 2; pass++){
+        if(pass == 1){
+            size_t name_length = strlen(chromosome_name);
+            uint64_t const values[3] = {file_idx, chromosome_idx, name_length};
+            if(fwrite(values, sizeof(uint64_t), 3, fp) != 3 || fwrite(chromosome_name, 1, name_length, fp) != name_length
+                    || fwrite(&row_num, sizeof(uint64_t), 1, fp) != 1){
+                fprintf(stderr, "ERROR: Cannot write a partial file\n"); exit(EXIT_FAILURE);
+            }
+        }
+        // The first pass counts the rows to be written by the second pass
+        for(size_t v = 0; v < visit_num; ++v){
+            size_t kmer = (kmers != NULL) ? kmers[v] : v;
+            struct ipd_cell const *row = find_ipd_table_row(table, kmer);
+            int observed = 0;
+            for(size_t i = 0; row != NULL && i < row_length; ++i){
+                observed |= (row[i].count > 0);
+            }
+            if(!observed){
+                continue;
+            }
+            if(pass == 0){
+                row_num++;
+                continue;
+            }
+            uint64_t const kmer_value = kmer;
+            if(fwrite(&kmer_value, sizeof(uint64_t), 1, fp) != 1 || fwrite(row, sizeof(struct ipd_cell), row_length, fp) != row_length){
+                fprintf(stderr, "ERROR: Cannot write a partial file\n"); exit(EXIT_FAILURE);
+            }
+        }
+    }
+    free(kmers);
+    return;
+}
+
+// Whether the results of file_idx are the first ones of their file in output, which are written with the CSV header.
+// Chromosomes are written in the order of files, but the first chromosome of a file may be skipped, e.g. by regions.
+int starts_output_file(struct ipd_output const *output, size_t const file_idx){
+    return (output->chromosome_num == 0 || output->last_file_index != file_idx) ? 1 : 0;
+}
+
+// Write the results of a chromosome. print_header is used only by CSV.
+// chromosome_idx is the index of the chromosome in its file, which is used only by partial files to sort the results.
+void write_ipd_output(struct ipd_output *output, char const *chromosome_name, size_t const file_idx, size_t const chromosome_idx,
+        struct ipd_table const *table, int const print_header){
+    if(output->format == FORMAT_CSV){
+        write_ipd_by_kmer(output->k, output->outside_length, output->chars_size, output->chars, chromosome_name, file_idx,
+                table, output->stats, output->min_count, print_header, &output->csv_writer);
+        output->last_file_index = file_idx;
+        output->chromosome_num++;
+        return;
+    }
+    if(output->format == FORMAT_PARTIAL){
+        write_partial_entry(output->partial, chromosome_name, file_idx, chromosome_idx, table);
+        output->last_file_index = file_idx;
+        output->chromosome_num++;
+        return;
+    }
+    size_t row_length = table->row_length;
+    size_t cells_size = output->kmers_size * row_length;
+    size_t block_cells = (cells_size < OUTPUT_BLOCK_CELLS) ? cells_size : OUTPUT_BLOCK_CELLS;
+    // Both double and uint64_t take 8 bytes
+    uint64_t *buf = (uint64_t *)malloc((block_cells > 0 ? block_cells : 1) * sizeof(uint64_t));
+    if(buf == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for output buffer\n"); exit(EXIT_FAILURE); }
+    size_t c = output->chromosome_num;
+    if(output->format == FORMAT_HDF5){
+        hsize_t dims[3] = {c + 1, output->kmers_size, row_length};
+        for(int s = 0; s < STAT_NUM; s++){
+            if(!stat_selected(output->stats, s)){
+                continue;
+            }
+            if(H5Dset_extent(output->stat_dsets[s], dims) < 0) { fprintf(stderr, "ERROR: Cannot extend %s\n", stat_names[s]); exit(EXIT_FAILURE); }
+        }
+        if(H5Dset_extent(output->chromosome_dset, dims) < 0 || H5Dset_extent(output->file_index_dset, dims) < 0) {
+            fprintf(stderr, "ERROR: Cannot extend chromosome and file_index\n"); exit(EXIT_FAILURE);
+        }
+    }
+    for(int s = 0; s < STAT_NUM; s++){
+        if(!stat_selected(output->stats, s)){
+            continue;
+        }
+        // Blocks of whole rows for the hyperslabs of HDF5
+        size_t block_kmers = (block_cells / row_length > 0) ? block_cells / row_length : 1;
+        for(size_t kmer = 0; kmer < output->kmers_size; kmer += block_kmers){
+            size_t kmer_end = (kmer + block_kmers < output->kmers_size) ? kmer + block_kmers : output->kmers_size;
+            gather_ipd_stat(table, s, kmer * row_length, kmer_end * row_length, buf);
+            if(output->format == FORMAT_HDF5){
+                hsize_t start[3] = {c, kmer, 0};
+                hsize_t count[3] = {1, kmer_end - kmer, row_length};
+                write_hyperslab(output->stat_dsets[s], 3, start, count, (s == STAT_COUNT) ? H5T_NATIVE_UINT64 : H5T_NATIVE_DOUBLE, buf);
+            }else{
+                size_t n = (kmer_end - kmer) * row_length;
+                if(fwrite(buf, sizeof(uint64_t), n, output->stat_files[s]) != n) { fprintf(stderr, "ERROR: Cannot write %s\n", stat_names[s]); exit(EXIT_FAILURE); }
+            }
+        }
+    }
+    free(buf);
+    if(output->format == FORMAT_HDF5){
+        hsize_t start[1] = {c};
+        hsize_t count[1] = {1};
+        hid_t name_type_id = H5Tcopy(H5T_C_S1);
+        H5Tset_size(name_type_id, H5T_VARIABLE);
+        write_hyperslab(output->chromosome_dset, 1, start, count, name_type_id, &chromosome_name);
+        H5Tclose(name_type_id);
+        uint64_t file_index = file_idx;
+        write_hyperslab(output->file_index_dset, 1, start, count, H5T_NATIVE_UINT64, &file_index);
+    }else{
+        if(file_idx == FILE_INDEX_ALL){
+            fprintf(output->chromosome_file, "%s,*\n", chromosome_name);
+        }else{
+            fprintf(output->chromosome_file, "%s,%zu\n", chromosome_name, file_idx);
+        }
+    }
+    output->last_file_index = file_idx;
+    output->chromosome_num++;
+    return;
+}
+
+void close_ipd_output(struct ipd_output *output){
+    if(output->format == FORMAT_CSV){
+        free_buffered_writer(&output->csv_writer);
+        fclose(output->csv);
+    }else if(output->format == FORMAT_HDF5){
+        for(int s = 0; s < STAT_NUM; s++){
+            if(output->stat_dsets[s] >= 0){
+                H5Dclose(output->stat_dsets[s]);
+            }
+        }
+        H5Dclose(output->chromosome_dset);
+        H5Dclose(output->file_index_dset);
+        H5Fclose(output->file_id);
+    }else if(output->format == FORMAT_PARTIAL){
+        if(fclose(output->partial) != 0) { fprintf(stderr, "ERROR: Cannot write a partial file\n"); exit(EXIT_FAILURE); }
+    }else{
+        for(int s = 0; s < STAT_NUM; s++){
+            if(output->stat_files[s] != NULL){
+                fclose(output->stat_files[s]);
+            }
+        }
+        fclose(output->chromosome_file);
+    }
+    return;
+}
+
+// Read the header of a partial file, and check that it is written by a compatible build
+void read_partial_header(FILE *fp, char const *path, struct partial_header *header){
+    char magic[8];
+    uint64_t values[8];
+    if(fread(magic, 1, 8, fp) != 8 || memcmp(magic, IPD_PARTIAL_MAGIC, 8) != 0){
+        fprintf(stderr, "ERROR: Not a partial file: %s\n", path); exit(EXIT_FAILURE);
+    }
+    if(fread(values, sizeof(uint64_t), 8, fp) != 8) { fprintf(stderr, "ERROR: Truncated partial file: %s\n", path); exit(EXIT_FAILURE); }
+    if(values[0] != sizeof(struct ipd_cell)) { fprintf(stderr, "ERROR: Cells of %s have a different layout\n", path); exit(EXIT_FAILURE); }
+    header->k = values[1];
+    header->outside_length = values[2];
+    header->kmers_size = values[3];
+    header->row_length = values[4];
+    header->shard_index = values[5];
+    header->shard_num = values[6];
+    size_t chars_length = values[7];
+    header->chars = (char *)malloc(chars_length + 1);
+    if(header->chars == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for chars\n"); exit(EXIT_FAILURE); }
+    if(fread(header->chars, 1, chars_length, fp) != chars_length) { fprintf(stderr, "ERROR: Truncated partial file: %s\n", path); exit(EXIT_FAILURE); }
+    header->chars[chars_length] = '\0';
+    return;
+}
+
+// Read the next entry of a partial file and skip its rows, which can be read later by add_partial_rows.
+// Return 0 at the end of the file, or 1 otherwise. entry->name must be freed by the caller.
+int read_partial_entry(FILE *fp, char const *path, size_t const row_length, struct partial_entry *entry){
+    uint64_t values[3];
+    size_t n = fread(values, sizeof(uint64_t), 3, fp);
+    if(n == 0 && feof(fp)){
+        return 0;
+    }
+    if(n != 3) { fprintf(stderr, "ERROR: Truncated partial file: %s\n", path); exit(EXIT_FAILURE); }
+    entry->file_index = values[0];
+    entry->chromosome_index = values[1];
+    size_t name_length = values[2];
+    entry->name = (char *)malloc(name_length + 1);
+    if(entry->name == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for name\n"); exit(EXIT_FAILURE); }
+    uint64_t row_num;
+    if(fread(entry->name, 1, name_length, fp) != name_length || fread(&row_num, sizeof(uint64_t), 1, fp) != 1){
+        fprintf(stderr, "ERROR: Truncated partial file: %s\n", path); exit(EXIT_FAILURE);
+    }
+    entry->name[name_length] = '\0';
+    entry->row_num = row_num;
+    entry->offset = ftello(fp);
+    off_t row_size = sizeof(uint64_t) + row_length * sizeof(struct ipd_cell);
+    if(fseeko(fp, (off_t)row_num * row_size, SEEK_CUR) != 0) { fprintf(stderr, "ERROR: Cannot seek in %s\n", path); exit(EXIT_FAILURE); }
+    return 1;
+}
+
+// Add the rows of an entry read by read_partial_entry to the table
+void add_partial_rows(FILE *fp, char const *path, struct partial_entry const *entry, struct ipd_table *table){
+    size_t row_length = table->row_length;
+    struct ipd_cell *row = (struct ipd_cell *)malloc(row_length * sizeof(struct ipd_cell));
+    if(row == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for row\n"); exit(EXIT_FAILURE); }
+    if(fseeko(fp, entry->offset, SEEK_SET) != 0) { fprintf(stderr, "ERROR: Cannot seek in %s\n", path); exit(EXIT_FAILURE); }
+    for(size_t r = 0; r < entry->row_num; r++){
+        uint64_t kmer;
+        if(fread(&kmer, sizeof(uint64_t), 1, fp) != 1 || fread(row, sizeof(struct ipd_cell), row_length, fp) != row_length){
+            fprintf(stderr, "ERROR: Truncated partial file: %s\n", path); exit(EXIT_FAILURE);
+        }
+        if(kmer >= table->kmers_size) { fprintf(stderr, "ERROR: Invalid k-mer in %s\n", path); exit(EXIT_FAILURE); }
+        add_ipd_cells(get_ipd_table_row(table, kmer), row, row_length);
+    }
+    free(row);
+    return;
+}
+
+// Parse a comma-separated list of lengths and ranges of lengths (e.g. "1-3,6") into ks in ascending order without duplicates.
+// Return 0 if arg is invalid or a length exceeds K_MAX.
+int parse_k_list(char const *arg, size_t **ks, size_t *k_num){
+    size_t *parsed = NULL;
+    size_t parsed_num = 0;
+    char const *p = arg;
+    while(1){
+        char *remain;
+        long first = strtol(p, &remain, 10);
+        if(remain == p || first <= 0){
+            free(parsed); return 0;
+        }
+        long last = first;
+        if(remain[0] == '-'){
+            p = remain + 1;
+            last = strtol(p, &remain, 10);
+            if(remain == p || last < first){
+                free(parsed); return 0;
+            }
+        }
+        if(last > K_MAX){
+            fprintf(stderr, "ERROR: k must be at most %d\n", K_MAX);
+            free(parsed); return 0;
+        }
+        parsed = (size_t *)realloc(parsed, sizeof(size_t) * (parsed_num + (size_t)(last - first) + 1));
+        if(parsed == NULL){ fprintf(stderr, "ERROR: Cannot realloc ks\n"); exit(EXIT_FAILURE); }
+        for(long k = first; k <= last; k++){
+            // Keep parsed sorted and unique by insertion
+            size_t j = parsed_num;
+            while(j > 0 && parsed[j - 1] > (size_t)k){
+                j--;
+            }
+            if(j > 0 && parsed[j - 1] == (size_t)k){
+                continue;
+            }
+            memmove(&parsed[j + 1], &parsed[j], sizeof(size_t) * (parsed_num - j));
+            parsed[j] = k;
+            parsed_num++;
+        }
+        if(remain[0] == '\0'){
+            break;
+        }
+        if(remain[0] != ','){
+            free(parsed); return 0;
+        }
+        p = remain + 1;
+    }
+    free(*ks);
+    *ks = parsed;
+    *k_num = parsed_num;
+    return 1;
+}
+
+// Parse a comma-separated list of statistics (ipd, ipd_log2, pred, pred_log2 or all) into a combination of IPD_STAT_*.
+// Return 0 if arg is invalid.
+int parse_stat_list(char const *arg, int *stats){
+    static char const *names[] = {"ipd", "ipd_log2", "pred", "pred_log2", "all"};
+    static int const values[] = {IPD_STAT_IPD, IPD_STAT_IPD_LOG2, IPD_STAT_PRED, IPD_STAT_PRED_LOG2, IPD_STAT_ALL};
+    int parsed = 0;
+    char const *p = arg;
+    while(1){
+        size_t length = strcspn(p, ",");
+        int found = 0;
+        for(size_t j = 0; j < sizeof(names) / sizeof(names[0]); j++){
+            if(strlen(names[j]) == length && strncmp(p, names[j], length) == 0){
+                parsed |= values[j];
+                found = 1;
+                break;
+            }
+        }
+        if(!found){
+            return 0;
+        }
+        if(p[length] == '\0'){
+            break;
+        }
+        p += length + 1;
+    }
+    *stats = parsed;
+    return 1;
+}
+
+// Path of the output of k-mers of length k: path with ".k<k>" inserted before the extension of the file name, or appended if it has no extension
+char *k_output_path(char const *path, size_t const k){
+    char const *slash = strrchr(path, '/');
+    char const *dot = strrchr(path, '.');
+    size_t stem_length = (dot != NULL && dot > ((slash != NULL) ? slash + 1 : path)) ? (size_t)(dot - path) : strlen(path);
+    char *k_path = (char *)malloc(strlen(path) + 24);
+    if(k_path == NULL) { fprintf(stderr, "ERROR: Cannot allocate memory for output path\n"); exit(EXIT_FAILURE); }
+    sprintf(k_path, "%.*s.k%zu%s", (int)stem_length, path, k, path + stem_length);
+    return k_path;
+}
@@ -0,0 +1,123 @@
+#ifndef COLLECT_IPD_OUTPUT_H
+#define COLLECT_IPD_OUTPUT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <hdf5.h>
+#include "collect_ipd_module.h"
+#include "collect_ipd_format.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Values of --format
+#define FORMAT_CSV 0
+#define FORMAT_HDF5 1
+#define FORMAT_COLUMNAR 2
+#define FORMAT_PARTIAL 3
+
+// Chromosome name and file index of the results aggregated over chromosomes and files
+#define AGGREGATE_NAME "*"
+#define FILE_INDEX_ALL SIZE_MAX
+
+// Largest k accepted by parse_k_list; 4^32 k-mers already overflow a 64-bit index
+#define K_MAX 32
+
+// Number of statistics of struct ipd_cell written to binary formats
+#define STAT_NUM 9
+
+// Destination of the results.
+// CSV writes rows per cell with write_ipd_by_kmer.
+// HDF5 writes a data set of dimensions [chromosome][kmer][offset] per statistic, and chromosome and file_index data sets of dimension [chromosome].
+// Columnar writes raw native-endian arrays in the order of [chromosome][kmer][offset] to PATH.STAT.f64 (or PATH.count.u64),
+// the list of chromosomes to PATH.chromosomes.csv and the dimensions to PATH.meta.csv.
+// Partial writes the observed rows of accumulators to be summed by collect_ipd_merge, see read_partial_header.
+struct ipd_output {
+    int format;
+    size_t k;
+    size_t outside_length;
+    size_t chars_size;
+    char const *chars;
+    size_t kmers_size;
+    // Statistics written, a combination of IPD_STAT_*; partial files hold whole cells
+    int stats;
+    // Only for CSV: write only the cells with count >= min_count if min_count > 0
+    size_t min_count;
+    // Number of chromosomes written
+    size_t chromosome_num;
+    // File index of the last chromosome written, valid if chromosome_num > 0
+    size_t last_file_index;
+    // CSV
+    FILE *csv;
+    struct buffered_writer csv_writer;
+    // HDF5
+    hid_t file_id;
+    hid_t stat_dsets[STAT_NUM];
+    hid_t chromosome_dset;
+    hid_t file_index_dset;
+    // Columnar
+    FILE *stat_files[STAT_NUM];
+    FILE *chromosome_file;
+    // Partial
+    FILE *partial;
+};
+
+// Parameters of a partial file.
+// A partial file is native-endian: the magic IPD_PARTIAL_MAGIC, uint64 values of cell_size, k, outside_length, kmers_size, row_length,
+// shard_index, shard_num and the length of chars, and chars without a terminator, followed by entries until the end of the file.
+// An entry is uint64 values of file_index, chromosome_index and the length of name, name without a terminator, uint64 row_num,
+// and row_num rows of a uint64 k-mer index and row_length struct ipd_cell, in ascending order of k-mers.
+#define IPD_PARTIAL_MAGIC "IPDPART1"
+struct partial_header {
+    size_t k;
+    size_t outside_length;
+    size_t kmers_size;
+    size_t row_length;
+    size_t shard_index;
+    size_t shard_num;
+    char *chars;
+};
+
+// An entry of a partial file, whose rows start from offset
+struct partial_entry {
+    size_t file_index;
+    size_t chromosome_index;
+    char *name;
+    size_t row_num;
+    off_t offset;
+};
+
+    int compare_size(void const *a, void const *b);
+
+    void write_ipd_by_kmer(size_t const k, size_t const outside_length, size_t const chars_size, char const *chars, char const *chromosome_name, size_t const file_idx,
+        struct ipd_table const *table, int const stats, size_t const min_count, int const print_header, struct buffered_writer *output);
+
+    void open_ipd_output(struct ipd_output *output, int const format, char const *path, size_t const k, size_t const outside_length,
+        size_t const chars_size, char const *chars, size_t const kmers_size, int const stats, size_t const min_count,
+        size_t const shard_index, size_t const shard_num);
+
+    void write_ipd_output(struct ipd_output *output, char const *chromosome_name, size_t const file_idx, size_t const chromosome_idx,
+        struct ipd_table const *table, int const print_header);
+
+    int starts_output_file(struct ipd_output const *output, size_t const file_idx);
+
+    void close_ipd_output(struct ipd_output *output);
+
+    void read_partial_header(FILE *fp, char const *path, struct partial_header *header);
+
+    int read_partial_entry(FILE *fp, char const *path, size_t const row_length, struct partial_entry *entry);
+
+    void add_partial_rows(FILE *fp, char const *path, struct partial_entry const *entry, struct ipd_table *table);
+
+    int parse_k_list(char const *arg, size_t **ks, size_t *k_num);
+
+    int parse_stat_list(char const *arg, int *stats);
+
+    char *k_output_path(char const *path, size_t const k);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
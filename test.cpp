@@ -1,12 +1,17 @@
 #include <stdint.h>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 #include <CppUTest/CommandLineTestRunner.h>
 #include "collect_ipd_module.h"
+#include "collect_ipd_format.h"
+#include "collect_ipd_output.h"
 
 TEST_GROUP(kmer_ipd)
 {
     // Tests for
-    // void collect_ipd_by_kmer(size_t const k, char const *chars, float const *tMeans, char **bases, size_t const dim,
+    // void collect_ipd_by_kmer(size_t const k, char const *chars, float const *tMeans, uint8_t const *bases, size_t const dim,
     //    double *tMean_sum, double *tMean_sq_sum, double *tMean_log2_sum, double *tMean_log2_sq_sum,
     //    double *prediction_sum, double *prediction_sq_sum, double *prediction_log2_sum, double *prediction_log2_sq_sum, size_t *count, float const *modelPredictions,
     //    unsigned int const *coverage, unsigned int const coverage_threshold,
@@ -18,10 +23,18 @@ TEST_GROUP(kmer_ipd)
 
     // Input arrays correspond to {pos1, neg1, pos2, neg2, ..., pos_n, neg_n}, that is,
     // positive: AACGC, negative: GC0TT
-    const char *bases[10]      = {"A", "T", "A", "T", "C", "\0", "G", "C", "C", "G"};
+    const char base_chars[10]  = {'A', 'T', 'A', 'T', 'C', '\0', 'G', 'C', 'C', 'G'};
     float tMeans[10]           = {1.5, 2.2, 3.1, 4.9, 5.5, 6.3, 7.2, 8.2, 9.1, 10.3};
     float modelPredictions[10] = {1.4, 2.1, 3.0, 4.8, 5.4, 6.2, 7.1, 8.1, 9.0, 10.2};
     unsigned int coverage[10]  = { 30,  20,  30,  20,  30,  20,  30,  40,  40,   40};
+    uint8_t bases[10];
+
+    void setup()
+    {
+        encode_bases(chars, base_chars, 1, dim, bases);
+        CHECK_EQUAL(3, bases[1]);
+        CHECK_EQUAL(IPD_BASE_NULL, bases[5]);
+    }
 };
 
 TEST(kmer_ipd, k1l0)
@@ -42,7 +55,7 @@ TEST(kmer_ipd, k1l0)
     double prediction_log2_sum[array_size] = {0.0};
     double prediction_log2_sq_sum[array_size] = {0.0};
     size_t count[array_size] = {0};
-    collect_ipd_by_kmer(k, chars, tMeans, (char **)bases, dim, tMean_sum, tMean_sq_sum, tMean_log2_sum, tMean_log2_sq_sum,
+    collect_ipd_by_kmer(k, chars, tMeans, bases, dim, tMean_sum, tMean_sq_sum, tMean_log2_sum, tMean_log2_sq_sum,
             prediction_sum, prediction_sq_sum, prediction_log2_sum, prediction_log2_sq_sum, count, modelPredictions, coverage, coverage_threshold, outside_length, check_outside_coverage);
     CHECK_EQUAL(1.5f + 3.1f, (float)tMean_sum[0]);
     CHECK_EQUAL(5.5f + 8.2f + 9.1f, (float)tMean_sum[1]);
@@ -101,7 +114,7 @@ TEST(kmer_ipd, k2l1)
     double prediction_log2_sum[array_size] = {0.0};
     double prediction_log2_sq_sum[array_size] = {0.0};
     size_t count[array_size] = {0};
-    collect_ipd_by_kmer(k, chars, tMeans, (char **)bases, dim, tMean_sum, tMean_sq_sum, tMean_log2_sum, tMean_log2_sq_sum,
+    collect_ipd_by_kmer(k, chars, tMeans, bases, dim, tMean_sum, tMean_sq_sum, tMean_log2_sum, tMean_log2_sq_sum,
             prediction_sum, prediction_sq_sum, prediction_log2_sum, prediction_log2_sq_sum, count, modelPredictions, coverage, coverage_threshold, outside_length, check_outside_coverage);
     // AA
     DOUBLES_EQUAL(0.0, tMean_sum[0 * total_length + 0], tolerance);
@@ -510,6 +523,596 @@ TEST(kmer_ipd, k2l1)
 
 }
 
+// Deterministic pseudo-random input including null bases, zero IPDs and low coverage, shared by the tests of the kernels
+struct random_kinetics : public Utest
+{
+    char *chars = (char *)"ACGT";
+    static const size_t dim = 400;
+    size_t coverage_threshold = 25;
+    double tolerance = 0.0001;
+    char base_strings[dim][2];
+    uint8_t bases[dim];
+    float tMeans[dim];
+    float modelPredictions[dim];
+    unsigned int coverage[dim];
+
+    void setup()
+    {
+        unsigned int seed = 12345;
+        for (size_t i = 0; i < dim; i++) {
+            seed = seed * 1103515245 + 12345;
+            unsigned int r = (seed >> 8) % 1000;
+            base_strings[i][0] = (r % 37 == 0) ? '\0' : chars[r % 4];
+            base_strings[i][1] = '\0';
+            tMeans[i] = (r % 23 == 0) ? 0.0f : 0.5f + r / 100.0f;
+            modelPredictions[i] = 0.7f + r / 150.0f;
+            coverage[i] = (r % 11 == 0) ? 10 : 30;
+        }
+        encode_bases(chars, base_strings[0], 2, dim, bases);
+    }
+
+    // Collect IPD of the whole input into sums, which holds the 8 statistics one after another, and count
+    void collect(size_t const k, size_t const outside_length, int const check_outside_coverage, std::vector<double> &sums, std::vector<size_t> &count)
+    {
+        size_t array_size = (size_t)(std::pow(4, k) + 0.5) * (k + 2 * outside_length);
+        sums.assign(8 * array_size, 0.0);
+        count.assign(array_size, 0);
+        collect_ipd_by_kmer(k, chars, tMeans, bases, dim, &sums[0], &sums[array_size], &sums[2 * array_size], &sums[3 * array_size],
+                &sums[4 * array_size], &sums[5 * array_size], &sums[6 * array_size], &sums[7 * array_size], &count[0],
+                modelPredictions, coverage, coverage_threshold, outside_length, check_outside_coverage);
+    }
+
+    // Collect IPD of the k-mers whose last base in the direction of its strand is in one of the segments, given as [begin, end) in base pairs,
+    // into sums and count as collect does. Each segment of each strand is given only its own copy of the data with the halo.
+    void collect_segments(size_t const k, size_t const outside_length, int const check_outside_coverage,
+            size_t const (*segments)[2], size_t const segment_num, std::vector<double> &sums, std::vector<size_t> &count)
+    {
+        size_t n = dim / 2;
+        size_t halo = ipd_segment_halo(k, outside_length) / 2;
+        std::vector<float> strand_tMeans[2];
+        std::vector<float> strand_modelPredictions[2];
+        std::vector<unsigned int> strand_coverage[2];
+        std::vector<uint8_t> strand_bases[2];
+        for (int strand = 0; strand < 2; strand++) {
+            strand_tMeans[strand].resize(n);
+            strand_modelPredictions[strand].resize(n);
+            strand_coverage[strand].resize(n);
+            strand_bases[strand].resize(n);
+        }
+        split_strands(tMeans, sizeof(float), n, &strand_tMeans[0][0], &strand_tMeans[1][0]);
+        split_strands(modelPredictions, sizeof(float), n, &strand_modelPredictions[0][0], &strand_modelPredictions[1][0]);
+        split_strands(coverage, sizeof(unsigned int), n, &strand_coverage[0][0], &strand_coverage[1][0]);
+        split_strands(bases, sizeof(uint8_t), n, &strand_bases[0][0], &strand_bases[1][0]);
+        struct ipd_table table;
+        alloc_ipd_table(&table, (size_t)(std::pow(4, k) + 0.5), k + 2 * outside_length, 0);
+        clear_ipd_table(&table);
+        for (size_t i = 0; i < segment_num; i++) {
+            // The reversed negative strand starts from the end of the positive strand
+            size_t strand_begin[2] = {segments[i][0], n - segments[i][1]};
+            size_t strand_end[2] = {segments[i][1], n - segments[i][0]};
+            for (int strand = 0; strand < 2; strand++) {
+                size_t offset = (strand_begin[strand] > halo) ? strand_begin[strand] - halo : 0;
+                size_t length = ((strand_end[strand] + halo < n) ? strand_end[strand] + halo : n) - offset;
+                std::vector<float> segment_tMeans(strand_tMeans[strand].begin() + offset, strand_tMeans[strand].begin() + offset + length);
+                std::vector<float> segment_modelPredictions(strand_modelPredictions[strand].begin() + offset,
+                        strand_modelPredictions[strand].begin() + offset + length);
+                std::vector<unsigned int> segment_coverage(strand_coverage[strand].begin() + offset, strand_coverage[strand].begin() + offset + length);
+                std::vector<uint8_t> segment_bases(strand_bases[strand].begin() + offset, strand_bases[strand].begin() + offset + length);
+                std::vector<double> tMean_log2s(length);
+                std::vector<double> prediction_log2s(length);
+                std::vector<unsigned char> flags(length);
+                precompute_ipd_values(&segment_tMeans[0], &segment_modelPredictions[0], &segment_coverage[0], length, coverage_threshold,
+                        check_outside_coverage, &tMean_log2s[0], &prediction_log2s[0], &flags[0]);
+                collect_ipd_by_kmer_strand(k, chars, &segment_tMeans[0], &tMean_log2s[0], &segment_bases[0], n, &table,
+                        &segment_modelPredictions[0], &prediction_log2s[0], &flags[0], outside_length, offset, length, strand_begin[strand], strand_end[strand]);
+            }
+        }
+        size_t array_size = table.kmers_size * table.row_length;
+        sums.assign(8 * array_size, 0.0);
+        count.assign(array_size, 0);
+        add_ipd_cells_to_arrays(table.cells, array_size, &sums[0], &sums[array_size], &sums[2 * array_size], &sums[3 * array_size],
+                &sums[4 * array_size], &sums[5 * array_size], &sums[6 * array_size], &sums[7 * array_size], &count[0]);
+        free_ipd_table(&table);
+    }
+
+    // Results of collect must be exactly the same, not only within the tolerance
+    void check_same(std::vector<double> const &expected_sums, std::vector<size_t> const &expected_count,
+            std::vector<double> const &sums, std::vector<size_t> const &count)
+    {
+        CHECK_EQUAL(expected_count.size(), count.size());
+        for (size_t j = 0; j < count.size(); j++) {
+            CHECK_EQUAL(expected_count[j], count[j]);
+        }
+        for (size_t j = 0; j < sums.size(); j++) {
+            CHECK_EQUAL(expected_sums[j], sums[j]);
+        }
+    }
+};
+
+TEST_GROUP_BASE(kmer_ipd_segment, random_kinetics)
+{
+    // Tests for
+    // void collect_ipd_by_kmer_strand(..., size_t const offset, size_t const length, size_t const begin, size_t const end);
+    // Summing the results of segments must give the same counts as the whole chromosome.
+};
+
+TEST(kmer_ipd_segment, k3l2)
+{
+    size_t k = 3;
+    size_t outside_length = 2;
+    int check_outside_coverage = 1;
+    std::vector<double> whole;
+    std::vector<size_t> whole_count;
+    collect(k, outside_length, check_outside_coverage, whole, whole_count);
+    // Uneven segments, including ones shorter than k-mers
+    size_t const segments[6][2] = {{0, 1}, {1, 20}, {20, 21}, {21, 100}, {100, 173}, {173, dim / 2}};
+    std::vector<double> segmented;
+    std::vector<size_t> segmented_count;
+    collect_segments(k, outside_length, check_outside_coverage, segments, 6, segmented, segmented_count);
+    size_t total_count = 0;
+    for (size_t j = 0; j < whole_count.size(); j++) {
+        CHECK_EQUAL(whole_count[j], segmented_count[j]);
+        total_count += whole_count[j];
+    }
+    for (size_t j = 0; j < whole.size(); j++) {
+        DOUBLES_EQUAL(whole[j], segmented[j], tolerance);
+    }
+    CHECK(total_count > 0);
+}
+
+TEST(kmer_ipd_segment, complementary_regions)
+{
+    // Intervals of --regions are in base pairs, and a k-mer is collected if its last base in the direction of its strand is in an interval.
+    // Complementary sets of intervals partition the k-mers of the chromosome, even if an interval is shorter than k-mers or exceeds the chromosome
+    // (clipped to it as collect_ipd does), and each interval is given only the data around it.
+    size_t k = 4;
+    size_t outside_length = 3;
+    int check_outside_coverage = 1;
+    size_t n = dim / 2;
+    size_t const intervals[2][3][2] = {
+        {{0, 7}, {31, 32}, {90, 150}},
+        {{7, 31}, {32, 90}, {150, n + 60}},
+    };
+    std::vector<double> whole;
+    std::vector<size_t> whole_count;
+    collect(k, outside_length, check_outside_coverage, whole, whole_count);
+    std::vector<double> sums[2];
+    std::vector<size_t> counts[2];
+    for (int r = 0; r < 2; r++) {
+        size_t segments[3][2];
+        for (size_t x = 0; x < 3; x++) {
+            segments[x][0] = intervals[r][x][0];
+            segments[x][1] = (intervals[r][x][1] < n) ? intervals[r][x][1] : n;
+        }
+        collect_segments(k, outside_length, check_outside_coverage, segments, 3, sums[r], counts[r]);
+    }
+    size_t region_count[2] = {0, 0};
+    for (size_t j = 0; j < whole_count.size(); j++) {
+        CHECK_EQUAL(whole_count[j], counts[0][j] + counts[1][j]);
+        region_count[0] += counts[0][j];
+        region_count[1] += counts[1][j];
+    }
+    for (size_t j = 0; j < whole.size(); j++) {
+        DOUBLES_EQUAL(whole[j], sums[0][j] + sums[1][j], tolerance);
+    }
+    CHECK(region_count[0] > 0);
+    CHECK(region_count[1] > 0);
+}
+
+TEST_GROUP_BASE(derive, random_kinetics)
+{
+    // Tests for derive_ipd_table
+
+    // Collect IPD of the whole input into a dense table of k-mers of length k
+    void collect_table(size_t const k, size_t const outside_length, struct ipd_table *table)
+    {
+        std::vector<double> sums;
+        std::vector<size_t> count;
+        collect(k, outside_length, 1, sums, count);
+        size_t size = count.size();
+        alloc_ipd_table(table, size / (k + 2 * outside_length), k + 2 * outside_length, 0);
+        clear_ipd_table(table);
+        for (size_t j = 0; j < size; j++) {
+            struct ipd_cell *cell = &table->cells[j];
+            cell->tMean_sum = sums[j];
+            cell->prediction_log2_sq_sum = sums[7 * size + j];
+            cell->count = count[j];
+        }
+    }
+};
+
+TEST(derive, shorter_k_and_outside_length)
+{
+    // A shorter outside length is exactly a part of each row
+    struct ipd_table source;
+    struct ipd_table direct;
+    struct ipd_table derived;
+    collect_table(3, 4, &source);
+    collect_table(3, 2, &direct);
+    alloc_ipd_table(&derived, direct.kmers_size, direct.row_length, 1);
+    clear_ipd_table(&derived);
+    derive_ipd_table(&derived, 3, 2, &source, 3, 4, 4, 0);
+    for (size_t kmer = 0; kmer < direct.kmers_size; kmer++) {
+        struct ipd_cell const *d = find_ipd_table_row(&direct, kmer);
+        struct ipd_cell const *e = find_ipd_table_row(&derived, kmer);
+        for (size_t j = 0; j < direct.row_length; j++) {
+            CHECK_EQUAL(d[j].count, (e == NULL) ? 0 : e[j].count);
+            CHECK_EQUAL(d[j].tMean_sum, (e == NULL) ? 0.0 : e[j].tMean_sum);
+        }
+    }
+    free_ipd_table(&direct);
+    free_ipd_table(&derived);
+    // Shorter k-mers are observed only where the dropped bases are covered, and the counts are conserved
+    collect_table(2, 1, &direct);
+    alloc_ipd_table(&derived, direct.kmers_size, direct.row_length, 0);
+    clear_ipd_table(&derived);
+    derive_ipd_table(&derived, 2, 1, &source, 3, 4, 4, 1);
+    size_t source_count = 0;
+    size_t derived_count = 0;
+    size_t missing_count = 0;
+    for (size_t kmer = 0; kmer < source.kmers_size; kmer++) {
+        for (size_t j = 0; j < direct.row_length; j++) {
+            // The window of the 2-mer from the second base of the 3-mer starts from the 4th cell of the source row
+            source_count += source.cells[kmer * source.row_length + 4 + j].count;
+        }
+    }
+    for (size_t j = 0; j < direct.kmers_size * direct.row_length; j++) {
+        CHECK(derived.cells[j].count <= direct.cells[j].count);
+        derived_count += derived.cells[j].count;
+        missing_count += direct.cells[j].count - derived.cells[j].count;
+    }
+    CHECK_EQUAL(source_count, derived_count);
+    CHECK(derived_count > 0);
+    CHECK(missing_count > 0);
+    free_ipd_table(&direct);
+    free_ipd_table(&derived);
+    free_ipd_table(&source);
+}
+
+TEST_GROUP_BASE(simd, random_kinetics)
+{
+    // Tests for set_ipd_simd_level
+};
+
+TEST(simd, same_as_scalar)
+{
+    // Every instruction set must give exactly the same sums as the scalar code.
+    std::vector<double> scalar;
+    std::vector<double> vectorized;
+    std::vector<size_t> scalar_count;
+    std::vector<size_t> vectorized_count;
+    LONGS_EQUAL(IPD_SIMD_NONE, set_ipd_simd_level(IPD_SIMD_NONE));
+    collect(2, 5, 0, scalar, scalar_count);
+    for (int level = IPD_SIMD_SSE4; level <= IPD_SIMD_AVX2; level++) {
+        if (set_ipd_simd_level(level) != level) {
+            continue;
+        }
+        collect(2, 5, 0, vectorized, vectorized_count);
+        check_same(scalar, scalar_count, vectorized, vectorized_count);
+    }
+    set_ipd_simd_level(IPD_SIMD_AVX2);
+}
+
+TEST_GROUP_BASE(specialized_kernels, random_kinetics)
+{
+    // Tests for set_ipd_specialized_kernels
+};
+
+TEST(specialized_kernels, same_as_generic)
+{
+    // Kernels specialized for (k, outside_length) must give exactly the same sums as the generic kernel.
+    size_t const outside_lengths[] = {10, 20};
+    std::vector<double> generic;
+    std::vector<double> specialized;
+    std::vector<size_t> generic_count;
+    std::vector<size_t> specialized_count;
+    for (int level = IPD_SIMD_NONE; level <= IPD_SIMD_AVX2; level++) {
+        if (set_ipd_simd_level(level) != level) {
+            continue;
+        }
+        for (size_t k = 1; k <= 6; k++) {
+            for (size_t o = 0; o < 2; o++) {
+                set_ipd_specialized_kernels(0);
+                collect(k, outside_lengths[o], 1, generic, generic_count);
+                set_ipd_specialized_kernels(1);
+                collect(k, outside_lengths[o], 1, specialized, specialized_count);
+                check_same(generic, generic_count, specialized, specialized_count);
+            }
+        }
+    }
+    set_ipd_simd_level(IPD_SIMD_AVX2);
+}
+
+TEST_GROUP_BASE(stats, random_kinetics)
+{
+    // Tests for parse_stat_list and set_ipd_stats
+};
+
+TEST(stats, selection)
+{
+    // Each selection of statistics must give exactly the same sums as all of them for the selected ones, and leave the others 0.
+    int stats = 0;
+    CHECK(parse_stat_list("ipd,pred_log2", &stats));
+    LONGS_EQUAL(IPD_STAT_IPD | IPD_STAT_PRED_LOG2, stats);
+    CHECK(!parse_stat_list("ipd,", &stats));
+    CHECK(!parse_stat_list("ipd_sum", &stats));
+    int const groups[8] = {IPD_STAT_IPD, IPD_STAT_IPD, IPD_STAT_IPD_LOG2, IPD_STAT_IPD_LOG2,
+        IPD_STAT_PRED, IPD_STAT_PRED, IPD_STAT_PRED_LOG2, IPD_STAT_PRED_LOG2};
+    size_t const ks[2] = {2, 4};
+    size_t const outside_lengths[2] = {3, 20};
+    std::vector<double> all;
+    std::vector<double> selected;
+    std::vector<size_t> all_count;
+    std::vector<size_t> selected_count;
+    for (int level = IPD_SIMD_NONE; level <= IPD_SIMD_AVX2; level++) {
+        if (set_ipd_simd_level(level) != level) {
+            continue;
+        }
+        for (int x = 0; x < 2; x++) {
+            set_ipd_stats(IPD_STAT_ALL);
+            collect(ks[x], outside_lengths[x], 1, all, all_count);
+            size_t array_size = all_count.size();
+            for (int selection = 1; selection < IPD_STAT_ALL; selection++) {
+                std::vector<double> expected(all);
+                for (size_t s = 0; s < 8; s++) {
+                    if (!(selection & groups[s])) {
+                        for (size_t j = 0; j < array_size; j++) {
+                            expected[s * array_size + j] = 0.0;
+                        }
+                    }
+                }
+                set_ipd_stats(selection);
+                collect(ks[x], outside_lengths[x], 1, selected, selected_count);
+                check_same(expected, all_count, selected, selected_count);
+            }
+        }
+    }
+    set_ipd_stats(IPD_STAT_ALL);
+    set_ipd_simd_level(IPD_SIMD_AVX2);
+}
+
+TEST_GROUP(ipd_table)
+{
+    // Tests for sparse tables, which must hold the same sums as dense tables
+    static const size_t kmers_size = 1 << 16;
+    static const size_t row_length = 3;
+    struct ipd_table dense;
+    struct ipd_table sparse;
+
+    void setup()
+    {
+        alloc_ipd_table(&dense, kmers_size, row_length, 0);
+        alloc_ipd_table(&sparse, kmers_size, row_length, 1);
+        clear_ipd_table(&dense);
+        clear_ipd_table(&sparse);
+    }
+
+    void teardown()
+    {
+        free_ipd_table(&dense);
+        free_ipd_table(&sparse);
+    }
+
+    // Add values to n pseudo-random k-mers, which are enough to make the sparse table grow
+    void fill(struct ipd_table *table, unsigned int seed, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            seed = seed * 1103515245 + 12345;
+            size_t kmer = (seed >> 8) % kmers_size;
+            struct ipd_cell *row = get_ipd_table_row(table, kmer);
+            row[i % row_length].tMean_sum += i * 0.5;
+            row[i % row_length].prediction_log2_sq_sum += 1.0;
+            row[i % row_length].count += 1;
+        }
+    }
+};
+
+TEST(ipd_table, sparse)
+{
+    fill(&dense, 1, 5000);
+    fill(&sparse, 1, 5000);
+    CHECK(sparse.slot_num > 1024);
+    // Sum of two tables
+    struct ipd_table other;
+    alloc_ipd_table(&other, kmers_size, row_length, 1);
+    clear_ipd_table(&other);
+    fill(&other, 2, 3000);
+    add_ipd_table(&dense, &other);
+    add_ipd_table(&sparse, &other);
+    free_ipd_table(&other);
+    size_t observed = 0;
+    for (size_t kmer = 0; kmer < kmers_size; kmer++) {
+        struct ipd_cell const *d = find_ipd_table_row(&dense, kmer);
+        struct ipd_cell const *s = find_ipd_table_row(&sparse, kmer);
+        if (s == NULL) {
+            for (size_t j = 0; j < row_length; j++) {
+                CHECK_EQUAL(0, d[j].count);
+            }
+            continue;
+        }
+        observed++;
+        for (size_t j = 0; j < row_length; j++) {
+            CHECK_EQUAL(d[j].count, s[j].count);
+            CHECK_EQUAL(d[j].tMean_sum, s[j].tMean_sum);
+            CHECK_EQUAL(d[j].prediction_log2_sq_sum, s[j].prediction_log2_sq_sum);
+        }
+    }
+    CHECK_EQUAL(sparse.used_num, observed);
+    clear_ipd_table(&sparse);
+    CHECK_EQUAL(0, sparse.used_num);
+    CHECK(find_ipd_table_row(&sparse, 0) == NULL);
+}
+
+
+TEST(ipd_table, partial)
+{
+    // Rows written to a partial file are summed back into the same values
+    fill(&dense, 1, 5000);
+    fill(&sparse, 2, 3000);
+    char const *path = "test.tmp.partial";
+    struct ipd_output output;
+    // k = 1 and outside_length = 1 give row_length = 3
+    open_ipd_output(&output, FORMAT_PARTIAL, path, 1, 1, 4, "ACGT", kmers_size, IPD_STAT_ALL, 0, 1, 2);
+    write_ipd_output(&output, "c1", 0, 5, &dense, 1);
+    write_ipd_output(&output, "c2", 1, 0, &sparse, 0);
+    close_ipd_output(&output);
+
+    FILE *fp = fopen(path, "rb");
+    CHECK(fp != NULL);
+    struct partial_header header;
+    read_partial_header(fp, path, &header);
+    CHECK_EQUAL(kmers_size, header.kmers_size);
+    CHECK_EQUAL(row_length, header.row_length);
+    CHECK_EQUAL(1, header.shard_index);
+    CHECK_EQUAL(2, header.shard_num);
+    STRCMP_EQUAL("ACGT", header.chars);
+    struct partial_entry entries[2];
+    CHECK_EQUAL(1, read_partial_entry(fp, path, row_length, &entries[0]));
+    CHECK_EQUAL(1, read_partial_entry(fp, path, row_length, &entries[1]));
+    CHECK_EQUAL(0, read_partial_entry(fp, path, row_length, &entries[1]));
+    STRCMP_EQUAL("c1", entries[0].name);
+    CHECK_EQUAL(5, entries[0].chromosome_index);
+    STRCMP_EQUAL("c2", entries[1].name);
+    CHECK_EQUAL(1, entries[1].file_index);
+    CHECK_EQUAL(sparse.used_num, entries[1].row_num);
+
+    struct ipd_table merged;
+    alloc_ipd_table(&merged, kmers_size, row_length, 1);
+    clear_ipd_table(&merged);
+    add_partial_rows(fp, path, &entries[1], &merged);
+    add_partial_rows(fp, path, &entries[0], &merged);
+    add_ipd_table(&dense, &sparse);
+    for (size_t kmer = 0; kmer < kmers_size; kmer++) {
+        struct ipd_cell const *d = find_ipd_table_row(&dense, kmer);
+        struct ipd_cell const *m = find_ipd_table_row(&merged, kmer);
+        for (size_t j = 0; j < row_length; j++) {
+            CHECK_EQUAL(d[j].count, (m != NULL) ? m[j].count : 0);
+            CHECK_EQUAL(d[j].tMean_sum, (m != NULL) ? m[j].tMean_sum : 0.0);
+        }
+    }
+    free_ipd_table(&merged);
+    free(entries[0].name);
+    free(entries[1].name);
+    free(header.chars);
+    fclose(fp);
+    remove(path);
+}
+
+TEST_GROUP(output)
+{
+    // Tests for the CSV header, which is written once per input file, and for the lists of k
+};
+
+TEST(output, header_per_file)
+{
+    // The first chromosome of each file is skipped as by regions without intervals on it
+    char const *path = "test.tmp.csv";
+    struct ipd_table table;
+    alloc_ipd_table(&table, 4, 1, 0);
+    clear_ipd_table(&table);
+    struct ipd_output output;
+    open_ipd_output(&output, FORMAT_CSV, path, 1, 0, 4, "ACGT", 4, IPD_STAT_IPD, 0, 0, 1);
+    size_t const written[3][2] = {{0, 1}, {0, 2}, {1, 3}};
+    for (size_t x = 0; x < 3; x++) {
+        CHECK_EQUAL(x != 1, starts_output_file(&output, written[x][0]));
+        write_ipd_output(&output, "c", written[x][0], written[x][1], &table, starts_output_file(&output, written[x][0]));
+    }
+    close_ipd_output(&output);
+    free_ipd_table(&table);
+
+    FILE *fp = fopen(path, "r");
+    CHECK(fp != NULL);
+    char line[256];
+    size_t line_num = 0;
+    size_t header_lines[2] = {SIZE_MAX, SIZE_MAX};
+    size_t header_num = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "kmer_string,", 12) == 0) {
+            CHECK(header_num < 2);
+            header_lines[header_num++] = line_num;
+        }
+        line_num++;
+    }
+    fclose(fp);
+    remove(path);
+    // Each chromosome has 4 rows of 1-mers
+    CHECK_EQUAL(2, header_num);
+    CHECK_EQUAL(0, header_lines[0]);
+    CHECK_EQUAL(9, header_lines[1]);
+    CHECK_EQUAL(14, line_num);
+}
+
+TEST(output, k_list)
+{
+    size_t *ks = NULL;
+    size_t k_num = 0;
+    CHECK(parse_k_list("3-4,1,3", &ks, &k_num));
+    CHECK_EQUAL(3, k_num);
+    CHECK_EQUAL(1, ks[0]);
+    CHECK_EQUAL(3, ks[1]);
+    CHECK_EQUAL(4, ks[2]);
+    // Invalid or oversized lists leave ks as it is
+    CHECK(!parse_k_list("2-1", &ks, &k_num));
+    CHECK(!parse_k_list("1-1000000000", &ks, &k_num));
+    CHECK(parse_k_list("32", &ks, &k_num));
+    CHECK(!parse_k_list("33", &ks, &k_num));
+    CHECK_EQUAL(1, k_num);
+    CHECK_EQUAL(32, ks[0]);
+    free(ks);
+}
+
+TEST_GROUP(format)
+{
+    char buffer[IPD_DOUBLE_BUFFER_SIZE];
+
+    void check_format(double const value, char const *expected)
+    {
+        // format_double does not terminate the string
+        size_t const length = format_double(value, buffer);
+        buffer[length] = '\0';
+        CHECK_EQUAL(strlen(expected), length);
+        STRCMP_EQUAL(expected, buffer);
+    }
+};
+
+TEST(format, shortest)
+{
+    check_format(0.0, "0");
+    check_format(-0.0, "-0");
+    check_format(0.1, "0.1");
+    check_format(1.5, "1.5");
+    check_format(-2.25, "-2.25");
+    check_format(123456.0, "123456");
+    check_format(1.5e-07, "1.5e-07");
+    check_format(1e+22, "1e+22");
+    check_format(5e-324, "5e-324");
+    check_format(1.7976931348623157e+308, "1.7976931348623157e+308");
+    buffer[format_size(0, buffer)] = '\0';
+    STRCMP_EQUAL("0", buffer);
+    buffer[format_size(18446744073709551615ULL, buffer)] = '\0';
+    STRCMP_EQUAL("18446744073709551615", buffer);
+}
+
+TEST(format, round_trip)
+{
+    // xorshift64 over raw bit patterns covers every exponent
+    uint64_t state = 88172645463325252ULL;
+    for (int i = 0; i < 100000; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        double value;
+        memcpy(&value, &state, sizeof(value));
+        if (!std::isfinite(value)) {
+            continue;
+        }
+        buffer[format_double(value, buffer)] = '\0';
+        double const parsed = strtod(buffer, NULL);
+        CHECK(memcmp(&value, &parsed, sizeof(value)) == 0);
+    }
+}
+
+
 
 int main(int ac, char** av)
 {